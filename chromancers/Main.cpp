@@ -1,6 +1,11 @@
 // std libraries
 #include <string>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <chrono>
+#include <cstdio>
+#include <format>
 
 #include <gsl/gsl>
 
@@ -31,6 +36,8 @@
 #include "utils/physics.h"
 #include "utils/input.h"
 #include "utils/framebuffer.h"
+#include "utils/render_graph.h"
+#include "utils/uniform_buffer.h"
 #include "utils/random.h"
 
 #include "utils/scene/camera.h "
@@ -38,6 +45,11 @@
 #include "utils/scene/scene.h  "
 #include "utils/scene/light.h  "
 #include "utils/scene/player.h "
+#include "utils/scene/paint_persistence.h"
+#include "utils/scene/splat_log.h"
+#include "utils/scene/shadow_scheduler.h"
+#include "utils/scene/light_clusters.h"
+#include "utils/query.h"
 
 #include "utils/components/rigidbody_component.h"
 #include "utils/components/paintable_component.h"
@@ -60,9 +72,8 @@ namespace
 Window* wdw_ptr;
 Window::window_size ws;
 
-// Framebuffers
-std::vector<Framebuffer*> fullscreen_framebuffers; 
-Framebuffer* map_framebuffer_ptr; // This framebuffer will be used to display an birds-eye view of the world centered on the player
+// Render graph, owning every framebuffer used to draw a frame
+RenderGraph* render_graph_ptr;
 
 // callback function for keyboard events
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mode);
@@ -88,6 +99,7 @@ float capped_deltaTime;
 std::function<void()> scene_setup;
 Player player;
 bool hold_to_fire = true;
+PaintPersistence* paint_persistence_ptr;
 
 // parameters for time computation
 float deltaTime = 0.0f;
@@ -175,6 +187,10 @@ void setup_input_keys()
 		// Reset scene transforms to starting positions
 		Input::instance().add_onRelease_callback(GLFW_KEY_R, [&]() { scene_setup(); });
 
+		// Save and load paintmaps
+		Input::instance().add_onRelease_callback(GLFW_KEY_F5, [&]() { paint_persistence_ptr->save(); });
+		Input::instance().add_onRelease_callback(GLFW_KEY_F9, [&]() { paint_persistence_ptr->load(); });
+
 		// Draw wireframe or filled
 		Input::instance().add_onRelease_callback(GLFW_KEY_L, [&]()
 			{
@@ -230,12 +246,8 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 	ws.width = width;
 	ws.height = height;
 	
-	// Resize all screensized framebuffers
-	for (auto f : fullscreen_framebuffers)
-	{
-		f->resize(width, height);
-	}
-	map_framebuffer_ptr->resize(width / map_framebuffer_divisor, height / map_framebuffer_divisor);
+	// Resize all the framebuffers of the render graph (the map one keeps its divisor)
+	render_graph_ptr->resize(width, height);
 
 	// Paintballs blur depends on framebuffer size so we need to adjust blur strength on resize
 	paintblur_shader_blurstrength = std::powf(static_cast<float>(ws.width * ws.height), 0.16f);
@@ -299,26 +311,49 @@ int main()
 	// Shader and lights setup
 
 	// Utils shaders are common types, constants and functions that can be added on top of other compiled shaders
-	std::vector<const GLchar*> utils_shaders { "shaders/types.glsl", "shaders/constants.glsl" };
+	// (uniform_blocks.glsl declares the per-frame camera and lights blocks, uploaded once per frame for all the shaders)
+	std::vector<const GLchar*> utils_shaders { "shaders/constants.glsl", "shaders/types.glsl", "shaders/uniform_blocks.glsl" };
 
 	// Basic shaders for debugging purposes
-	Shader basic_mvp_shader      { "basic_mvp_shader", "shaders/text/generic/mvp.vert", "shaders/text/generic/basic.frag", 4, 3 };
-	Shader debug_shader          { "debug_shader", "shaders/text/generic/mvp.vert", "shaders/text/generic/fullcolor.frag", 4, 3 };
+	Shader basic_mvp_shader      { "basic_mvp_shader", "shaders/text/generic/mvp.vert", "shaders/text/generic/basic.frag", 4, 3, nullptr, utils_shaders };
+	Shader debug_shader          { "debug_shader", "shaders/text/generic/mvp.vert", "shaders/text/generic/fullcolor.frag", 4, 3, nullptr, utils_shaders };
 
 	// Lit shaders, will take into account point and directional lights for shading calculations as well as materials
 	Shader default_lit_shader    { "default_lit", "shaders/text/default_lit.vert", "shaders/text/default_lit.frag", 4, 3, nullptr, utils_shaders };
 	Shader default_lit_instanced { "default_lit_instanced", "shaders/text/default_lit_instanced.vert", "shaders/text/default_lit.frag", 4, 3, nullptr, utils_shaders };
 
+	// Multi-draw variant of the default lit shader, drawing many independent entities per call (needs GLSL 4.60 for gl_DrawID)
+	std::vector<const GLchar*> multi_draw_utils_shaders { utils_shaders };
+	multi_draw_utils_shaders.push_back("shaders/multi_draw.glsl");
+	Shader default_lit_multi_draw{ "default_lit_multi_draw", "shaders/text/default_lit.vert", "shaders/text/default_lit.frag", 4, 6, nullptr, multi_draw_utils_shaders };
+	main_scene.set_multi_draw_shader(default_lit_shader, default_lit_multi_draw);
+
+	// Depth of the opaque entities filled before shading them, so each visible fragment is shaded once
+	// The prepass draws with the lit programs themselves in depth only mode, along the same (multi-)draw path, so the depths match exactly
+	bool use_depth_prepass = true;
+	PipelineStatisticsQuery lit_fragments_query{ GL_FRAGMENT_SHADER_INVOCATIONS };
+	GLuint64 lit_fragments[2]{ 0, 0 }; // shaded by the world pass, without and with the prepass
+
 	// Simple shader that applies a texture to a volume (especially used for full-screen quads)
 	Shader textured_shader       { "textured_shader", "shaders/text/generic/textured.vert" , "shaders/text/generic/textured.frag", 4, 3 };
 
 	// Shader for paintable objects, will load/store color values onto a paintmap
-	Shader painter_shader        { "painter_shader", "shaders/text/generic/texpainter.vert" , "shaders/text/generic/texpainter.frag", 4, 3 };
+	Shader painter_shader        { "painter_shader", "shaders/text/generic/texpainter.vert" , "shaders/text/generic/texpainter.frag", 4, 3, nullptr, utils_shaders };
 
 	// Shaders for shadowmap calculation, respectively for directional lights and for point lights
 	Shader shadowmap_shader      { "shadowmap_shader", "shaders/text/generic/shadow_map.vert" , "shaders/text/generic/shadow_map.frag", 4, 3 };
 	Shader shadowcube_shader     { "shadowcube_shader", "shaders/text/generic/shadow_cube.vert" , "shaders/text/generic/shadow_cube.frag", 4, 3, "shaders/text/generic/shadow_cube.geom" };
 
+	// Point light shaders drawing the casters only into the cube faces they overlap, without geometry shader
+	// (the layered one selects the face from the vertex shader, which needs ARB_shader_viewport_layer_array)
+	Shader shadowcube_face_shader{ "shadowcube_face_shader", "shaders/text/generic/shadow_cube_face.vert" , "shaders/text/generic/shadow_cube.frag", 4, 3 };
+	// Instanced depth-only variants, letting the paintballs cast shadows without going through the lit pipeline
+	Shader shadowmap_instanced_shader { "shadowmap_instanced_shader", "shaders/text/generic/shadow_map_instanced.vert" , "shaders/text/generic/shadow_map.frag", 4, 3 };
+	Shader shadowcube_instanced_shader{ "shadowcube_instanced_shader", "shaders/text/generic/shadow_cube_instanced.vert" , "shaders/text/generic/shadow_cube.frag", 4, 3, "shaders/text/generic/shadow_cube.geom" };
+	std::optional<Shader> shadowcube_layered_shader;
+	if (has_extension("GL_ARB_shader_viewport_layer_array"))
+		shadowcube_layered_shader.emplace("shadowcube_layered_shader", "shaders/text/generic/shadow_cube_layered.vert", "shaders/text/generic/shadow_cube.frag", 4, 3);
+
 	// Shaders for post-processing effects on the paintballs, to make them look more organic instead of single particles
 	Shader paintblur_shader      { "paintblur_shader", "shaders/text/generic/postprocess.vert" , "shaders/text/generic/paintblur.frag", 4, 3 };
 	Shader paintstep_shader      { "paintstep_shader", "shaders/text/generic/postprocess.vert" , "shaders/text/generic/paintstep.frag", 4, 3 };
@@ -326,23 +361,36 @@ int main()
 	// Shader for merging two framebuffers into one, using their color and depth buffers as textures to determine the resulting fragments
 	Shader mergefbo_shader       { "mergefbo_shader", "shaders/text/generic/postprocess.vert" , "shaders/text/generic/merge_fbo.frag", 4, 3 };
 
+	// Shader fusing the last blur pass, the paintstep and the merge of the paintballs onto the world in a single pass
+	Shader paint_composite_shader{ "paint_composite_shader", "shaders/text/generic/postprocess.vert" , "shaders/text/generic/paint_composite.frag", 4, 3 };
+
 	// Bundling up shaders in collections to later perform shader uniform setting operations in bulk
-	std::vector <std::reference_wrapper<Shader>> lit_shaders, all_shaders;
-	lit_shaders.push_back(default_lit_shader); lit_shaders.push_back(default_lit_instanced); 
-	all_shaders.push_back(basic_mvp_shader); all_shaders.push_back(default_lit_shader); all_shaders.push_back(default_lit_instanced); 
+	std::vector <std::reference_wrapper<Shader>> lit_shaders;
+	lit_shaders.push_back(default_lit_shader); lit_shaders.push_back(default_lit_instanced); lit_shaders.push_back(default_lit_multi_draw);
 
 	// Lights and shadowmaps setup 
 	std::vector<unsigned int> shadowmap_res{128, 256, 512, 1024, 2048, 4096};
-	unsigned int current_dl_res = shadowmap_res[4];
+	unsigned int current_dl_res = shadowmap_res[3]; // per cascade
 	unsigned int current_pl_res = shadowmap_res[2];
 
 	DirectionalLight::ShadowMapSettings dir_sm_settings;
 	dir_sm_settings.resolution = current_dl_res;
 	dir_sm_settings.shader = &shadowmap_shader;
+	dir_sm_settings.instanced_shader = &shadowmap_instanced_shader;
 
 	PointLight::ShadowMapSettings pl_sm_settings;
 	pl_sm_settings.resolution = current_pl_res;
 	pl_sm_settings.shader = &shadowcube_shader;
+	pl_sm_settings.face_shader = &shadowcube_face_shader;
+	pl_sm_settings.instanced_shader = &shadowcube_instanced_shader;
+	pl_sm_settings.layered_shader = shadowcube_layered_shader ? &shadowcube_layered_shader.value() : nullptr;
+	pl_sm_settings.path = shadowcube_layered_shader ? PointLight::CubeShadowPath::layered : PointLight::CubeShadowPath::per_face;
+	int current_pl_path = static_cast<int>(pl_sm_settings.path);
+
+	// Shadow lookups compare in hardware (each fetch is a bilinear 2x2 PCF), the filter picks how many fetches a directional lookup takes
+	int current_shadow_format = static_cast<int>(ShadowFormat::depth32f);
+	int shadow_filter = 1; // SHADOW_FILTER_PCF3X3
+	bool point_shadow_pcf = false;
 
 	PointLight pl1 { glm::vec3{-8.0f, 2.0f, 2.5f}, glm::vec4{1, 0, 1, 1}, 0.5f, pl_sm_settings};
 	PointLight pl2 { glm::vec3{-8.0f, 2.0f, 7.5f}, glm::vec4{0, 1, 1, 1}, 0.5f, pl_sm_settings};
@@ -359,19 +407,36 @@ int main()
 
 	if(point_lights.size() > 0) currentLight = point_lights[0];
 
-	// Shader uniform commons and constants setup
-	for (Shader& shader : all_shaders)
+	// Shadowmap updates are spread over the frames within a texel budget, directional lights first on equal priority
+	ShadowScheduler shadow_scheduler;
+	std::vector<Light*> shadow_lights;
+	shadow_lights.insert(shadow_lights.end(), dir_lights.begin(), dir_lights.end());
+	shadow_lights.insert(shadow_lights.end(), point_lights.begin(), point_lights.end());
+
+	// Paint glows, small colored lights hovering over the floor without shadows, shaded through the light clusters
+	const size_t max_glow_lights = 64;
+	int glow_lights_amount = 48;
+	float glow_intensity = 0.6f;
+	std::vector<ClusteredLight> glow_lights;
+	std::vector<float> glow_phases;
+	for (size_t i = 0; i < max_glow_lights; i++)
 	{
-		shader.bind();
-		shader.setMat4("projectionMatrix", main_scene.current_camera->projectionMatrix());
-		shader.setVec3("wCameraPos", main_scene.current_camera->position());
+		glm::vec4 glow_color{ rng.get_float(), rng.get_float(), rng.get_float(), 1.f };
+		glow_color /= std::max({ glow_color.r, glow_color.g, glow_color.b, 0.01f });
+		glow_lights.emplace_back(glm::vec3{ rng.get_float(-11.f, 11.f), 0.f, rng.get_float(-11.f, 11.f) }, glow_color, glow_intensity);
+		glow_phases.push_back(rng.get_float(0.f, 6.28f));
 	}
-	for (Shader& lit_shader : lit_shaders)
+	std::vector<ClusteredLight*> clustered_lights;
+	auto gather_glow_lights = [&]()
 	{
-		lit_shader.bind();
-		lit_shader.setUint("nPointLights", gsl::narrow<unsigned int>(point_lights.size()));
-		lit_shader.setUint("nDirLights", gsl::narrow<unsigned int>(dir_lights.size()));
-	}
+		clustered_lights.clear();
+		for (int i = 0; i < glow_lights_amount; i++) clustered_lights.push_back(&glow_lights[i]);
+	};
+	gather_glow_lights();
+
+	// Camera and lights uniform blocks, shared by every shader through their fixed binding points
+	UniformBuffer<FrameData>  frame_ubo  { FRAME_DATA_BINDING, main_scene.current_camera->frame_data() };
+	UniformBuffer<LightsData> lights_ubo { LIGHTS_BINDING, LightsData{ point_lights, dir_lights } };
 
 	// Specific uniforms setup (we use these in imgui for interactability)
 	float paintstep_shader_t0_color = 0.1f, paintstep_shader_t1_color = 0.4f;
@@ -379,6 +444,39 @@ int main()
 	float paintblur_shader_depthoffset = 1.f;
 	bool paintblur_shader_ignore_alpha = false;
 	int paintblur_blurpasses = 4;
+	int paintballs_resolution_divisor = 1; // The paintballs and their post-processing can be rendered at 1/2 or 1/4 of the resolution
+
+	// Compute blur: a single wide gaussian pass per direction replacing the repeated 9-tap passes (which are kept as fallback)
+	bool paintblur_use_compute = true;
+	bool paint_fused_composite = true; // Fuse the end of the paintball chain (last blur pass, paintstep and merge) in a single pass
+	int paintblur_compute_radius = 8, paintblur_compute_shader_radius = -1; // kernel radius in texels (the shader is rebuilt with the kernel when it changes)
+	auto make_paintblur_compute_shader = [](int radius)
+	{
+		std::vector<float> kernel = utils::math::gaussian_kernel(radius, radius / 2.5f);
+
+		// Full precision and locale independent literals, so that the weights still sum to 1 in the shader
+		std::string weights;
+		for (size_t i = 0; i < kernel.size(); ++i)
+			weights += std::format("{}{:.9g}", i ? ", " : "", kernel[i]);
+		std::string kernel_source = 
+			"#define BLUR_RADIUS " + std::to_string(radius) + "\n" +
+			"const float blur_weights[BLUR_RADIUS + 1] = float[](" + weights + ");\n";
+
+		return Shader{ "paintblur_compute_shader", "shaders/text/generic/paintblur.comp", 4, 3, {}, kernel_source };
+	};
+	Shader paintblur_compute_shader = make_paintblur_compute_shader(paintblur_compute_radius);
+	paintblur_compute_shader_radius = paintblur_compute_radius;
+
+	// Compute shaders culling the paintball instances on the GPU, against the camera frustum and a Hi-Z pyramid of the world depth
+	Shader instance_cull_shader  { "instance_cull_shader", "shaders/text/generic/instance_cull.comp", 4, 3 };
+	Shader hiz_build_shader      { "hiz_build_shader", "shaders/text/generic/hiz_build.comp", 4, 3 };
+	GPUInstanceCuller instance_culler{ instance_cull_shader, hiz_build_shader };
+	main_scene.instance_culler = &instance_culler;
+	std::optional<Scene::CullingCheck> gpu_culling_check; // result of the last culling self-test, run from the UI
+
+	// Compute shader assigning the clustered lights to the clusters of the view frustum (reads the camera from the FrameData block)
+	Shader light_cluster_shader  { "light_cluster_shader", "shaders/text/generic/light_cluster.comp", 4, 3, utils_shaders };
+	LightClusters light_clusters{ light_cluster_shader };
 
 #pragma endregion shader_setup
 
@@ -440,6 +538,8 @@ int main()
 	// Model loading and scene entities emplacement
 	Model cube_model{ "models/cube.obj" }, sphere_model{ "models/sphere.obj" }, bunny_model{ "models/bunny.obj" };
 	Model gun_model{ "models/gun/gun.obj" }; Model paintball_model{ "models/drop_lowres.obj" }; 
+	Model paintball_shadow_model{ "models/drop_ultralowres.obj" }; // paintball groups cast shadows with the lowest detail drop
+	main_scene.set_shadow_model(paintball_model, paintball_shadow_model);
 	Model quad_mesh{ Mesh::simple_quad_mesh() };
 
 	Entity* cube        = main_scene.emplace_entity("cube", "brick_cube", cube_model, cube_material);
@@ -505,6 +605,10 @@ int main()
 		bunny->set_size(glm::vec3(.75f));
 		bunny->set_position(glm::vec3(5.0f, 3.0f, -2.0f));
 
+		// The sphere and the bunny are pushed around by the player, so they never join the cached static shadows
+		sphere->dynamic_shadow_caster = true;
+		bunny->dynamic_shadow_caster = true;
+
 		fountain->set_size(glm::vec3(0.1f));
 		fountain->set_orientation(glm::vec3(90.f, 0.0f, 0.0f));
 		fountain->set_position(glm::vec3(-12.0f, 2.0f, 5.f));
@@ -547,7 +651,7 @@ int main()
 	player.gun_entity = &gun;
 
 	// Physics setup
-	GLDebugDrawer phy_debug_drawer{ *main_scene.current_camera, debug_shader };
+	GLDebugDrawer phy_debug_drawer{ debug_shader };
 	physics_engine.addDebugDrawer(&phy_debug_drawer);
 	physics_engine.set_debug_mode(phy_debug_mode);
 
@@ -567,15 +671,28 @@ int main()
 		ColliderShapeCreateInfo{ ColliderShape::HULL, bunny->world_transform().size(), &bunny_mesh_vertices}}, false);
 
 	// Paintable entities setup (an entity that has a paintmap, thus its appearance can be changed by paintballs)
-	test_cube      ->emplace_component<PaintableComponent>(painter_shader, 128, 128, &splat_tex, &splat_normal_tex);
-	wall_plane     ->emplace_component<PaintableComponent>(painter_shader, 512, 512, &splat_tex, &splat_normal_tex);
-	cube           ->emplace_component<PaintableComponent>(painter_shader, 128, 128, &splat_tex, &splat_normal_tex);
-	floor_plane    ->emplace_component<PaintableComponent>(painter_shader, 2048, 2048, &splat_tex, &splat_normal_tex);
-	bunny          ->emplace_component<PaintableComponent>(painter_shader, 256, 256, &splat_tex, &splat_normal_tex);
+	// Paintmap sizes are derived from the texel density needed on each entity surface, then fit into a memory budget
+	PaintmapSizing paintmap_sizing{ 16.f, 64, 4096 };
+	size_t paintmaps_memory_budget = 32 * 1024 * 1024;
+
+	// Every paintmap is packed in the paint atlas, which applies the splats of all paintables in batches
+	PaintAtlas paint_atlas{ painter_shader, splat_tex };
+
+	test_cube      ->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+	wall_plane     ->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+	cube           ->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+	floor_plane    ->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex, PaintmapFormat::PALETTE_RG8);
+	bunny          ->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
 
-	left_room_lwall->emplace_component<PaintableComponent>(painter_shader, 512, 512, &splat_tex, &splat_normal_tex);
-	left_room_rwall->emplace_component<PaintableComponent>(painter_shader, 512, 512, &splat_tex, &splat_normal_tex);
-	left_room_bwall->emplace_component<PaintableComponent>(painter_shader, 512, 512, &splat_tex, &splat_normal_tex);
+	left_room_lwall->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+	left_room_rwall->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+	left_room_bwall->emplace_component<PaintableComponent>(paint_atlas, paintmap_sizing, &splat_normal_tex);
+
+	std::vector<PaintableComponent*> paintables = main_scene.find_components<PaintableComponent>();
+	PaintableComponent::apply_memory_budget(paintables, paintmaps_memory_budget, paintmap_sizing.min_size);
+	PaintableComponent::report(paintables);
+	paint_atlas.commit();
+	paint_atlas.report();
 
 	// Paintball spawners setup (an entity that generates paintballs)
 	PaintballSpawnerComponent* fountain_spawner = static_cast<PaintballSpawnerComponent*> 
@@ -621,38 +738,497 @@ int main()
 #pragma endregion entities_setup
 
 #pragma region framebuffers_setup
-	// Framebuffers setup
-	// This framebuffer will be used to display the entities from the whole scene except the paintballs
-	Framebuffer world_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
-	
-	// This framebuffer will be used to display the instanced paintball entities
-	Framebuffer paintballs_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
-	
-	// These framebuffers will be used for the "ping-pong" blur passes
-	Framebuffer postfxblur0_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
-	Framebuffer postfxblur1_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
-	
-	// This framebuffer will be used for the smoothstep effect of paintballs
-	Framebuffer paintstep_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
+	// Render graph setup: the framebuffers are render targets owned by the graph, which shares them between targets
+	// whose lifetimes in the frame don't overlap and skips the passes whose results are not needed
+	RenderGraph render_graph{ ws.width, ws.height };
+	render_graph_ptr = &render_graph;
+	int render_graph_blurpasses = -1, render_graph_paint_divisor = -1; // Paintball settings the graph was built with
+	bool render_graph_compute_blur = false, render_graph_fused_composite = false;
+
+	// Fused composite check: on request, the composite pass also runs the unfused passes on the same inputs (last blur pass if fused, paintstep
+	// and merge, in scratch framebuffers) and reads both results back, reporting the largest per-channel difference in 8 bit levels
+	bool paint_composite_check_requested = false;
+	int paint_composite_check_difference = -1; // -1 until checked
+	auto paint_composite_difference = [&](Framebuffer& world_fb, Framebuffer& paint_fb, Framebuffer& paintballs_fb, Framebuffer& fused_fb, bool fused_blur)
+	{
+		Texture::FormatInfo color_format{ GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE }, depth_format{ GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT };
+		Framebuffer blurred{ paint_fb.width(), paint_fb.height(), color_format, depth_format };
+		Framebuffer stepped{ paint_fb.width(), paint_fb.height(), color_format, depth_format };
+		Framebuffer merged { fused_fb.width(), fused_fb.height(), color_format, depth_format };
+		Framebuffer* paint = &paint_fb;
+
+		if (fused_blur)
+		{
+			blurred.bind();
+			paintblur_shader.bind();
+			glActiveTexture(GL_TEXTURE0); paint_fb.get_color_attachment().bind(); paintblur_shader.setInt("image", 0);
+			glActiveTexture(GL_TEXTURE1); paintballs_fb.get_depth_attachment().bind(); paintblur_shader.setInt("depth_image", 1);
+			paintblur_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+			paintblur_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+			paintblur_shader.setBool("horizontal", (paintblur_blurpasses - 1) % 2);
+			paintblur_shader.setFloat("blur_strength", paintblur_shader_blurstrength);
+			paintblur_shader.setFloat("depth_offset", paintblur_shader_depthoffset);
+			paintblur_shader.setBool("ignore_alpha", paintblur_shader_ignore_alpha);
+			quad_mesh.draw();
+			paintblur_shader.unbind();
+			blurred.unbind();
+			paint = &blurred;
+		}
+
+		stepped.bind();
+		paintstep_shader.bind();
+		glActiveTexture(GL_TEXTURE0); paint->get_color_attachment().bind(); paintstep_shader.setInt("image", 0);
+		paintstep_shader.setFloat("t0_color", paintstep_shader_t0_color);
+		paintstep_shader.setFloat("t1_color", paintstep_shader_t1_color);
+		paintstep_shader.setFloat("t0_alpha", paintstep_shader_t0_alpha);
+		paintstep_shader.setFloat("t1_alpha", paintstep_shader_t1_alpha);
+		quad_mesh.draw();
+		paintstep_shader.unbind();
+		stepped.unbind();
+
+		merged.bind();
+		mergefbo_shader.bind();
+		glActiveTexture(GL_TEXTURE0); world_fb.get_color_attachment().bind(); mergefbo_shader.setInt("fbo0_color", 0);
+		glActiveTexture(GL_TEXTURE1); world_fb.get_depth_attachment().bind(); mergefbo_shader.setInt("fbo0_depth", 1);
+		glActiveTexture(GL_TEXTURE2); stepped.get_color_attachment().bind(); mergefbo_shader.setInt("fbo1_color", 2);
+		glActiveTexture(GL_TEXTURE3); paintballs_fb.get_depth_attachment().bind(); mergefbo_shader.setInt("fbo1_depth", 3);
+		mergefbo_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+		mergefbo_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+		quad_mesh.draw();
+		mergefbo_shader.unbind();
+		merged.unbind();
+
+		// Synchronous readback, acceptable for a check run on demand
+		size_t size = size_t(merged.width()) * merged.height() * 4;
+		std::vector<unsigned char> fused(size), unfused(size);
+		glGetTextureImage(fused_fb.get_color_attachment().id(), 0, GL_RGBA, GL_UNSIGNED_BYTE, gsl::narrow<GLsizei>(size), fused.data());
+		glGetTextureImage(merged.get_color_attachment().id(), 0, GL_RGBA, GL_UNSIGNED_BYTE, gsl::narrow<GLsizei>(size), unfused.data());
+
+		std::array<int, 4> max_difference{};
+		for (size_t i = 0; i < size; i++)
+			max_difference[i % 4] = std::max(max_difference[i % 4], std::abs(int(fused[i]) - int(unfused[i])));
+		utils::io::info("PAINT COMPOSITE - max difference between fused and unfused (8 bit levels): R ", max_difference[0], ", G ", max_difference[1],
+			", B ", max_difference[2], ", A ", max_difference[3], fused_blur ? " (last blur pass fused)" : " (paintstep and merge fused)");
+		return *std::max_element(max_difference.begin(), max_difference.end());
+	};
+
+	auto build_render_graph = [&]()
+	{
+		render_graph.reset();
+		render_graph_blurpasses = paintblur_blurpasses;
+		render_graph_paint_divisor = paintballs_resolution_divisor;
+		render_graph_compute_blur = paintblur_use_compute;
+		render_graph_fused_composite = paint_fused_composite;
+
+		// The paintball chain targets share the paintballs resolution
+		RenderGraph::TargetDesc paint_desc{ .size_divisor = gsl::narrow<unsigned int>(paintballs_resolution_divisor) };
+
+		// This target will be used to display the entities from the whole scene except the paintballs
+		auto world_target = render_graph.create_target("world");
+		// This target will be used to display the instanced paintball entities
+		auto paintballs_target = render_graph.create_target("paintballs", paint_desc);
+		// This target will be used for the smoothstep effect of paintballs
+		auto paintstep_target = render_graph.create_target("paintstep", paint_desc);
+		// This target will be used to group the world and paintballs
+		auto present_target = render_graph.create_target("present");
+		// This target will be used to display an birds-eye view of the world centered on the player
+		auto map_target = render_graph.create_target("map", { .size_divisor = map_framebuffer_divisor });
+
+		render_graph.add_pass("world", [&, world_target](RenderGraph& graph)
+		{
+			Framebuffer& world_framebuffer = graph.framebuffer(world_target);
+			world_framebuffer.bind();
+			{
+				glClearColor(0.26f, 0.46f, 0.98f, 1.0f); // bluish
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+				// Depth only first, then the lit shaders run just for the fragments matching the nearest depth
+				// Both passes draw the same culled and batched entities, prepared (and uploaded) once
+				bool prepass = use_depth_prepass;
+				main_scene.prepare_except_instanced();
+				if (prepass)
+				{
+					glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+					for (Shader& lit_shader : lit_shaders) lit_shader.setBool("depth_only", true);
+					main_scene.draw_prepared(true);
+					for (Shader& lit_shader : lit_shaders) lit_shader.setBool("depth_only", false);
+					glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+					glDepthFunc(GL_EQUAL);
+					glDepthMask(GL_FALSE);
+				}
+
+				lit_fragments_query.begin();
+				main_scene.draw_prepared();
+				lit_fragments_query.end(prepass);
+				lit_fragments[lit_fragments_query.result_tag()] = lit_fragments_query.result();
+
+				if (prepass)
+				{
+					glDepthFunc(GL_LESS);
+					glDepthMask(GL_TRUE);
+				}
+			}
+			world_framebuffer.unbind();
+
+			// The world depth occludes the paintballs, which can then be culled before being drawn
+			main_scene.build_occlusion_pyramid(world_framebuffer.get_depth_attachment());
+		}).write(world_target);
+
+		// Draw paintballs in their own framebuffer (the whole paintball chain is skipped when there are none)
+		render_graph.add_pass("paintballs", [&, paintballs_target](RenderGraph& graph)
+		{
+			Framebuffer& paintballs_framebuffer = graph.framebuffer(paintballs_target);
+			paintballs_framebuffer.bind();
+			{
+				glClearColor(0, 0, 0, 0);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+				main_scene.draw_only_instanced();
+			}
+			paintballs_framebuffer.unbind();
+		}).write(paintballs_target).enabled_if([&]() { return main_scene.get_instances_amount() > 0; });
+
+		// We perform a number of blur passes to make paintball countours less evident, rendering the whole paintball stream more cohesive
+		// Each pass writes its own target: as a target is only needed by the following pass, the graph ping-pongs them between two framebuffers
+		auto blur_source = paintballs_target;
+		bool fuse_last_blur = paint_fused_composite && !paintblur_use_compute && paintballs_resolution_divisor == 1 && paintblur_blurpasses > 0;
+		if (paintblur_use_compute)
+		{
+			// Compute blur: one horizontal and one vertical dispatch, each workgroup blurs a segment of a row (or column) from shared memory
+			RenderGraph::TargetDesc compute_blur_desc = paint_desc;
+			compute_blur_desc.color_format = { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE }; // image load/store needs a sized format
+
+			for (int i = 0; i < 2; i++)
+			{
+				auto blur_target = render_graph.create_target(i ? "paintblur_compute_v" : "paintblur_compute_h", compute_blur_desc);
+				bool horizontal = i == 0;
+
+				render_graph.add_pass(i ? "paintblur_compute_v" : "paintblur_compute_h", [&, blur_source, blur_target, paintballs_target, horizontal](RenderGraph& graph)
+				{
+					Texture& destination = graph.framebuffer(blur_target).get_color_attachment();
+					paintblur_compute_shader.bind();
+					{
+						glActiveTexture(GL_TEXTURE0);
+						graph.framebuffer(blur_source).get_color_attachment().bind();
+						paintblur_compute_shader.setInt("image", 0);
+
+						glActiveTexture(GL_TEXTURE1);
+						graph.framebuffer(paintballs_target).get_depth_attachment().bind();
+						paintblur_compute_shader.setInt("depth_image", 1);
+
+						glBindImageTexture(0, destination.id(), 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+
+						paintblur_compute_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+						paintblur_compute_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+
+						paintblur_compute_shader.setBool("horizontal", horizontal);
+						paintblur_compute_shader.setFloat("blur_strength", paintblur_shader_blurstrength / paintballs_resolution_divisor);
+						paintblur_compute_shader.setFloat("depth_offset", paintblur_shader_depthoffset);
+						paintblur_compute_shader.setBool("ignore_alpha", paintblur_shader_ignore_alpha);
+
+						// Workgroups of 128 texels along the blur direction, one row of workgroups per line
+						unsigned int line_length = horizontal ? destination.width() : destination.height();
+						unsigned int lines = horizontal ? destination.height() : destination.width();
+						glDispatchCompute((line_length + 127) / 128, lines, 1);
+
+						// The result is then sampled as a texture
+						glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+					}
+					paintblur_compute_shader.unbind();
+				}).read(blur_source).read(paintballs_target).write(blur_target);
+
+				blur_source = blur_target;
+			}
+		}
+		else
+		{
+			// The last pass can be done by the fused composite, as long as it reads the paintballs at their own resolution
+			for (int i = 0; i < paintblur_blurpasses - fuse_last_blur; i++)
+			{
+				auto blur_target = render_graph.create_target("paintblur" + std::to_string(i), paint_desc);
+				bool horizontal = i % 2;
+
+				render_graph.add_pass("paintblur" + std::to_string(i), [&, blur_source, blur_target, paintballs_target, horizontal](RenderGraph& graph)
+				{
+					Framebuffer& destination_fb = graph.framebuffer(blur_target);
+					destination_fb.bind();
+					paintblur_shader.bind();
+					{
+						glClearColor(0, 0, 0, 0);
+						glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+						glActiveTexture(GL_TEXTURE0);
+						graph.framebuffer(blur_source).get_color_attachment().bind();
+						paintblur_shader.setInt("image", 0);
+
+						glActiveTexture(GL_TEXTURE1);
+						graph.framebuffer(paintballs_target).get_depth_attachment().bind();
+						paintblur_shader.setInt("depth_image", 1);
+					
+						paintblur_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+						paintblur_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+
+						paintblur_shader.setBool("horizontal", horizontal);
+						paintblur_shader.setFloat("blur_strength", paintblur_shader_blurstrength / paintballs_resolution_divisor); // blur radius is in texels
+						paintblur_shader.setFloat("depth_offset", paintblur_shader_depthoffset);
+						paintblur_shader.setBool("ignore_alpha", paintblur_shader_ignore_alpha);
+						quad_mesh.draw();
+					}
+					paintblur_shader.unbind();
+					destination_fb.unbind();
+				}).read(blur_source).read(paintballs_target).write(blur_target);
+
+				blur_source = blur_target;
+			}
+		}
+
+		// We play with color and alpha levels of the blurred paintballs to make them look more organic and liquidy
+		// (in the fused composite, this is done while merging)
+		if (!paint_fused_composite)
+		{
+			render_graph.add_pass("paintstep", [&, blur_source, paintstep_target](RenderGraph& graph)
+			{
+				Framebuffer& paintstep_framebuffer = graph.framebuffer(paintstep_target);
+				paintstep_framebuffer.bind();
+				{
+					glClearColor(0, 0, 0, 0);
+					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+					paintstep_shader.bind();
+					{
+						glActiveTexture(GL_TEXTURE0);
+						graph.framebuffer(blur_source).get_color_attachment().bind(); // We take the last blurred target
+						paintstep_shader.setInt("image", 0);
+						paintstep_shader.setFloat("t0_color", paintstep_shader_t0_color);
+						paintstep_shader.setFloat("t1_color", paintstep_shader_t1_color);
+						paintstep_shader.setFloat("t0_alpha", paintstep_shader_t0_alpha);
+						paintstep_shader.setFloat("t1_alpha", paintstep_shader_t1_alpha);
+						quad_mesh.draw();
+					}
+					paintstep_shader.unbind();
+				}
+				paintstep_framebuffer.unbind();
+			}).read(blur_source).write(paintstep_target);
+		}
+
+		// Merge world and post-processed paintball framebuffers
+		auto paint_layer = paint_fused_composite ? blur_source : paintstep_target;
+		render_graph.add_pass(paint_fused_composite ? "composite" : "merge", [&, world_target, paintballs_target, paint_layer, present_target, fuse_last_blur](RenderGraph& graph)
+		{
+			Framebuffer& world_framebuffer = graph.framebuffer(world_target);
+			Framebuffer& present_framebuffer = graph.framebuffer(present_target);
+
+			if (graph.available(paint_layer) && paint_fused_composite)
+			{
+				present_framebuffer.bind();
+				glClearColor(0, 0, 0, 0);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+				paint_composite_shader.bind();
+				{
+					glActiveTexture(GL_TEXTURE0);
+					world_framebuffer.get_color_attachment().bind();
+					paint_composite_shader.setInt("world_color", 0);
+
+					glActiveTexture(GL_TEXTURE1);
+					world_framebuffer.get_depth_attachment().bind();
+					paint_composite_shader.setInt("world_depth", 1);
+
+					glActiveTexture(GL_TEXTURE2);
+					graph.framebuffer(paint_layer).get_color_attachment().bind();
+					paint_composite_shader.setInt("paint_image", 2);
+
+					glActiveTexture(GL_TEXTURE3);
+					graph.framebuffer(paintballs_target).get_depth_attachment().bind();
+					paint_composite_shader.setInt("paint_depth", 3);
+
+					paint_composite_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+					paint_composite_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+
+					// Last blur pass
+					paint_composite_shader.setBool("fuse_blur", fuse_last_blur);
+					paint_composite_shader.setBool("horizontal", (paintblur_blurpasses - 1) % 2);
+					paint_composite_shader.setFloat("blur_strength", paintblur_shader_blurstrength);
+					paint_composite_shader.setFloat("depth_offset", paintblur_shader_depthoffset);
+					paint_composite_shader.setBool("ignore_alpha", paintblur_shader_ignore_alpha);
+
+					// Paintstep
+					paint_composite_shader.setFloat("t0_color", paintstep_shader_t0_color);
+					paint_composite_shader.setFloat("t1_color", paintstep_shader_t1_color);
+					paint_composite_shader.setFloat("t0_alpha", paintstep_shader_t0_alpha);
+					paint_composite_shader.setFloat("t1_alpha", paintstep_shader_t1_alpha);
+
+					quad_mesh.draw();
+				}
+				paint_composite_shader.unbind();
+
+				if (paint_composite_check_requested)
+				{
+					paint_composite_check_requested = false;
+					paint_composite_check_difference = paint_composite_difference(world_framebuffer, graph.framebuffer(paint_layer),
+						graph.framebuffer(paintballs_target), present_framebuffer, fuse_last_blur);
+					glBindFramebuffer(GL_FRAMEBUFFER, present_framebuffer.id()); // the scratch framebuffers restored the viewport, not the binding
+				}
+			}
+			else if (graph.available(paint_layer))
+			{
+				present_framebuffer.bind();
+				glClearColor(0, 0, 0, 0);
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+				mergefbo_shader.bind();
+				{
+					glActiveTexture(GL_TEXTURE0);
+					world_framebuffer.get_color_attachment().bind();
+					mergefbo_shader.setInt("fbo0_color", 0);
+
+					glActiveTexture(GL_TEXTURE1);
+					world_framebuffer.get_depth_attachment().bind();
+					mergefbo_shader.setInt("fbo0_depth", 1);
+
+					glActiveTexture(GL_TEXTURE2);
+					graph.framebuffer(paint_layer).get_color_attachment().bind();
+					mergefbo_shader.setInt("fbo1_color", 2);
+
+					glActiveTexture(GL_TEXTURE3);
+					graph.framebuffer(paintballs_target).get_depth_attachment().bind(); // N.B. we use the paintballs depth buffer because we lost the depth info while processing it!!
+					mergefbo_shader.setInt("fbo1_depth", 3);
+
+					// Needed to upsample lower resolution paintballs
+					mergefbo_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
+					mergefbo_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
+
+					quad_mesh.draw();
+				}
+				mergefbo_shader.unbind();
+			}
+			else
+			{
+				// No paintballs to merge, the world is copied as is
+				glBlitNamedFramebuffer(world_framebuffer.id(), present_framebuffer.id(), 0, 0, world_framebuffer.width(), world_framebuffer.height(),
+					0, 0, present_framebuffer.width(), present_framebuffer.height(), GL_COLOR_BUFFER_BIT, GL_NEAREST);
+				present_framebuffer.bind();
+			}
 
-	Framebuffer map_framebuffer{ ws.width / map_framebuffer_divisor, ws.height / map_framebuffer_divisor, 
-		Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
+			// Draw gun on top of world
+			glClear(GL_DEPTH_BUFFER_BIT);
+			player.draw();
+
+			present_framebuffer.unbind();
+		}).read(world_target).read_optional(paint_layer).read_optional(paintballs_target).write(present_target);
 
-	// This framebuffer will be used to group
-	Framebuffer present_framebuffer{ ws.width, ws.height, Texture::FormatInfo{GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE}, Texture::FormatInfo{GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT} };
+		// MAP
+		render_graph.add_pass("map", [&, map_target](RenderGraph& graph)
+		{
+			Framebuffer& map_framebuffer = graph.framebuffer(map_target);
+			bool cull_option = main_scene.use_frustum_culling;
+			map_framebuffer.bind();
+			{
+				glClearColor(0.26f, 0.46f, 0.98f, 1.0f); // bluish
+				glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			
+				float topdown_height = 20;
+				topdown_camera.set_position(player.first_person_camera.position() + glm::vec3{ 0, topdown_height, 0 });
+				topdown_camera.lookAt(player.first_person_camera.position(), glm::vec3{0, 0, 1});
+				main_scene.current_camera = &topdown_camera;
+				main_scene.use_frustum_culling = false;
+			
+				// Update camera info since we swapped to topdown, clusters included
+				frame_ubo.update(main_scene.current_camera->frame_data());
+				light_clusters.update(clustered_lights);
+			
+				// Redraw all scene objects from map pov except paintballs
+				main_scene.draw_except_instanced();
+			
+				// Prepare cursor shader
+				glClear(GL_DEPTH_BUFFER_BIT);
+			
+				cursor.set_position(player.first_person_camera.position());
+				cursor.set_orientation({ -90.0f, 0.0f, -player.first_person_camera.rotation().y - 90.f });
+			
+				cursor.update(capped_deltaTime);
+				cursor.draw();
+			}
+			map_framebuffer.unbind();
 
-	fullscreen_framebuffers = {&world_framebuffer, & paintballs_framebuffer,
-		& postfxblur0_framebuffer, & postfxblur1_framebuffer, & paintstep_framebuffer, & present_framebuffer};
+			// Reset main scene camera to the player's one
+			main_scene.current_camera = &player.first_person_camera;
+			frame_ubo.update(main_scene.current_camera->frame_data());
+			light_clusters.update(clustered_lights);
+			main_scene.use_frustum_culling = cull_option; // restore frustum culling option
+		}).write(map_target);
 
-	std::vector<Framebuffer*> postfx_fbos; postfx_fbos.push_back(&postfxblur0_framebuffer); postfx_fbos.push_back(&postfxblur1_framebuffer);
+		render_graph.add_pass("present", [&, present_target, map_target](RenderGraph& graph)
+		{
+			Framebuffer& present_framebuffer = graph.framebuffer(present_target);
+			Framebuffer& map_framebuffer = graph.framebuffer(map_target);
 
-	map_framebuffer_ptr = &map_framebuffer;
+			// World present onto default framebuffer
+			glBlitNamedFramebuffer(present_framebuffer.id(), 0, 0, 0, ws.width, ws.height, 0, 0, ws.width, ws.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+
+			// Draw physics colliders on top if debug mode is enabled
+			physics_engine.debug_draw_world();
+
+			// Map present : we render now into the smaller map viewport
+			glClear(GL_DEPTH_BUFFER_BIT);
+			glViewport(ws.width - map_framebuffer.width() - 10, ws.height - map_framebuffer.height() - 10, map_framebuffer.width(), map_framebuffer.height());
+			textured_shader.bind();
+			{
+				glActiveTexture(GL_TEXTURE0);
+				map_framebuffer.get_color_attachment(0).bind();
+				quad_mesh.draw();
+				textured_shader.unbind();
+			}
+			glViewport(0, 0, ws.width, ws.height);
+		}).read(present_target).read(map_target).side_effect();
+	};
+	build_render_graph();
 #pragma endregion framebuffers_setup
 	
 #pragma region pre-loop_setup
 	main_scene.init();
 	player.init();
 
+	// Paint persistence setup, restoring the paint state of the previous session (if any)
+	PaintPersistence paint_persistence{ main_scene, "saves/main_scene.paint" };
+	paint_persistence_ptr = &paint_persistence;
+	paint_persistence.load();
+
+	// Splat log setup (recording can be toggled from the settings)
+	std::unique_ptr<SplatLog> splat_log;
+	const std::string splat_log_path = "saves/main_scene.splats";
+	std::string splat_log_status;
+
+	// Replays synthetic splats onto the floor (overwriting its paint) and measures the time taken
+	auto benchmark_splat_replay = [&](size_t splats_amount)
+	{
+		const glm::vec4 team_colors[] = { { 0.1f, 0.64f, 0.92f, 1.f }, { 0.1f, 0.5f, 0.f, 1.f }, { 0.5f, 0.f, 0.5f, 1.f }, { 1.f, 0.85f, 0.f, 1.f } };
+		uint32_t floor_hash = utils::strings::hash_fnv1a(floor_plane->display_name);
+
+		std::vector<SplatRecord> records; records.reserve(splats_amount);
+		for (size_t i = 0; i < splats_amount; ++i)
+		{
+			Splat splat
+			{ 
+				{ rng.get_float(-20.f, 20.f), -0.8f, rng.get_float(-20.f, 20.f) },
+				glm::normalize(glm::vec3{ rng.get_float(-0.5f, 0.5f), -1.f, rng.get_float(-0.5f, 0.5f) }),
+				rng.get_float(0.05f, 0.2f),
+				team_colors[rng.get_uint() % 4]
+			};
+			records.push_back(SplatRecord::encode(splat, floor_hash));
+		}
+
+		glFinish();
+		auto start = std::chrono::high_resolution_clock::now();
+		SplatLog::replay(main_scene, { PaintballComponent::paint_near_plane, PaintballComponent::paint_far_plane, PaintballComponent::distance_bias }, records);
+		glFinish();
+		std::chrono::duration<double, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+
+		splat_log_status = "Replayed " + std::to_string(splats_amount) + " splats in " + std::to_string(elapsed.count()) + " ms (" 
+			+ std::to_string(splats_amount / (elapsed.count() / 1000.0)) + " splats/s), log size " + std::to_string(splats_amount * sizeof(SplatRecord) / 1024) + " KB";
+		utils::io::info("SPLAT LOG - ", splat_log_status);
+	};
+
 	// Fps Measurements variables setup
 	const int fps_values_amount = 2000;
 	utils::containers::FixedQueue<float, fps_values_amount> fps_values;
@@ -699,26 +1275,27 @@ int main()
 		ws = wdw.get_size();
 		glViewport(0, 0, ws.width, ws.height);
 
-		// Update commons for all shaders 
-		for (Shader& shader : all_shaders)
+		// Update camera and lighting commons, once for all shaders 
+		frame_ubo.update(main_scene.current_camera->frame_data());
+		for (DirectionalLight* dl : dir_lights) dl->fit_cascades(*main_scene.current_camera);
+
+		// Reach of each point light, so the lit draws skip the ones too far from them (same order as in the Lights block)
+		main_scene.point_light_influences.clear();
+		for (size_t i = 0; i < point_lights.size() && i < MAX_POINT_LIGHTS; i++)
+			main_scene.point_light_influences.push_back({ point_lights[i]->position, point_lights[i]->influence_radius() });
+
+		// Paint glows bob over the floor, then are assigned to the clusters of this frame's camera
+		for (size_t i = 0; i < glow_lights.size(); i++)
 		{
-			shader.bind();
-			shader.setVec3("wCameraPos", main_scene.current_camera->position());
-			shader.setMat4("viewMatrix", main_scene.current_camera->viewMatrix());
+			glow_lights[i].position.y = -0.2f + 0.4f * (1.f + std::sin(currentFrameTime + glow_phases[i]));
+			glow_lights[i].intensity = glow_intensity;
 		}
+		light_clusters.update(clustered_lights);
 
-		// Update lighting for lit shaders
 		for (Shader& lit_shader : lit_shaders)
 		{
 			lit_shader.bind();
-			for (size_t i = 0; i < point_lights.size(); i++)
-			{
-				point_lights[i]->setup(lit_shader, i);
-			}
-			for (size_t i = 0; i < dir_lights.size(); i++)
-			{
-				dir_lights[i]->setup(lit_shader, i);
-			}
+			paint_atlas.bind(lit_shader);
 			lit_shader.unbind();
 		}
 
@@ -740,18 +1317,21 @@ int main()
 		main_scene.update(capped_deltaTime);
 		player.update(capped_deltaTime);
 
+		// Apply the splats of this frame's paintball impacts
+		paint_atlas.apply_splats();
+
+		// Advance pending paint saves/loads
+		paint_persistence.update();
+		if (splat_log) splat_log->flush();
+
 #pragma endregion update_world
 
 #pragma region shadow_pass
 
-		for (auto& light : dir_lights)
-		{
-			light->compute_shadowmap(main_scene);
-		}
-		for (auto& light : point_lights)
-		{
-			light->compute_shadowmap(main_scene);
-		}
+		shadow_scheduler.update(main_scene, shadow_lights);
+
+		// Lights are uploaded after their shadow pass, so each cascade is sampled with the matrix its layer was last rendered with
+		lights_ubo.update(LightsData{ point_lights, dir_lights });
 
 		// Update lit shaders to add the computed shadowmap(s)
 		std::array<GLint, MAX_DIR_LIGHTS> dir_shadow_locs;
@@ -769,7 +1349,7 @@ int main()
 					int tex_offset = SHADOW_TEX_UNIT + i;
 					dir_shadow_locs[i] = tex_offset;
 					glActiveTexture(GL_TEXTURE0 + tex_offset);
-					glBindTexture(GL_TEXTURE_2D, i < dir_lights.size() ? dir_lights[i]->depthmap : 0);
+					glBindTexture(GL_TEXTURE_2D_ARRAY, i < dir_lights.size() ? dir_lights[i]->depthmap : 0);
 				}
 				// Set sampler locations for point shadow maps
 				for (int i = 0; i < point_shadow_locs_amount; i++)
@@ -782,6 +1362,8 @@ int main()
 
 				lit_shader.setIntV("directional_shadow_maps", dir_shadow_locs_amount, dir_shadow_locs.data());
 				lit_shader.setIntV("point_shadow_maps", point_shadow_locs_amount, point_shadow_locs.data());
+				lit_shader.setInt("shadow_filter", shadow_filter);
+				lit_shader.setBool("point_shadow_pcf", point_shadow_pcf);
 			}
 			lit_shader.unbind();
 		}
@@ -789,191 +1371,27 @@ int main()
 #pragma endregion shadow_pass
 
 #pragma region draw_world
-		// Render scene
-		world_framebuffer.bind();
-		{
-			glClearColor(0.26f, 0.46f, 0.98f, 1.0f); // bluish
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			main_scene.draw_except_instanced();
-		}
-		world_framebuffer.unbind();
-
-		// Draw paintballs in their own framebuffer
-		paintballs_framebuffer.bind();
-		{
-			glClearColor(0, 0, 0, 0);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-			main_scene.draw_only_instanced();
-		}
-		paintballs_framebuffer.unbind();
-
-		// We perform a number of blur passes to make paintball countours less evident, rendering the whole paintball stream more cohesive
-		Framebuffer *destination_fb = postfx_fbos[0], *source_fb = &paintballs_framebuffer, *paintblur_fb = &paintballs_framebuffer;
-		paintblur_shader.bind();
-		{
-			for (int i = 0; i < paintblur_blurpasses; i++)
-			{
-				bool horizontal = i % 2;
-
-				destination_fb->bind();
-				{
-					glClearColor(0, 0, 0, 0);
-					glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-					glActiveTexture(GL_TEXTURE0);
-					source_fb->get_color_attachment().bind();
-					paintblur_shader.setInt("image", 0);
-
-					glActiveTexture(GL_TEXTURE1);
-					paintballs_framebuffer.get_depth_attachment().bind();
-					paintblur_shader.setInt("depth_image", 1);
-					
-					paintblur_shader.setFloat("near_plane", main_scene.current_camera->near_plane());
-					paintblur_shader.setFloat("far_plane", main_scene.current_camera->far_plane());
-
-					paintblur_shader.setBool("horizontal", horizontal);
-					paintblur_shader.setFloat("blur_strength", paintblur_shader_blurstrength);
-					paintblur_shader.setFloat("depth_offset", paintblur_shader_depthoffset);
-					paintblur_shader.setBool("ignore_alpha", paintblur_shader_ignore_alpha);
-					quad_mesh.draw();
-				}
-				destination_fb->unbind();
-
-				// Swap source and destination buffers
-				destination_fb = postfx_fbos[!horizontal];
-				source_fb      = postfx_fbos[ horizontal];
-				paintblur_fb   = source_fb;
-			}
-		}
-		paintblur_shader.unbind();
-
-		// We play with color and alpha levels of the blurred paintballs to make them look more organic and liquidy
-		paintstep_framebuffer.bind();
+		// Render the frame through the render graph (world, paintballs and their post-processing, map and present)
+		if (paintblur_compute_radius != paintblur_compute_shader_radius)
 		{
-			glClearColor(0, 0, 0, 0);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-			paintstep_shader.bind();
-			{
-				glActiveTexture(GL_TEXTURE0);
-				paintblur_fb->get_color_attachment().bind(); // We take the last destination framebuffer
-				paintstep_shader.setInt("image", 0);
-				paintstep_shader.setFloat("t0_color", paintstep_shader_t0_color);
-				paintstep_shader.setFloat("t1_color", paintstep_shader_t1_color);
-				paintstep_shader.setFloat("t0_alpha", paintstep_shader_t0_alpha);
-				paintstep_shader.setFloat("t1_alpha", paintstep_shader_t1_alpha);
-				quad_mesh.draw();
-			}
-			paintstep_shader.unbind();
+			paintblur_compute_shader = make_paintblur_compute_shader(paintblur_compute_radius);
+			paintblur_compute_shader_radius = paintblur_compute_radius;
 		}
-		paintstep_framebuffer.unbind();
-
-		// Merge world and post-processed paintball framebuffers
-		present_framebuffer.bind();
-		{
-			glClearColor(0, 0, 0, 0);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-			mergefbo_shader.bind();
-			{
-				glActiveTexture(GL_TEXTURE0);
-				world_framebuffer.get_color_attachment().bind();
-				mergefbo_shader.setInt("fbo0_color", 0);
-
-				glActiveTexture(GL_TEXTURE1);
-				world_framebuffer.get_depth_attachment().bind();
-				mergefbo_shader.setInt("fbo0_depth", 1);
-
-				glActiveTexture(GL_TEXTURE2);
-				paintstep_framebuffer.get_color_attachment().bind();
-				mergefbo_shader.setInt("fbo1_color", 2);
-
-				glActiveTexture(GL_TEXTURE3);
-				paintballs_framebuffer.get_depth_attachment().bind(); // N.B. we use the paintballs depth buffer because we lost the depth info while processing it!!
-				mergefbo_shader.setInt("fbo1_depth", 3);
-
-				quad_mesh.draw();
-			}
-			mergefbo_shader.unbind();
-
-			// Draw gun on top of world
-			glClear(GL_DEPTH_BUFFER_BIT);
-			player.draw();
-		}
-		present_framebuffer.unbind();
+		if (paintblur_blurpasses != render_graph_blurpasses || paintballs_resolution_divisor != render_graph_paint_divisor || 
+			paintblur_use_compute != render_graph_compute_blur || paint_fused_composite != render_graph_fused_composite) build_render_graph();
+		render_graph.execute();
 
 #pragma endregion draw_world
 
-#pragma region map_draw
-
-		// MAP
-		bool cull_option = main_scene.use_frustum_culling;
-		map_framebuffer.bind();
-		{
-			glClearColor(0.26f, 0.46f, 0.98f, 1.0f); // bluish
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		
-			float topdown_height = 20;
-			topdown_camera.set_position(player.first_person_camera.position() + glm::vec3{ 0, topdown_height, 0 });
-			topdown_camera.lookAt(player.first_person_camera.position(), glm::vec3{0, 0, 1});
-			main_scene.current_camera = &topdown_camera;
-			main_scene.use_frustum_culling = false;
-		
-			// Update camera info since we swapped to topdown
-			for (Shader& shader : all_shaders)
-			{
-				shader.bind();
-				shader.setVec3("wCameraPos", main_scene.current_camera->position());
-				shader.setMat4("viewMatrix", main_scene.current_camera->viewMatrix());
-			}
-		
-			// Redraw all scene objects from map pov except paintballs
-			main_scene.draw_except_instanced();
-		
-			// Prepare cursor shader
-			glClear(GL_DEPTH_BUFFER_BIT);
-		
-			cursor.set_position(player.first_person_camera.position());
-			cursor.set_orientation({ -90.0f, 0.0f, -player.first_person_camera.rotation().y - 90.f });
-		
-			cursor.update(capped_deltaTime);
-			cursor.draw();
-		}
-		map_framebuffer.unbind();
-
-		// Reset main scene camera to the player's one
-		main_scene.current_camera = &player.first_person_camera;
-		main_scene.use_frustum_culling = cull_option; // restore frustum culling option
-
-#pragma endregion map_draw
-
-#pragma region present
-		// World present onto default framebuffer
-		glBlitNamedFramebuffer(present_framebuffer.id(), 0, 0, 0, ws.width, ws.height, 0, 0, ws.width, ws.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
-
-		// Draw physics colliders on top if debug mode is enabled
-		physics_engine.debug_draw_world();
-
-		// Map present : we render now into the smaller map viewport
-		glClear(GL_DEPTH_BUFFER_BIT);
-		glViewport(ws.width - map_framebuffer.width() - 10, ws.height - map_framebuffer.height() - 10, map_framebuffer.width(), map_framebuffer.height());
-		textured_shader.bind();
-		{
-			glActiveTexture(GL_TEXTURE0);
-			map_framebuffer.get_color_attachment(0).bind();
-			quad_mesh.draw();
-			textured_shader.unbind();
-		}
-		glViewport(0, 0, ws.width, ws.height);
-
-#pragma endregion present
-
 #pragma region imgui_draw
 		// ImGUI window creation
 		ImGui_ImplOpenGL3_NewFrame();// Tell OpenGL a new Imgui frame is about to begin
 		ImGui_ImplGlfw_NewFrame();
 		ImGui::NewFrame();
 
+		// Formats a number for the imgui labels without allocating (the result is valid until the next call)
+		auto imgui_label = [](auto value) { static char label[24]; std::snprintf(label, sizeof(label), "%lld", static_cast<long long>(value)); return label; };
+
 		ImGui::Begin("FPS info");
 		{
 			avg_ms_per_frame  = alpha * avg_ms_per_frame + (1.0f - alpha) * (deltaTime * 1000);
@@ -987,14 +1405,9 @@ int main()
 			fps_values.push_back(avg_fps);
 			t_values.push_back(currentFrameTime);
 			
-			std::string my_fps_counter = "Avg FPS: " + std::to_string(avg_fps);
-			std::string ms_frame_counter = "Time per frame: " + std::to_string(avg_ms_per_frame) + "ms";
-			std::string min_record = "Min fps:" + std::to_string(min_fps) + "ms";
-			std::string max_record = "Max fps:" + std::to_string(max_fps) + "ms";
-			std::string pballs_amount = "Current paintballs amount:" + std::to_string(main_scene.get_instances_amount()) + "ms";
-			ImGui::Text(my_fps_counter.c_str()); ImGui::Text(ms_frame_counter.c_str());
-			ImGui::Text(min_record.c_str()); ImGui::Text(max_record.c_str());
-			ImGui::Text(pballs_amount.c_str());
+			ImGui::Text("Avg FPS: %f", avg_fps); ImGui::Text("Time per frame: %fms", avg_ms_per_frame);
+			ImGui::Text("Min fps:%fms", min_fps); ImGui::Text("Max fps:%fms", max_fps);
+			ImGui::Text("Current paintballs amount:%zums", main_scene.get_instances_amount());
 			ImGui::SliderFloat("Time offset", &time_offset, 0, 10, " %.1f", ImGuiSliderFlags_AlwaysClamp);
 			ImGui::SliderFloat("Fps offset", &fps_offset, 0, 200, " %.1f", ImGuiSliderFlags_AlwaysClamp);
 			if (ImPlot::BeginPlot("##Fps Plot"))
@@ -1022,7 +1435,24 @@ int main()
 				ImGui::SliderFloat("Shininess", &player.paintball_spawner->paintball_material.shininess, 0, 128.f, " %.1f", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::Checkbox("Receive shadows", &player.paintball_spawner->paintball_material.receive_shadows);
 				ImGui::Separator(); ImGui::Text("Blur and step FX shaders");
-				ImGui::SliderInt("Blur passes", &paintblur_blurpasses, 0, 8, "%d", ImGuiSliderFlags_AlwaysClamp);
+				ImGui::Checkbox("Compute blur", &paintblur_use_compute);
+				ImGui::Checkbox("Fused composite", &paint_fused_composite);
+				if (paint_fused_composite)
+				{
+					// The last blur pass can only be fused with the fragment blur at full resolution (the compute blur runs as a whole)
+					bool fuses_blur = !paintblur_use_compute && paintballs_resolution_divisor == 1 && paintblur_blurpasses > 0;
+					ImGui::TextDisabled(fuses_blur ? "Fusing the last blur pass, paintstep and merge" : "Fusing paintstep and merge only (last blur pass needs the fragment blur at full resolution)");
+					if (ImGui::Button("Compare with unfused")) paint_composite_check_requested = true;
+					if (paint_composite_check_difference >= 0) { ImGui::SameLine(); ImGui::Text("max difference: %d/255", paint_composite_check_difference); }
+				}
+				if (paintblur_use_compute)
+					ImGui::SliderInt("Blur radius", &paintblur_compute_radius, 1, 64, "%d", ImGuiSliderFlags_AlwaysClamp);
+				else
+					ImGui::SliderInt("Blur passes", &paintblur_blurpasses, 0, 8, "%d", ImGuiSliderFlags_AlwaysClamp);
+				ImGui::Text("Paintballs resolution"); ImGui::SameLine();
+				ImGui::RadioButton("Full", &paintballs_resolution_divisor, 1); ImGui::SameLine();
+				ImGui::RadioButton("1/2", &paintballs_resolution_divisor, 2); ImGui::SameLine();
+				ImGui::RadioButton("1/4", &paintballs_resolution_divisor, 4);
 				ImGui::SliderFloat("Blur Strength", &paintblur_shader_blurstrength, 0, 16.f, " %.1f", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::SliderFloat("Blur Depth offset", &paintblur_shader_depthoffset, 0, 16.f, " %.1f", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::Checkbox("Blur ignore alpha", &paintblur_shader_ignore_alpha);
@@ -1058,7 +1488,7 @@ int main()
 				for (int i = 0; i < fountain_spawners.size(); i++)
 				{
 					auto& fountain_spawner = fountain_spawners[i];
-					std::string fountain_label = fountain_spawner->parent()->display_name;
+					const std::string& fountain_label = fountain_spawner->parent()->display_name;
 
 					if (ImGui::CollapsingHeader(fountain_label.c_str()))
 					{
@@ -1099,6 +1529,36 @@ int main()
 			if (ImGui::CollapsingHeader("Lights"))
 			{
 				ImGui::Indent();
+				ImGui::Checkbox("Cache static shadows", &StaticShadowCache::enabled);
+				ImGui::Checkbox("Shadow budget", &shadow_scheduler.enabled); ImGui::SameLine();
+				ImGui::SliderFloat("Mtexels/frame", &shadow_scheduler.budget_megatexels, 0.25f, 32.f, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+				ImGui::Text("Shadow texels rendered: %.2fM", shadow_scheduler.rendered_texels() / 1e6f);
+				if (ImGui::Combo("Shadow format", &current_shadow_format, "Depth 16\0Depth 32F\0"))
+				{
+					for (auto& pl : point_lights) pl->set_shadow_format(static_cast<ShadowFormat>(current_shadow_format));
+					for (auto& dl : dir_lights) dl->set_shadow_format(static_cast<ShadowFormat>(current_shadow_format));
+				}
+				size_t shadow_memory = 0;
+				for (Light* light : shadow_lights) shadow_memory += light->shadow_memory();
+				ImGui::Text("Shadow memory: %.1f MB (with static caches)", shadow_memory / (1024.f * 1024.f));
+				ImGui::Combo("Dir shadow filter", &shadow_filter, "PCF 2x2 (1 fetch)\0PCF 3x3 (4 fetches)\0PCF 4x4 (9 fetches)\0");
+				ImGui::Checkbox("Point shadow PCF (4 fetches)", &point_shadow_pcf);
+				ImGui::Checkbox("Paintball shadows", &main_scene.instanced_shadow_casters); ImGui::SameLine();
+				ImGui::Checkbox("Visible only", &main_scene.instanced_shadow_visible_only);
+				int instanced_shadow_budget = gsl::narrow<int>(main_scene.instanced_shadow_budget);
+				if (ImGui::SliderInt("Paintball casters", &instanced_shadow_budget, 0, 8192, "%d", ImGuiSliderFlags_AlwaysClamp))
+					main_scene.instanced_shadow_budget = instanced_shadow_budget;
+				ImGui::Text("Paintballs drawn by the last shadow pass: %zu", main_scene.instanced_shadow_drawn());
+				ImGui::PushID(&glow_lights);
+				if (ImGui::CollapsingHeader("Paint glows"))
+				{
+					ImGui::Checkbox("Clustered lights", &light_clusters.enabled);
+					if (ImGui::SliderInt("Amount", &glow_lights_amount, 0, gsl::narrow<int>(max_glow_lights), "%d", ImGuiSliderFlags_AlwaysClamp))
+						gather_glow_lights();
+					ImGui::SliderFloat("Intensity", &glow_intensity, 0, 2, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+					ImGui::Text("Clustered lights: %zu (up to %d per cluster)", light_clusters.light_count(), MAX_LIGHTS_PER_CLUSTER);
+				}
+				ImGui::PopID();
 				ImGui::PushID(&point_lights);
 				if (ImGui::CollapsingHeader("Pointlights"))
 				{
@@ -1107,17 +1567,17 @@ int main()
 						for (int n = 0; n < point_lights.size(); n++)
 						{
 							bool is_selected = (currentLight == point_lights[n]); // You can store your selection however you want, outside or inside your objects
-							if (ImGui::Selectable(std::to_string(n).c_str(), is_selected))
+							if (ImGui::Selectable(imgui_label(n), is_selected))
 								currentLight = point_lights[n];
 						}
 						ImGui::EndCombo();
 					}
-					if (ImGui::BeginCombo("Shadowmap resolution##rescombo", std::to_string(current_pl_res).c_str())) // The second parameter is the label previewed before opening the combo.
+					if (ImGui::BeginCombo("Shadowmap resolution##rescombo", imgui_label(current_pl_res))) // The second parameter is the label previewed before opening the combo.
 					{
 						for (int n = 0; n < shadowmap_res.size(); n++)
 						{
 							bool is_selected = (current_pl_res == shadowmap_res[n]); // You can store your selection however you want, outside or inside your objects
-							if (ImGui::Selectable(std::to_string(shadowmap_res[n]).c_str(), is_selected))
+							if (ImGui::Selectable(imgui_label(shadowmap_res[n]), is_selected))
 							{
 								current_pl_res = shadowmap_res[n];
 								for (auto& pl : point_lights)
@@ -1128,11 +1588,23 @@ int main()
 						}
 						ImGui::EndCombo();
 					}
+					if (ImGui::Combo("Cube faces", &current_pl_path, "Geometry shader\0Layered (culled)\0Per face (culled)\0"))
+					{
+						for (auto& pl : point_lights)
+						{
+							pl->shadowmap_settings.path = static_cast<PointLight::CubeShadowPath>(current_pl_path);
+						}
+					}
+					ImGui::Checkbox("Influence culling", &main_scene.use_light_culling);
+					ImGui::SliderFloat("Influence cutoff", &PointLight::influence_cutoff, 1.f / 1024.f, 0.1f, "%.4f", ImGuiSliderFlags_Logarithmic | ImGuiSliderFlags_AlwaysClamp);
 					for (int i = 0; i < point_lights.size(); i++)
 					{
 						ImGui::PushID(i);
-						std::string light_label = "Point light n." + std::to_string(i);
-						ImGui::Separator(); ImGui::Text(light_label.c_str());
+						ImGui::Separator(); ImGui::Text("Point light n.%d", i);
+						ImGui::Text("Caster/face draws: %zu", point_lights[i]->caster_face_draws);
+						auto pl_shadow_stats = shadow_scheduler.stats(point_lights[i]);
+						ImGui::Text("Shadow updates: %.2f faces/frame (%u pending)", pl_shadow_stats.updates_per_frame, pl_shadow_stats.pending);
+						ImGui::Text("Influence radius: %.1f", point_lights[i]->influence_radius());
 						ImGui::SliderFloat3("Pos", glm::value_ptr(point_lights[i]->position), -20, 20, "%.2f", 1);
 						ImGui::SliderFloat("Intensity", &point_lights[i]->intensity, 0, 1, "%.2f", ImGuiSliderFlags_AlwaysClamp);
 						ImGui::ColorEdit4("Color", glm::value_ptr(point_lights[i]->color));
@@ -1149,12 +1621,12 @@ int main()
 				ImGui::PushID(&dir_lights);
 				if (ImGui::CollapsingHeader("Dir lights"))
 				{
-					if (ImGui::BeginCombo("Shadowmap resolution##rescombo", std::to_string(current_dl_res).c_str())) // The second parameter is the label previewed before opening the combo.
+					if (ImGui::BeginCombo("Shadowmap resolution##rescombo", imgui_label(current_dl_res))) // The second parameter is the label previewed before opening the combo.
 					{
 						for (int n = 0; n < shadowmap_res.size(); n++)
 						{
 							bool is_selected = (current_dl_res == shadowmap_res[n]); // You can store your selection however you want, outside or inside your objects
-							if (ImGui::Selectable(std::to_string(shadowmap_res[n]).c_str(), is_selected))
+							if (ImGui::Selectable(imgui_label(shadowmap_res[n]), is_selected))
 							{
 								current_dl_res = shadowmap_res[n];
 								for (auto& dl : dir_lights)
@@ -1168,16 +1640,19 @@ int main()
 					for (int i = 0; i < dir_lights.size(); i++)
 					{
 						ImGui::PushID(i);
-						std::string light_label = "Directional light n." + std::to_string(i);
-						ImGui::Separator(); ImGui::Text(light_label.c_str());
+						ImGui::Separator(); ImGui::Text("Directional light n.%d", i);
+						auto dl_shadow_stats = shadow_scheduler.stats(dir_lights[i]);
+						ImGui::Text("Shadow updates: %.2f cascades/frame (%u pending)", dl_shadow_stats.updates_per_frame, dl_shadow_stats.pending);
 						ImGui::SliderFloat3("Dir", glm::value_ptr(dir_lights[i]->direction), -1, 1, "%.2f", 1);
 						ImGui::SliderFloat("Intensity", &dir_lights[i]->intensity, 0, 1, "%.2f", ImGuiSliderFlags_AlwaysClamp);
 						ImGui::ColorEdit4("Color", glm::value_ptr(dir_lights[i]->color));
 
 						ImGui::SliderFloat("Dist bias", &dir_lights[i]->shadowmap_settings.distance_bias, 0, 100, "%.2f", ImGuiSliderFlags_AlwaysClamp);
-						ImGui::SliderFloat("Near ", &dir_lights[i]->shadowmap_settings.frustum_near, 0, 100, "%.2f", ImGuiSliderFlags_AlwaysClamp);
-						ImGui::SliderFloat("Far ", &dir_lights[i]->shadowmap_settings.frustum_far, 0, 100, "%.2f", ImGuiSliderFlags_AlwaysClamp);
-						ImGui::SliderFloat("Frust ", &dir_lights[i]->shadowmap_settings.frustum_size, 0, 100, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+						int cascades = static_cast<int>(dir_lights[i]->shadowmap_settings.cascades);
+						if (ImGui::SliderInt("Cascades", &cascades, 1, MAX_SHADOW_CASCADES, "%d", ImGuiSliderFlags_AlwaysClamp))
+							dir_lights[i]->set_cascades(cascades);
+						ImGui::SliderFloat("Shadow dist", &dir_lights[i]->shadowmap_settings.shadow_distance, 1, 100, "%.2f", ImGuiSliderFlags_AlwaysClamp);
+						ImGui::SliderFloat("Split lambda", &dir_lights[i]->shadowmap_settings.split_lambda, 0, 1, "%.2f", ImGuiSliderFlags_AlwaysClamp);
 						ImGui::PopID();
 					}
 				}
@@ -1185,11 +1660,86 @@ int main()
 				ImGui::Unindent();
 			}
 
+			// Render graph
+			if (ImGui::CollapsingHeader("Render graph"))
+			{
+				for (const auto& pass : render_graph.get_passes())
+					ImGui::Text("%s%s", pass.name().c_str(), pass.is_active() ? "" : " (culled)");
+				ImGui::Text("Render targets: %zu KB (%zu KB without aliasing)", render_graph.memory_bytes() / 1024, render_graph.unaliased_memory_bytes() / 1024);
+			}
+
+			// Paintmaps
+			if (ImGui::CollapsingHeader("Paintmaps"))
+			{
+				size_t paintmaps_memory = 0;
+				for (PaintableComponent* paintable : paintables)
+				{
+					ImGui::Text("%s: %ux%u, %zu KB, %.1f texels/m", paintable->parent()->display_name.c_str(), 
+						paintable->width(), paintable->height(), paintable->size_bytes() / 1024, paintable->texel_density());
+					paintmaps_memory += paintable->size_bytes();
+				}
+				ImGui::Text("Total: %zu KB (budget %zu KB)", paintmaps_memory / 1024, paintmaps_memory_budget / 1024);
+				ImGui::Text("Atlas: %zu KB", paint_atlas.memory_bytes() / 1024);
+			}
+
+			// Splat log
+			if (ImGui::CollapsingHeader("Splat log"))
+			{
+				bool recording = splat_log != nullptr;
+				if (ImGui::Checkbox("Record splats", &recording))
+				{
+					if (recording)
+						splat_log = std::make_unique<SplatLog>(splat_log_path, 
+							SplatLog::ProjectionParams{ PaintballComponent::paint_near_plane, PaintballComponent::paint_far_plane, PaintballComponent::distance_bias });
+					else
+						splat_log.reset();
+					PaintballComponent::splat_log = splat_log.get();
+				}
+				if (splat_log) ImGui::Text("Logged splats: %zu", splat_log->size());
+
+				if (ImGui::Button("Replay log"))
+				{
+					if (splat_log) splat_log->flush();
+
+					SplatLog::ProjectionParams params; std::vector<SplatRecord> records;
+					if (SplatLog::read(splat_log_path, params, records))
+						splat_log_status = "Replayed " + std::to_string(SplatLog::replay(main_scene, params, records)) + " splats";
+				}
+				ImGui::SameLine();
+				if (ImGui::Button("Benchmark replay (1M splats)")) benchmark_splat_replay(1000000);
+				ImGui::TextWrapped("%s", splat_log_status.c_str());
+			}
+
 			// Other settings
 			if (ImGui::CollapsingHeader("other coefficients and scales"))
 			{
 				ImGui::Text("Scene");
 				ImGui::Checkbox("Use frustum culling", &main_scene.use_frustum_culling);
+				ImGui::Checkbox("Compact instance transforms", &main_scene.compact_instance_transforms);
+				ImGui::Checkbox("Multi-draw indirect", &main_scene.use_multi_draw);
+				ImGui::Checkbox("Depth prepass", &use_depth_prepass);
+				if (lit_fragments_query.available())
+				{
+					// Each count is the latest one measured in its mode, toggle the prepass to refresh both
+					ImGui::Text("Lit fragments: %.2fM without prepass, %.2fM with", lit_fragments[0] / 1e6f, lit_fragments[1] / 1e6f);
+					if (lit_fragments[0] > 0 && lit_fragments[1] > 0)
+						ImGui::Text("Fragment invocations saved: %.1f%%", 100.f * (1.f - float(lit_fragments[1]) / lit_fragments[0]));
+				}
+				if (main_scene.use_multi_draw)
+					ImGui::Text("Last multi-draw: %zu draws in %zu calls", main_scene.multi_draw_draws(), main_scene.multi_draw_calls());
+				ImGui::Checkbox("GPU paintball culling", &main_scene.use_gpu_instance_culling);
+				if (main_scene.use_gpu_instance_culling)
+				{
+					ImGui::Checkbox("Occlusion culling (Hi-Z)", &main_scene.use_occlusion_culling);
+					ImGui::Text("Visible paintballs: %zu/%zu", instance_culler.visible_instances(), main_scene.get_instances_amount());
+					if (ImGui::Button("Culling self-test")) gpu_culling_check = main_scene.check_gpu_culling();
+					if (gpu_culling_check)
+					{
+						bool passed = gpu_culling_check->resident == gpu_culling_check->instances && gpu_culling_check->gpu_visible == gpu_culling_check->cpu_visible;
+						ImGui::SameLine();
+						ImGui::Text("%s: %zu visible on the GPU, %zu on the CPU", passed ? "passed" : "MISMATCH", gpu_culling_check->gpu_visible, gpu_culling_check->cpu_visible);
+					}
+				}
 
 				ImGui::Separator(); ImGui::Text("Paintspace proj params");
 				ImGui::SliderFloat("Near plane##paint", &PaintballComponent::paint_near_plane, 0, 2, " % .2f", ImGuiSliderFlags_AlwaysClamp);
@@ -1199,6 +1749,16 @@ int main()
 				ImGui::Separator(); ImGui::Text("Floor");
 				ImGui::SliderFloat("Repeat tex##floor", &floor_plane->material->uv_repeat, 0, 3000, " % .1f", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::SliderFloat("Parallax Height Scale##floor", &floor_plane->material->parallax_heightscale, 0, 0.5, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+				int floor_parallax_mode = static_cast<int>(floor_plane->material->parallax_mode);
+				if (ImGui::Combo("Parallax mode##floor", &floor_parallax_mode, "None\0Offset\0Steep\0Adaptive\0"))
+					floor_plane->material->parallax_mode = static_cast<Material::ParallaxMode>(floor_parallax_mode);
+				if (floor_plane->material->parallax_mode == Material::ParallaxMode::adaptive)
+				{
+					ImGui::SliderFloat("Steep until##floor", &floor_plane->material->parallax_steep_distance, 0, 100, "%.1f", ImGuiSliderFlags_AlwaysClamp);
+					ImGui::SliderFloat("Offset until##floor", &floor_plane->material->parallax_offset_distance, 0, 100, "%.1f", ImGuiSliderFlags_AlwaysClamp);
+				}
+				ImGui::SliderInt("Parallax layers min##floor", &floor_plane->material->parallax_min_layers, 1, 64, "%d", ImGuiSliderFlags_AlwaysClamp);
+				ImGui::SliderInt("Parallax layers max##floor", &floor_plane->material->parallax_max_layers, 1, 64, "%d", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::SliderFloat("Paint normal bias##floor", &floor_plane->material->detail_normal_bias, 0, 0.5, "%.2f", ImGuiSliderFlags_AlwaysClamp);
 				ImGui::SliderFloat("Paint threshold##floor", &floor_plane->material->detail_alpha_threshold, 0, 1, "%.2f", ImGuiSliderFlags_AlwaysClamp);
 
@@ -1235,6 +1795,11 @@ int main()
 #pragma endregion rendering_loop
 
 #pragma region post-loop_cleanup
+	// Save the paint state for the next session, after any operation still in progress (which would make the save be ignored)
+	paint_persistence.flush();
+	paint_persistence.save();
+	paint_persistence.flush();
+
 	std::cout << " Avg.fps : " << (avg_fps) << " | Avg. frametime (ms) :" << avg_ms_per_frame;
 	ImPlot::DestroyContext();
 	ImGui_ImplOpenGL3_Shutdown();
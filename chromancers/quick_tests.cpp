@@ -8,6 +8,7 @@
 
 #include "utils/window.h"
 #include "utils/shader.h"
+#include "utils/uniform_buffer.h"
 #include "utils/scene/camera.h"
 #include "utils/model.h "
 #include "utils/scene/entity.h"
@@ -75,11 +76,14 @@ int mainz()
 	// Setup keys
 	setup_keys(wdw);
 
-	Shader painter_shader{ "jj", "shaders/text/generic/texpainter.vert" ,"shaders/text/generic/texpainter.frag", 4, 3 };
-	Shader mvp{ "mvp", "shaders/text/generic/mvp.vert", "shaders/text/generic/fullcolor.frag", 4 , 3 };
+	// The generic shaders expect the shared definitions and uniform blocks prepended, as in the main application
+	std::vector<const GLchar*> utils_shaders { "shaders/constants.glsl", "shaders/types.glsl", "shaders/uniform_blocks.glsl" };
+	Shader painter_shader{ "jj", "shaders/text/generic/texpainter.vert" ,"shaders/text/generic/texpainter.frag", 4, 3, nullptr, utils_shaders };
+	Shader mvp{ "mvp", "shaders/text/generic/mvp.vert", "shaders/text/generic/fullcolor.frag", 4 , 3, nullptr, utils_shaders };
 	Model cube_model{ "models/cube.obj" }, sphere_model{ "models/sphere.obj" }, bunny_model{ "models/bunny.obj" };
 	
 	Camera cam{ glm::vec3{0, 0, 5.f} };
+	UniformBuffer<FrameData> frame_ubo{ FRAME_DATA_BINDING, cam.frame_data() };
 
 	float avg_fps = 1.f, alpha = 0.9f;
 	float deltaTime = 0.f, lastFrameTime = 0.f;
@@ -100,10 +104,9 @@ int mainz()
 		// Clear the frame and z buffer
 		glClearColor(0.26f, 0.46f, 0.98f, 1.0f); //the "clear" color for the default frame buffer
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		frame_ubo.update(cam.frame_data());
 		mvp.bind();
 		{
-			mvp.setMat4("viewMatrix", cam.viewMatrix());
-			mvp.setMat4("projectionMatrix", cam.projectionMatrix());
 			mvp.setVec3("colorIn", glm::vec3{ 1.f, 1.f, 0 });
 			cube_model.draw();
 		}
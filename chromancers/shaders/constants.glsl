@@ -9,4 +9,27 @@
 #define MAX_POINT_LIGHTS 3
 #define MAX_SPOT_LIGHTS  3
 #define MAX_DIR_LIGHTS   3
-#define MAX_LIGHTS MAX_POINT_LIGHTS+MAX_SPOT_LIGHTS+MAX_DIR_LIGHTS
\ No newline at end of file
+#define MAX_LIGHTS MAX_POINT_LIGHTS+MAX_SPOT_LIGHTS+MAX_DIR_LIGHTS
+#define MAX_SHADOW_CASCADES 4
+
+// Directional shadow filters, named after the texels they compare (each fetch compares 2x2)
+#define SHADOW_FILTER_PCF2X2 0 // 1 fetch
+#define SHADOW_FILTER_PCF3X3 1 // 4 fetches
+#define SHADOW_FILTER_PCF4X4 2 // 9 fetches
+
+// Clustered lighting (mirror light_clusters.h)
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 32
+#define CLUSTERED_LIGHTS_BINDING 10
+#define CLUSTER_LIGHTS_BINDING   11
+
+// Parallax modes (mirror Material::ParallaxMode)
+#define PARALLAX_NONE     0
+#define PARALLAX_OFFSET   1
+#define PARALLAX_STEEP    2
+#define PARALLAX_ADAPTIVE 3
+
+// Painting
+#define MAX_PAINT_PALETTE_COLORS 8
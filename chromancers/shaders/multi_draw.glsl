@@ -0,0 +1,11 @@
+// #version 460 core
+
+// Utility shader enabling the multi-draw variant of the lit shaders (see MultiDrawBatch in multi_draw.h)
+// The model matrix and material of each draw are read from SSBOs indexed by gl_DrawID instead of uniforms,
+// so it must be prepended to shaders compiled for GLSL 4.60 or later
+
+#define MULTI_DRAW
+
+// SSBO bindings (mirror the ones of multi_draw.h)
+#define MULTI_DRAW_DATA_BINDING      5
+#define MULTI_DRAW_MATERIALS_BINDING 6
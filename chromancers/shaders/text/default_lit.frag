@@ -22,66 +22,64 @@ in VS_OUT
 	vec3 twDirLightDir  [MAX_DIR_LIGHTS];
 	vec3 twCameraPos; 
 	vec3 twNormal;
-
-	// light space data
-	vec4 lwDirFragPos[MAX_DIR_LIGHTS];
+	mat3 invTBN; // world -> tangent transform, for the clustered lights whose directions are computed per fragment
 
 	// the output variable for UV coordinates
 	vec2 interp_UV;
 } fs_in;
 
-//Lights
-uniform uint nPointLights;
-uniform uint nDirLights;
-
-uniform PointLight       pointLights      [MAX_POINT_LIGHTS];
-uniform DirectionalLight directionalLights[MAX_DIR_LIGHTS];
+// Lights come from the Lights uniform block, the clustered ones from the ClusteredLights and ClusterLights buffers
 
 // Textures
-// texture samplers
-uniform sampler2D diffuse_map        ; // TexUnit0 Main material color
-uniform sampler2D normal_map         ; // TexUnit1 Normals for detail and light computation
-uniform sampler2D displacement_map   ; // TexUnit2 Emulated vertex displacement (also known as height/depth map)
-uniform sampler2D detail_diffuse_map ; // TexUnit3 Secondary material color
-uniform sampler2D detail_normal_map  ; // TexUnit4 Secondary material color
-
-uniform sampler2D directional_shadow_maps[MAX_DIR_LIGHTS]; // TexUnit5 Shadow map 0
-uniform samplerCube point_shadow_maps[MAX_POINT_LIGHTS]; // TexUnit??
-
-uniform int sample_diffuse_map        = 0;
-uniform int sample_normal_map         = 0;
-uniform int sample_displacement_map   = 0;
-uniform int sample_detail_diffuse_map = 0;
-uniform int sample_detail_normal_map  = 0;
-
-uniform int sample_shadow_map  = 0; // receive shadows or not
-
-uniform float uv_repeat = 1; // texture repetitions
-
-// Detail map attributes
-uniform float detail_alpha_threshold = 0.7f;
-uniform float detail_diffuse_bias = 1.75f;
-uniform float detail_normal_bias = 0.05f;
-
-// Material-light attributes
-uniform vec4 ambient_color ;
-uniform vec4 diffuse_color ;
-uniform vec4 specular_color;
-
-// Ambient, diffuse, specular coefficients
-uniform float kA;
-uniform float kD;
-uniform float kS;
+// texture samplers (material texture units are fixed, see material.h)
+layout (binding = 0) uniform sampler2D diffuse_map        ; // TexUnit0 Main material color
+layout (binding = 1) uniform sampler2D normal_map         ; // TexUnit1 Normals for detail and light computation
+layout (binding = 2) uniform sampler2D displacement_map   ; // TexUnit2 Emulated vertex displacement (also known as height/depth map)
+layout (binding = 3) uniform sampler2D detail_diffuse_map ; // TexUnit3 Secondary material color (unused by paintables, whose paint is in the atlas)
+layout (binding = 4) uniform sampler2D detail_normal_map  ; // TexUnit4 Secondary material color
+
+// shadowmaps compare against the given depth, each fetch returning the bilinear blend of 4 comparisons (hardware PCF)
+uniform sampler2DArrayShadow directional_shadow_maps[MAX_DIR_LIGHTS]; // TexUnit5 Shadow map 0, one layer per cascade
+uniform samplerCubeShadow point_shadow_maps[MAX_POINT_LIGHTS]; // TexUnit??
+
+uniform int  shadow_filter = SHADOW_FILTER_PCF3X3; // footprint of the directional shadow lookups (see SHADOW_FILTER_ constants)
+uniform bool point_shadow_pcf = false;             // 4 fetches around the direction of the point shadow lookups instead of 1
+
+// Paint atlas, one texture array per paintmap format
+uniform sampler2DArray paint_atlas_rgba8; // TexUnit11 full color
+uniform sampler2DArray paint_atlas_rg8;   // TexUnit12 palette index + coverage
+uniform sampler2DArray paint_atlas_r8;    // TexUnit13 palette index (3 bits) + coverage (5 bits)
+
+// The location of each paintmap in the atlas
+layout (std430, binding = 3) readonly buffer PaintAtlasEntries
+{
+	PaintAtlasEntry paint_atlas_entries[];
+};
 
-// shininess coefficients (passed from the application)
-uniform float shininess;
+// palette used to resolve palette-indexed paintmaps
+uniform vec4 paint_palette[MAX_PAINT_PALETTE_COLORS];
 
-// uniforms for GGX model
-uniform float alpha; // rugosity - 0 : smooth, 1: rough
-uniform float F0; // fresnel reflectance at normal incidence
+// Material attributes (see MaterialData in types.glsl)
+#ifdef MULTI_DRAW
+// Materials of the current multi-draw, each draw reads the one selected by its draw data (see multi_draw.glsl)
+layout (std430, binding = MULTI_DRAW_MATERIALS_BINDING) readonly buffer MultiDrawMaterials
+{
+	MaterialData materials[];
+};
+flat in uint material_index;
+#define material materials[material_index]
+flat in uint draw_point_light_mask;
+#define point_light_mask draw_point_light_mask
+#else
+// uploaded by each material in its own buffer (mirrors Material::GPUData)
+layout (std140, binding = 3) uniform MaterialBlock
+{
+	MaterialData material;
+};
+uniform uint point_light_mask = 0xFFFFFFFFu; // bit i set if the i-th point light reaches the entity
+#endif
 
-// uniform for parallax map
-uniform float parallax_heightscale;
+uniform bool depth_only = false; // depth prepass, writing no color
 
 // Current light position
 vec3 curr_twLightDir;
@@ -91,40 +89,43 @@ vec3 twViewDir;
 vec2 finalTexCoords;
 vec3 finalNormal;
 
-vec2 CheapParallaxMapping(vec2 texCoords, vec3 viewDir)
+// Surface seen by every light (see calculateSurface)
+vec4 surfaceColor;
+vec3 surfaceNormal;
+float surfaceShininess;
+
+vec2 CheapParallaxMapping(vec2 texCoords, vec3 viewDir, vec2 dUVdx, vec2 dUVdy)
 { 
 	// Sample the heightmap
-    float height = texture(displacement_map, texCoords).r; 
+    float height = textureGrad(displacement_map, texCoords, dUVdx, dUVdy).r; 
 	// Calculate vector towards approximate height
-	vec2 p = viewDir.xy * (height * parallax_heightscale);
+	vec2 p = viewDir.xy * (height * material.parallax_heightscale);
 	// Return displacement
     return texCoords - p; 
 }
 
-vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
+// Steep parallax: ray march through the given number of depth layers, then interpolate the hit between the last two
+// Derivatives are taken once outside the loop (the march diverges between neighbouring fragments)
+vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir, float numLayers, vec2 dUVdx, vec2 dUVdy)
 { 
-    // number of depth layers
-    const float minLayers = 8;
-    const float maxLayers = 32;
-    float numLayers = mix(maxLayers, minLayers, abs(dot(vec3(0.0, 0.0, 1.0), viewDir)));  
     // calculate the size of each layer
     float layerDepth = 1.0 / numLayers;
     // depth of current layer
     float currentLayerDepth = 0.0;
     // the amount to shift the texture coordinates per layer (from vector P)
-    vec2 P = viewDir.xy / viewDir.z * parallax_heightscale; 
+    vec2 P = viewDir.xy / viewDir.z * material.parallax_heightscale; 
     vec2 deltaTexCoords = P / numLayers;
   
     // get initial values
     vec2  currentTexCoords     = texCoords;
-    float currentDepthMapValue = texture(displacement_map, currentTexCoords).r;
+    float currentDepthMapValue = textureGrad(displacement_map, currentTexCoords, dUVdx, dUVdy).r;
       
     while(currentLayerDepth < currentDepthMapValue)
     {
         // shift texture coordinates along direction of P
         currentTexCoords -= deltaTexCoords;
         // get depthmap value at current texture coordinates
-        currentDepthMapValue = texture(displacement_map, currentTexCoords).r;  
+        currentDepthMapValue = textureGrad(displacement_map, currentTexCoords, dUVdx, dUVdy).r;  
         // get depth of next layer
         currentLayerDepth += layerDepth;  
     }
@@ -134,7 +135,7 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
 
     // get depth after and before collision for linear interpolation
     float afterDepth  = currentDepthMapValue - currentLayerDepth;
-    float beforeDepth = texture(displacement_map, prevTexCoords).r - currentLayerDepth + layerDepth;
+    float beforeDepth = textureGrad(displacement_map, prevTexCoords, dUVdx, dUVdy).r - currentLayerDepth + layerDepth;
  
     // interpolation of texture coordinates
     float weight = afterDepth / (afterDepth - beforeDepth);
@@ -143,23 +144,52 @@ vec2 ParallaxMapping(vec2 texCoords, vec3 viewDir)
     return finalTexCoords;
 }
 
+// Layers of the steep parallax: more at grazing angles, where the ray travels farther across the surface,
+// and less as the displacement texels shrink on screen (a fragment covering 2^n texels needs 2^n times less layers)
+float parallaxLayers(vec3 viewDir, vec2 dUVdx, vec2 dUVdy, bool adaptive)
+{
+    float minLayers = float(material.parallax_min_layers);
+    float maxLayers = float(max(material.parallax_max_layers, material.parallax_min_layers));
+    float numLayers = mix(maxLayers, minLayers, abs(viewDir.z));
+    if(adaptive)
+    {
+        vec2 texels = vec2(textureSize(displacement_map, 0));
+        float footprint = max(length(dUVdx * texels), length(dUVdy * texels));
+        numLayers /= max(footprint, 1.0);
+    }
+    return clamp(numLayers, minLayers, maxLayers);
+}
+
 vec2 calculateTexCoords(vec2 texCoords, vec3 viewDir)
 {
 	//Repeated UV coords
-	vec2 computedTexCoords = texCoords * uv_repeat;
+	vec2 computedTexCoords = texCoords * material.uv_repeat;
+	if(material.sample_displacement_map == 0 || material.parallax_mode == PARALLAX_NONE) return computedTexCoords;
 
-	// branchless condition to avoid divergence
-	computedTexCoords = ((1 - sample_displacement_map) * computedTexCoords) + // no displacement map
-	                    ((sample_displacement_map)     * CheapParallaxMapping(computedTexCoords,  viewDir));  // use displacement map
-	
-	return computedTexCoords;
+	// derivatives are taken before any branch depending on the fragment
+	vec2 dUVdx = dFdx(computedTexCoords);
+	vec2 dUVdy = dFdy(computedTexCoords);
+
+	// adaptive parallax degrades with the distance: steep, then offset, then none
+	int mode = material.parallax_mode;
+	if(mode == PARALLAX_ADAPTIVE)
+	{
+		float view_distance = length(fs_in.vwFragPos);
+		if(view_distance > material.parallax_offset_distance) return computedTexCoords;
+		if(view_distance > material.parallax_steep_distance) mode = PARALLAX_OFFSET;
+	}
+
+	if(mode == PARALLAX_OFFSET) return CheapParallaxMapping(computedTexCoords, viewDir, dUVdx, dUVdy);
+
+	float numLayers = parallaxLayers(viewDir, dUVdx, dUVdy, mode == PARALLAX_ADAPTIVE);
+	return ParallaxMapping(computedTexCoords, viewDir, numLayers, dUVdx, dUVdy);
 }
 
 vec4 calculateSurfaceColor(vec2 texCoords)
 {
 	// branchless condition to avoid divergence
-	vec4 surface_color = ((1 - sample_diffuse_map) * diffuse_color) + // use albedo (diffuse color)
-	                     ((sample_diffuse_map)     * texture(diffuse_map, texCoords)); // use diffuse map
+	vec4 surface_color = ((1 - material.sample_diffuse_map) * material.diffuse_color) + // use albedo (diffuse color)
+	                     ((material.sample_diffuse_map)     * texture(diffuse_map, texCoords)); // use diffuse map
 
 	return surface_color;
 }
@@ -167,8 +197,8 @@ vec4 calculateSurfaceColor(vec2 texCoords)
 vec4 calculateDetailColor(vec2 texCoords)
 {
 	// branchless condition to avoid divergence
-	vec4 detail_color = ((1 - sample_detail_diffuse_map) * 0) + // don't consider detail
-	                    ((sample_detail_diffuse_map)     * texture(detail_diffuse_map, texCoords)); // use detail map
+	vec4 detail_color = ((1 - material.sample_detail_diffuse_map) * 0) + // don't consider detail
+	                    ((material.sample_detail_diffuse_map)     * texture(detail_diffuse_map, texCoords)); // use detail map
 
 	return detail_color;
 }
@@ -200,8 +230,77 @@ vec4 texturePCF(sampler2D map, vec2 interp_UV)
 	return sampled;
 }
 
-// Compute shadow from a directional shadow map
-float calculateShadow(sampler2D shadow_map, vec4 lwFragPos, vec3 wLightDir, vec3 normal)
+// Resolve a palette-indexed texel into its palette color, premultiplied by the paint coverage
+vec4 decodePaletteTexel(vec4 texel, int format)
+{
+	uint index; float coverage;
+	if(format == 1)
+	{
+		index = uint(round(texel.r * 255)); coverage = texel.g;
+	}
+	else
+	{
+		uint packed = uint(round(texel.r * 255));
+		index = packed >> 5; coverage = float(packed & 31u) / 31;
+	}
+
+	vec4 color = paint_palette[min(index, uint(MAX_PAINT_PALETTE_COLORS - 1))];
+	return vec4(color.rgb * coverage, coverage);
+}
+
+// Same averaging filter as texturePCF, applied to the paintmap of an atlas entry:
+// taps are kept inside the entry region so neighbouring paintmaps never bleed in,
+// and palette indices (which can't be interpolated) are fetched and resolved before filtering
+vec4 samplePaintAtlas(int entry_index, vec2 interp_UV)
+{
+	PaintAtlasEntry entry = paint_atlas_entries[entry_index];
+	vec4 sampled = vec4(0);
+
+	if(entry.format == 0)
+	{
+		vec2 texelSize = 1.0 / textureSize(paint_atlas_rgba8, 0).xy;
+		vec2 region_min = entry.scale_offset.zw + 0.5 * texelSize;
+		vec2 region_max = entry.scale_offset.zw + entry.scale_offset.xy - 0.5 * texelSize;
+		vec2 uv = entry.scale_offset.zw + clamp(interp_UV, 0, 1) * entry.scale_offset.xy;
+		for(int x = -1; x <= 1; ++x)
+		{
+			for(int y = -1; y <= 1; ++y)
+			{
+				sampled += texture(paint_atlas_rgba8, vec3(clamp(uv + vec2(x, y) * texelSize, region_min, region_max), entry.layer)); 
+			}    
+		}
+	}
+	else
+	{
+		ivec2 size = entry.texel_region.zw;
+		ivec2 texel = ivec2(clamp(interp_UV, 0, 1) * size);
+		for(int x = -1; x <= 1; ++x)
+		{
+			for(int y = -1; y <= 1; ++y)
+			{
+				ivec3 coords = ivec3(entry.texel_region.xy + clamp(texel + ivec2(x, y), ivec2(0), size - 1), entry.layer);
+				vec4 value = entry.format == 1 ? texelFetch(paint_atlas_rg8, coords, 0) : texelFetch(paint_atlas_r8, coords, 0);
+				sampled += decodePaletteTexel(value, entry.format); 
+			}    
+		}
+	}
+	sampled /= 9.0;
+
+	return sampled;
+}
+
+// Select the cascade of a directional light covering a fragment at the given view depth (-1 if beyond the last one)
+int selectCascade(DirectionalLight light, float view_depth)
+{
+	for(int i = 0; i < light.cascade_count; i++)
+	{
+		if(view_depth < light.cascade_splits[i]) return i;
+	}
+	return -1;
+}
+
+// Compute shadow from a cascade of a directional shadow map
+float calculateShadow(sampler2DArrayShadow shadow_map, int cascade, vec4 lwFragPos, vec3 wLightDir, vec3 normal)
 {
 	// perform perspective divide
     vec3 projCoords = lwFragPos.xyz / lwFragPos.w;
@@ -209,104 +308,120 @@ float calculateShadow(sampler2D shadow_map, vec4 lwFragPos, vec3 wLightDir, vec3
 	// normalize coordinates to be within [0,1] instead of NDC range [-1,1]
 	projCoords = projCoords * 0.5 + 0.5; 
 
-	// get fragment depth
-	float currentDepth = projCoords.z;  
+	// don't affect areas outside the shadow_map
+	if(projCoords.z > 1.0)
+        return 0.0;
 
 	// calculate bias to solve shadow acne 
 	float shadow_factor = dot(normal, wLightDir);
 	float bias = max(0.01 * (1.0 - shadow_factor), 0.005);
 
-	// sample the depthmap obtained from the light POV
-	float closestDepth = texture(shadow_map, projCoords.xy).r;
-	// if fragment has greater depth, then something occluded it from light POV, thus is in shadow
-	float shadow = currentDepth - bias > closestDepth  ? 1.0 : 0.0; 
-	
-	// PCF-filtered shadow sampling
-	shadow = 0.0;
-    vec2 texelSize = 1.0 / textureSize(shadow_map, 0);
-    for(int x = -1; x <= 1; ++x)
-    {
-        for(int y = -1; y <= 1; ++y)
-        {
-			// sample the depthmap obtained from the light POV through the filtering mask
-            float pcfDepth = texture(shadow_map, projCoords.xy + vec2(x, y) * texelSize).r; 
-            shadow += currentDepth - bias > pcfDepth  ? 1.0 : 0.0;        
-        }    
-    }
-	// Average-out the filtering mask
-    shadow /= 9.0;
+	// fragment depth to compare against the depthmap obtained from the light POV (lit where it is not farther than the stored one)
+	float referenceDepth = projCoords.z - bias;
+    vec2 texelSize = 1.0 / textureSize(shadow_map, 0).xy;
 
-	// don't affect areas outside the shadow_map
-	if(projCoords.z > 1.0)
-        shadow = 0.0;
+	// PCF-filtered shadow sampling, every fetch already blends a 2x2 block of comparisons
+	float lit = 0.0;
+	if(shadow_filter == SHADOW_FILTER_PCF2X2)
+	{
+		lit = texture(shadow_map, vec4(projCoords.xy, cascade, referenceDepth));
+	}
+	else if(shadow_filter == SHADOW_FILTER_PCF3X3)
+	{
+		// 4 fetches half a texel apart cover a 3x3 block, weighted as a tent
+		for(int x = 0; x < 2; ++x)
+			for(int y = 0; y < 2; ++y)
+				lit += texture(shadow_map, vec4(projCoords.xy + (vec2(x, y) - 0.5) * texelSize, cascade, referenceDepth));
+		lit /= 4.0;
+	}
+	else
+	{
+		// 9 fetches (as many as the texels of a manual 3x3 PCF) cover a 4x4 block
+		for(int x = -1; x <= 1; ++x)
+			for(int y = -1; y <= 1; ++y)
+				lit += texture(shadow_map, vec4(projCoords.xy + vec2(x, y) * texelSize, cascade, referenceDepth));
+		lit /= 9.0;
+	}
 
-	return shadow;
+	return 1.0 - lit;
 }
 
 // Compute shadow from a pointlight shadow cube
-float calculateShadow(samplerCube shadow_cube, vec3 wFragPos, vec3 wLightPos, float far_plane /* TODO temp*/)
+float calculateShadow(samplerCubeShadow shadow_cube, vec3 wFragPos, vec3 wLightPos, float far_plane /* TODO temp*/)
 {
     // get vector between fragment position and light position
     vec3 fragToLight = wFragPos - wLightPos;
-    // use the light to fragment vector to sample from the depth map    
-    float closestDepth = texture(shadow_cube, fragToLight).r;
-    // it is currently in linear range between [0,1]. Re-transform back to original value
-    closestDepth *= far_plane;
     // now get current linear depth as the length between the fragment and light position
     float currentDepth = length(fragToLight);
-    // now test for shadows
+    // the cube stores the linear depth in range [0,1], so the biased reference is mapped the same way
     float bias = 0.05; 
-    float shadow = currentDepth -  bias > closestDepth ? 1.0 : 0.0;
+    float referenceDepth = (currentDepth - bias) / far_plane;
 
-	// No PCF for shadow cube or performance tanks :(
+	// A single fetch is already a 2x2 PCF on the face it lands on
+	if(!point_shadow_pcf)
+		return 1.0 - texture(shadow_cube, vec4(fragToLight, referenceDepth));
 
-    return shadow;
-} 
+	// Cheap PCF: 4 fetches half a texel away along the axes of the face plane, about a 3x3 block
+	vec3 axis = abs(fragToLight.y) < 0.99 * currentDepth ? vec3(0, 1, 0) : vec3(1, 0, 0);
+	vec3 tangent = normalize(cross(fragToLight, axis));
+	vec3 bitangent = cross(normalize(fragToLight), tangent);
+	float texelSpan = currentDepth / float(textureSize(shadow_cube, 0).x); // half the world size of a face texel at this distance (a face spans 2 units at distance 1)
 
-// Simple blinn phong lighting solution
-vec3 BlinnPhong()
-{
-	float shininess_factor = shininess;
+	float lit = 0.0;
+	lit += texture(shadow_cube, vec4(fragToLight + tangent   * texelSpan, referenceDepth));
+	lit += texture(shadow_cube, vec4(fragToLight - tangent   * texelSpan, referenceDepth));
+	lit += texture(shadow_cube, vec4(fragToLight + bitangent * texelSpan, referenceDepth));
+	lit += texture(shadow_cube, vec4(fragToLight - bitangent * texelSpan, referenceDepth));
 
-	// ambient component 
-	vec3 ambient_component = kA * ambient_color.rgb;
-
-	// view direction
-	vec3 V = twViewDir;
+    return 1.0 - lit / 4.0;
+} 
 
-    vec2 final_texCoords = finalTexCoords;
+// Surface attributes shared by every light: the material, detail and paint textures are sampled once per fragment
+void calculateSurface()
+{
+	surfaceShininess = material.shininess;
 
 	// obtain normal from primary normal map
 	vec3 N = finalNormal;
-	vec4 surface_color = diffuse_color;
-	vec4 diffuse_map_color = texture(diffuse_map, final_texCoords);
+	surfaceColor = material.diffuse_color;
+	vec4 diffuse_map_color = texture(diffuse_map, finalTexCoords);
 
-	vec4 detail_diffuse_color = texturePCF(detail_diffuse_map, fs_in.interp_UV);
+	vec4 detail_diffuse_color = material.paint_atlas_entry >= 0 ? samplePaintAtlas(material.paint_atlas_entry, fs_in.interp_UV) : texturePCF(detail_diffuse_map, fs_in.interp_UV);
 
-	if(sample_diffuse_map == 1)
-		surface_color = diffuse_map_color;
+	if(material.sample_diffuse_map == 1)
+		surfaceColor = diffuse_map_color;
 
-	if(sample_detail_diffuse_map == 1 && sample_detail_normal_map == 1)
+	if((material.sample_detail_diffuse_map == 1 || material.paint_atlas_entry >= 0) && material.sample_detail_normal_map == 1)
 	{
-		if(detail_diffuse_color.a > detail_alpha_threshold)
+		if(detail_diffuse_color.a > material.detail_alpha_threshold)
 		{
 			float ft = detail_diffuse_color.a;
-			N += calculateNormal(detail_normal_map, sample_detail_normal_map, fs_in.twNormal, finalTexCoords) * detail_normal_bias * ft;
-			surface_color = mix(surface_color, detail_diffuse_color * detail_diffuse_bias, ft);
+			N += calculateNormal(detail_normal_map, material.sample_detail_normal_map, fs_in.twNormal, finalTexCoords) * material.detail_normal_bias * ft;
+			surfaceColor = mix(surfaceColor, detail_diffuse_color * material.detail_diffuse_bias, ft);
 			
 			float detail_shininess = 512.f;
-			shininess_factor = mix(shininess_factor, detail_shininess, ft);
+			surfaceShininess = mix(surfaceShininess, detail_shininess, ft);
 		}
 	}
-	
+
+	surfaceNormal = normalize(N);
+}
+
+// Simple blinn phong lighting solution: diffuse and specular contribution of the light coming from the current direction
+// (the surface comes from calculateSurface, the ambient term is added once per fragment)
+vec3 BlinnPhong()
+{
+	// view direction
+	vec3 V = twViewDir;
+	vec3 N = surfaceNormal;
+
 	// normalization of the per-fragment light incidence direction
 	vec3 L = normalize(curr_twLightDir);
 	
 	// Lambert coefficient
-	N = normalize(N);
 	float lambertian = max(dot(L,N), 0.0);
 	
-	vec3 final_color = ambient_component;
+	vec3 final_color = vec3(0);
 
 	// if the lambert coefficient is positive, then we calculate the specular component
 	if(lambertian > 0.0)
@@ -316,13 +431,13 @@ vec3 BlinnPhong()
 		// we use H to calculate the specular component
 		float specAngle = max(dot(H, N), 0.0);
 		// shininess application to the specular component
-		float spec = pow(specAngle, shininess_factor);
+		float spec = pow(specAngle, surfaceShininess);
 
 		// calculate diffuse component
-		vec3 diffuse_component = kD * lambertian * surface_color.rgb;
+		vec3 diffuse_component = material.kD * lambertian * surfaceColor.rgb;
 
 		// calculate specular component
-		vec3 specular_component = kS * spec * specular_color.rgb;
+		vec3 specular_component = material.kS * spec * material.specular_color.rgb;
 		
 		// We add diffusive and specular components to the final color
 		// N.B. ): in this implementation, the sum of the components can be different than 1
@@ -338,6 +453,9 @@ vec3 calculatePointLights()
 
 	for(int i = 0; i < nPointLights; i++)
 	{
+		// Lights out of reach of the whole draw are skipped with their shadow lookup (the mask is the same for every fragment of a draw)
+		if ((point_light_mask & (1u << i)) == 0) continue;
+
 		curr_twLightDir = normalize(fs_in.twPointLightDir[i]);
 		float light_distance = length(fs_in.wPointLightDir[i]);
 		float attenuation = 0.001f + // to avoid division by zero
@@ -345,7 +463,7 @@ vec3 calculatePointLights()
 							pointLights[i].attenuation_linear * light_distance +
 							pointLights[i].attenuation_quadratic * light_distance * light_distance;
 
-		float shadow = calculateShadow(point_shadow_maps[i], fs_in.wFragPos, pointLights[i].position, 25.f) * sample_shadow_map;
+		float shadow = calculateShadow(point_shadow_maps[i], fs_in.wFragPos, pointLights[i].position, 25.f) * material.sample_shadow_map;
 
 		color += (1 - shadow) * BlinnPhong() * pointLights[i].color.rgb * pointLights[i].intensity * (1.f/attenuation);
 	}
@@ -353,6 +471,37 @@ vec3 calculatePointLights()
 	return color;
 }
 
+// Compute fragment's lighting from the clustered lights reaching the cluster of the fragment
+vec3 calculateClusteredLights()
+{
+	vec3 color = vec3(0);
+
+	vec4 cFragPos = projectionMatrix * vec4(fs_in.vwFragPos, 1);
+	uint base = clusterIndex(cFragPos.xy / cFragPos.w, -fs_in.vwFragPos.z) * (MAX_LIGHTS_PER_CLUSTER + 1);
+	uint count = min(clusterLights[base], MAX_LIGHTS_PER_CLUSTER);
+
+	for(uint i = 0; i < count; i++)
+	{
+		ClusteredLight light = clusteredLights[clusterLights[base + 1 + i]];
+		vec3 wLightDir = light.position - fs_in.wFragPos;
+		float light_distance = length(wLightDir);
+		if(light_distance >= light.radius) continue;
+
+		curr_twLightDir = normalize(fs_in.invTBN * wLightDir);
+		float attenuation = 0.001f + // to avoid division by zero
+							light.attenuation.x +
+							light.attenuation.y * light_distance +
+							light.attenuation.z * light_distance * light_distance;
+
+		// fade to zero at the radius, so the light doesn't end abruptly at the cluster borders
+		float window = clamp(1 - pow(light_distance / light.radius, 4), 0, 1);
+
+		color += BlinnPhong() * light.color.rgb * light.intensity * (window * window / attenuation);
+	}
+
+	return color;
+}
+
 // Compute fragment's lighting from directional lights 
 vec3 calculateDirLights()
 {
@@ -362,7 +511,14 @@ vec3 calculateDirLights()
 	{
 		curr_twLightDir = normalize(fs_in.twDirLightDir[i]);
 
-		float shadow = calculateShadow(directional_shadow_maps[i], fs_in.lwDirFragPos[i], fs_in.wDirLightDir[i], finalNormal) * sample_shadow_map;
+		// Fragments beyond the last cascade are left unshadowed
+		float shadow = 0;
+		int cascade = selectCascade(directionalLights[i], -fs_in.vwFragPos.z);
+		if(cascade >= 0)
+		{
+			vec4 lwFragPos = directionalLights[i].lightspace_matrices[cascade] * vec4(fs_in.wFragPos, 1);
+			shadow = calculateShadow(directional_shadow_maps[i], cascade, lwFragPos, fs_in.wDirLightDir[i], finalNormal) * material.sample_shadow_map;
+		}
 
 		color += (1 - shadow) * BlinnPhong() * directionalLights[i].color.rgb * directionalLights[i].intensity;
 	}
@@ -372,13 +528,21 @@ vec3 calculateDirLights()
 
 void main()
 {
+	// Depth prepass: same program and vertex path as the shading pass, so its depth passes GL_EQUAL, but nothing to shade
+	if(depth_only) return;
+
 	vec3 color = vec3(0);
 
 	twViewDir = normalize( fs_in.twCameraPos - fs_in.twFragPos );
 	finalTexCoords = calculateTexCoords(fs_in.interp_UV, twViewDir);
-	finalNormal = calculateNormal(normal_map, sample_normal_map, fs_in.twNormal, finalTexCoords);
-	
+	finalNormal = calculateNormal(normal_map, material.sample_normal_map, fs_in.twNormal, finalTexCoords);
+	calculateSurface();
+
+	// ambient component, once per fragment rather than once per light
+	color += material.kA * material.ambient_color.rgb;
+
 	color += calculatePointLights();
+	color += calculateClusteredLights();
 	color += calculateDirLights();
 
 	colorFrag = vec4(color, 1.0f);
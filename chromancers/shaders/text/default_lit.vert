@@ -26,28 +26,31 @@ out VS_OUT
 	vec3 twDirLightDir  [MAX_DIR_LIGHTS];
 	vec3 twCameraPos; 
 	vec3 twNormal;
-
-	// light space data (l = transformed by lightProjMatrix * lightViewMatrix)
-	vec4 lwDirFragPos[MAX_DIR_LIGHTS]; // fragment position in light space for directional lights
+	mat3 invTBN; // world -> tangent transform, for the clustered lights whose directions are computed per fragment
 
 	// the output variable for UV coordinates
 	vec2 interp_UV;
 } vs_out;
 
+#ifdef MULTI_DRAW
+// Data of the draws of the current multi-draw, each draw reads its own entry through gl_DrawID (see multi_draw.glsl)
+layout (std430, binding = MULTI_DRAW_DATA_BINDING) readonly buffer MultiDrawData
+{
+	DrawData draws[];
+};
+flat out uint material_index;
+flat out uint draw_point_light_mask;
+#define modelMatrix draws[gl_DrawID].model_matrix
+#define point_light_mask draws[gl_DrawID].point_light_mask
+#else
 uniform mat4 modelMatrix      = mat4(1);
-uniform mat4 viewMatrix       = mat4(1);
-uniform mat4 projectionMatrix = mat4(1);
+uniform uint point_light_mask = 0xFFFFFFFFu; // bit i set if the i-th point light reaches the entity (see Scene::point_light_influences)
+#endif
 
-//Lights
-uniform uint nPointLights;
-uniform uint nDirLights  ;
-uniform uint nSpotLights ;
+// Camera (viewMatrix, projectionMatrix, wCameraPos) and lights come from the FrameData and Lights uniform blocks
 
-uniform PointLight       pointLights      [MAX_POINT_LIGHTS];
-uniform DirectionalLight directionalLights[MAX_DIR_LIGHTS];
-uniform SpotLight        spotLights       [MAX_SPOT_LIGHTS];
-
-uniform vec3 wCameraPos = vec3(0);
+// The depth prepass runs this same program (depth_only in the fragment shader), so the fragments can be tested with GL_EQUAL against its depth
+invariant gl_Position;
 
 mat3 invTBN; // Inverse TangentBitangentNormal space transformation matrix
 
@@ -75,11 +78,6 @@ void calculateSpotLightTangentDir(uint light_idx)
 	
 }
 
-void calculateDirLightSpaceFragPos(uint light_idx)
-{
-	vs_out.lwDirFragPos[light_idx] = directionalLights[light_idx].lightspace_matrix * vec4(vs_out.wFragPos, 1);
-}
-
 void calculatePointLightSpaceFragPos(uint light_idx)
 {
 
@@ -104,6 +102,11 @@ mat3 calculateInverseTBN(mat3 worldNormalMatrix, vec3 normal_vec, vec3 tangent_v
 
 void main()
 {
+#ifdef MULTI_DRAW
+	material_index = draws[gl_DrawID].material_index;
+	draw_point_light_mask = point_light_mask;
+#endif
+
 	// we prefer calcs in the vertex shader since it is called less, thus less expensive computationally over time
 	mat3 worldNormalMatrix = transpose(inverse(mat3(modelMatrix))); // this matrix updates normals to follow world/model matrix transformations
 
@@ -122,19 +125,20 @@ void main()
 	//vec3 wN = worldNormalMatrix * normal;
 	vs_out.twNormal = normalize(invTBN * worldNormalMatrix * normal);
 	vs_out.twCameraPos = invTBN * wCameraPos;
+	vs_out.invTBN = invTBN;
 
 	vs_out.interp_UV = UV;
 	
 	// calculate light related data
 	for(uint i = 0; i < nPointLights; i++)
 	{
+		if ((point_light_mask & (1u << i)) == 0) continue; // out of reach, skipped by the fragment shader too
 		calculatePointLightTangentDir(i);
 	}
 
 	for(uint i = 0; i < nDirLights; i++)
 	{
 		calculateDirLightTangentDir(i);
-		calculateDirLightSpaceFragPos(i);
 	}
 
 	// transformations are applied to each vertex
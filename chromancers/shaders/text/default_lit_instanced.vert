@@ -28,33 +28,24 @@ out VS_OUT
 	vec3 twDirLightDir  [MAX_DIR_LIGHTS];
 	vec3 twCameraPos; 
 	vec3 twNormal;
-
-	// light space data (l = transformed by lightProjMatrix * lightViewMatrix) (needed for shadow calcs)
-	vec4 lwDirFragPos[MAX_DIR_LIGHTS]; // fragment position in light space for directional lights
+	mat3 invTBN; // world -> tangent transform, for the clustered lights whose directions are computed per fragment
 
 	// the output variable for UV coordinates
 	vec2 interp_UV;
 } vs_out;
 
-layout (std430, binding = 0) buffer InstanceGroupTransforms
+// Transforms of the instances, either as 3 rows of an affine matrix (compact) or as the 4 columns of a mat4
+layout (std430, binding = 0) readonly buffer InstanceGroupTransforms
 {
-	mat4 instance_transforms[];
+	vec4 instance_transforms[];
 };
 
-uniform mat4 modelMatrix      = mat4(1);
-uniform mat4 viewMatrix       = mat4(1);
-uniform mat4 projectionMatrix = mat4(1);
-
-//Lights
-uniform uint nPointLights;
-uniform uint nDirLights  ;
-uniform uint nSpotLights ;
+uniform bool compact_instances = false;
 
-uniform PointLight       pointLights      [MAX_POINT_LIGHTS];
-uniform DirectionalLight directionalLights[MAX_DIR_LIGHTS];
-uniform SpotLight        spotLights       [MAX_SPOT_LIGHTS];
+uniform mat4 modelMatrix      = mat4(1);
+uniform uint point_light_mask = 0xFFFFFFFFu; // bit i set if the i-th point light reaches any instance of the group (see Scene::point_light_influences)
 
-uniform vec3 wCameraPos = vec3(0);
+// Camera (viewMatrix, projectionMatrix, wCameraPos) and lights come from the FrameData and Lights uniform blocks
 
 mat3 invTBN; // Inverse TangentBitangentNormal space transformation matrix
 
@@ -82,11 +73,6 @@ void calculateSpotLightTangentDir(uint light_idx)
 	
 }
 
-void calculateDirLightSpaceFragPos(uint light_idx)
-{
-	vs_out.lwDirFragPos[light_idx] = directionalLights[light_idx].lightspace_matrix * vec4(vs_out.wFragPos, 1);
-}
-
 void calculatePointLightSpaceFragPos(uint light_idx)
 {
 
@@ -109,9 +95,20 @@ mat3 calculateInverseTBN(mat3 worldNormalMatrix, vec3 normal_vec, vec3 tangent_v
 	return transpose(mat3(T, B, N)); 
 }
 
+mat4 instanceTransform(int instance)
+{
+	if (compact_instances)
+	{
+		int i = instance * 3;
+		return transpose(mat4(instance_transforms[i], instance_transforms[i + 1], instance_transforms[i + 2], vec4(0, 0, 0, 1)));
+	}
+	int i = instance * 4;
+	return mat4(instance_transforms[i], instance_transforms[i + 1], instance_transforms[i + 2], instance_transforms[i + 3]);
+}
+
 void main()
 {
-	mat4 worldMatrix = instance_transforms[gl_InstanceID] * modelMatrix;
+	mat4 worldMatrix = instanceTransform(gl_InstanceID) * modelMatrix;
 	// we calculate the inverse transform matrix to transform coords world space -> tangent space
 	// we prefer calcs in the vertex shader since it is called less, thus less expensive computationally over time
 	mat3 worldNormalMatrix = transpose(inverse(mat3(worldMatrix))); // this matrix updates normals to follow world/model matrix transformations
@@ -130,19 +127,20 @@ void main()
 	//vs_out.wNormal = normalize(worldNormalMatrix * normal);
 	vs_out.twNormal = normalize(invTBN * worldNormalMatrix * normal);
 	vs_out.twCameraPos = invTBN * wCameraPos;
+	vs_out.invTBN = invTBN;
 
 	vs_out.interp_UV = UV;
 	
 	// calculate light related data
 	for(uint i = 0; i < nPointLights; i++)
 	{
+		if ((point_light_mask & (1u << i)) == 0) continue; // out of reach, skipped by the fragment shader too
 		calculatePointLightTangentDir(i);
 	}
 
 	for(uint i = 0; i < nDirLights; i++)
 	{
 		calculateDirLightTangentDir(i);
-		calculateDirLightSpaceFragPos(i);
 	}
 
 	// transformations are applied to each vertex
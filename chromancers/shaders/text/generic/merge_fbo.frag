@@ -5,24 +5,82 @@ out vec4 FragColor;
 uniform sampler2D fbo0_color;
 uniform sampler2D fbo0_depth;
 
+// The second image may have a lower resolution than the first one (e.g. half-res paintballs)
 uniform sampler2D fbo1_color;
 uniform sampler2D fbo1_depth;
 
+uniform float near_plane = 0.1f;
+uniform float far_plane  = 100.f;
+
+// How quickly low-res samples lose weight as their depth moves away from the nearest one (in linear depth units)
+uniform float upsample_depth_sharpness = 4.f;
+
 in vec2 TexCoords;
 
+// Since the depth map is not linear, we need to linearize it
+float LinearizeDepth(float depth) 
+{
+    float z = depth * 2.0 - 1.0; // back to NDC 
+    return (2.0 * near_plane * far_plane) / (far_plane + near_plane - z * (far_plane - near_plane));	
+}
+
+// Depth-aware (bilateral) upsample of the second image: the four low-res texels around the fragment are bilinearly weighted,
+// discarding the ones hidden behind the full-res first image depth (so paint doesn't bleed over the edges of closer objects)
+// and favouring the ones whose depth is close to the nearest visible one (so separate layers of paint don't mix)
+void upsample(float depth0, out vec4 color1, out float depth1)
+{
+    vec2 size = textureSize(fbo1_color, 0);
+    vec2 coords = TexCoords * size - 0.5;
+    ivec2 base = ivec2(floor(coords));
+    vec2 f = fract(coords);
+
+    vec4  colors[4];
+    float depths[4];
+    float bilinear[4] = float[](( 1 - f.x) * (1 - f.y), f.x * (1 - f.y), (1 - f.x) * f.y, f.x * f.y);
+
+    depth1 = 1.0;
+    for (int i = 0; i < 4; ++i)
+    {
+        ivec2 texel = clamp(base + ivec2(i % 2, i / 2), ivec2(0), ivec2(size) - 1);
+        colors[i] = texelFetch(fbo1_color, texel, 0);
+        depths[i] = texelFetch(fbo1_depth, texel, 0).r;
+
+        // Hidden samples are treated as empty
+        if (depths[i] > depth0) { colors[i] = vec4(0); depths[i] = 1.0; }
+        depth1 = min(depth1, depths[i]);
+    }
+
+    float nearest = LinearizeDepth(depth1);
+    vec4 sum = vec4(0); float weights = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        // Empty samples only soften the paint borders, they don't take part in the depth test
+        float depth_distance = depths[i] < 1.0 ? abs(LinearizeDepth(depths[i]) - nearest) : 0;
+        float weight = bilinear[i] * exp(-depth_distance * upsample_depth_sharpness) + 1e-4;
+        sum += colors[i] * weight;
+        weights += weight;
+    }
+    color1 = sum / weights;
+}
+
 // Shader capable to merge two color images together by using their relative
 // depth images to decide which color sample is in front of the other
 void main()
 {
     ivec2 texcoord = ivec2(floor(gl_FragCoord.xy));
 
-	// Fetch depths
+	// Fetch depths and colors
     float depth0 = texelFetch(fbo0_depth, texcoord, 0).r;
-    float depth1 = texelFetch(fbo1_depth, texcoord, 0).r;
-
-	// Fetch colors
     vec4 color0 = texelFetch(fbo0_color, texcoord, 0);
-    vec4 color1 = texelFetch(fbo1_color, texcoord, 0);
+
+    float depth1; vec4 color1;
+    if (textureSize(fbo1_color, 0) == textureSize(fbo0_color, 0))
+    {
+        depth1 = texelFetch(fbo1_depth, texcoord, 0).r;
+        color1 = texelFetch(fbo1_color, texcoord, 0);
+    }
+    else
+        upsample(depth0, color1, depth1);
 
     vec4 final_color;
     
@@ -39,4 +97,4 @@ void main()
     }
 
     FragColor = final_color;
-}
\ No newline at end of file
+}
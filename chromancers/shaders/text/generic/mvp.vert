@@ -2,11 +2,9 @@
 
 layout (location = 0) in vec3 pos;
 
-out gl_PerVertex { vec4 gl_Position; };
+out gl_PerVertex { invariant vec4 gl_Position; }; // invariant, as the depth prepass computing the same position
 
-uniform mat4 modelMatrix      = mat4(1);
-uniform mat4 viewMatrix       = mat4(1);
-uniform mat4 projectionMatrix = mat4(1);
+uniform mat4 modelMatrix      = mat4(1); // view and projection matrices come from the FrameData uniform block
 
 // Simple vertex shader, transforms the vertex position by using the MVP matrices
 void main()
@@ -0,0 +1,136 @@
+#version 430 core
+
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// Shader fusing the end of the paintball post-processing chain into a single full-screen pass:
+// the last blur iteration (optional), the smoothstep color levels of paintstep.frag and the depth-based merge of merge_fbo.frag
+// The intermediate results never go through memory, every paintball texel is blurred and leveled right before being merged
+
+// World image
+uniform sampler2D world_color;
+uniform sampler2D world_depth;
+
+// Paintballs image (the result of the previous blur iterations) and its depth, possibly at a lower resolution
+uniform sampler2D paint_image;
+uniform sampler2D paint_depth;
+
+uniform float near_plane = 0.1f;
+uniform float far_plane  = 100.f;
+
+// Last blur iteration parameters (see paintblur.frag)
+uniform bool  fuse_blur = false;
+uniform bool  horizontal = false;
+uniform float blur_strength = 1.f;
+uniform bool  ignore_alpha = false;
+uniform float depth_offset = 1.f;
+
+// Color levels parameters (see paintstep.frag)
+uniform float t0_color = 0.1f;
+uniform float t1_color = 0.5f;
+uniform float t0_alpha = 0.7f;
+uniform float t1_alpha = 0.9f;
+
+// Upsampling parameters (see merge_fbo.frag)
+uniform float upsample_depth_sharpness = 4.f;
+
+// The equivalent blur kernel is a 9x9 gaussian mask
+float weights[5] = float[] (0.227027, 0.1945946, 0.1216216, 0.054054, 0.016216);
+
+// Since the depth map is not linear, we need to linearize it
+float LinearizeDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0; // back to NDC
+    return (2.0 * near_plane * far_plane) / (far_plane + near_plane - z * (far_plane - near_plane));
+}
+
+// Same as paintblur.frag, centered on the given paint texel
+vec4 blur(ivec2 texel)
+{
+    vec2 size = textureSize(paint_image, 0);
+    vec2 uv = (texel + 0.5) / size;
+
+    float linear_depth = LinearizeDepth(texelFetch(paint_depth, texel, 0).r) + depth_offset;
+    vec2 tex_offset = (blur_strength / linear_depth) / size;
+    vec2 blur_step = horizontal ? vec2(tex_offset.x, 0.0) : vec2(0.0, tex_offset.y);
+
+    vec4 result = texture(paint_image, uv) * weights[0];
+    for(int i = 1; i < 5; ++i)
+    {
+        result += texture(paint_image, uv + blur_step * i) * weights[i];
+        result += texture(paint_image, uv - blur_step * i) * weights[i];
+    }
+
+    return ignore_alpha ? vec4(result.rgb, 1.0) : result;
+}
+
+// Final paintball color of a paint texel: last blur iteration then color levels
+vec4 paintTexel(ivec2 texel)
+{
+    vec4 sampled = fuse_blur ? blur(texel) : texelFetch(paint_image, texel, 0);
+    return vec4(smoothstep(t0_color, t1_color, sampled.rgb), smoothstep(t0_alpha, t1_alpha, sampled.a));
+}
+
+// Same depth-aware upsample as merge_fbo.frag, leveling each low-res texel before filtering
+void upsample(float depth0, out vec4 color1, out float depth1)
+{
+    vec2 size = textureSize(paint_image, 0);
+    vec2 coords = TexCoords * size - 0.5;
+    ivec2 base = ivec2(floor(coords));
+    vec2 f = fract(coords);
+
+    vec4  colors[4];
+    float depths[4];
+    float bilinear[4] = float[](( 1 - f.x) * (1 - f.y), f.x * (1 - f.y), (1 - f.x) * f.y, f.x * f.y);
+
+    depth1 = 1.0;
+    for (int i = 0; i < 4; ++i)
+    {
+        ivec2 texel = clamp(base + ivec2(i % 2, i / 2), ivec2(0), ivec2(size) - 1);
+        depths[i] = texelFetch(paint_depth, texel, 0).r;
+
+        // Hidden samples are treated as empty
+        if (depths[i] > depth0) { colors[i] = vec4(0); depths[i] = 1.0; }
+        else colors[i] = paintTexel(texel);
+        depth1 = min(depth1, depths[i]);
+    }
+
+    float nearest = LinearizeDepth(depth1);
+    vec4 sum = vec4(0); float total_weight = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        float depth_distance = depths[i] < 1.0 ? abs(LinearizeDepth(depths[i]) - nearest) : 0;
+        float weight = bilinear[i] * exp(-depth_distance * upsample_depth_sharpness) + 1e-4;
+        sum += colors[i] * weight;
+        total_weight += weight;
+    }
+    color1 = sum / total_weight;
+}
+
+void main()
+{
+    ivec2 texcoord = ivec2(floor(gl_FragCoord.xy));
+
+    float depth0 = texelFetch(world_depth, texcoord, 0).r;
+    vec4 color0 = texelFetch(world_color, texcoord, 0);
+
+    float depth1; vec4 color1;
+    if (textureSize(paint_image, 0) == textureSize(world_color, 0))
+    {
+        depth1 = texelFetch(paint_depth, texcoord, 0).r;
+        color1 = paintTexel(texcoord);
+    }
+    else
+        upsample(depth0, color1, depth1);
+
+    vec4 final_color;
+
+	// Blend the colors by using the alpha of the least deep sample
+    if (depth0 <= depth1)
+        final_color = color0 * color0.a + color1 * (1 - color0.a);
+    else
+        final_color = color1 * color1.a + color0 * (1 - color1.a);
+
+    FragColor = final_color;
+}
@@ -0,0 +1,15 @@
+#version 430 core
+layout (location = 0) in vec3 position;
+
+uniform mat4 modelMatrix;
+uniform mat4 lightspace_matrix; // of the cube face being drawn
+
+out vec4 lwFragPos;
+
+// Vertex shader drawing the caster into a single cube face, attached as the only layer of the framebuffer
+// Part of the pointlight shadow cube computation
+void main()
+{
+    lwFragPos = modelMatrix * vec4(position, 1.0);
+    gl_Position = lightspace_matrix * lwFragPos;
+}
@@ -0,0 +1,17 @@
+#version 430 core
+layout (location = 0) in vec3 position;
+
+// Transforms of the instances, as 3 rows of an affine matrix (see Scene::draw_instanced_shadow_casters)
+layout (std430, binding = 0) readonly buffer InstanceGroupTransforms
+{
+    vec4 instance_transforms[];
+};
+
+// Instanced variant of shadow_cube.vert, transforming the raw position by the transform of the instance
+// Part of the pointlight shadow cube computation (through shadow_cube.geom)
+void main()
+{
+    int i = gl_InstanceID * 3;
+    mat4 modelMatrix = transpose(mat4(instance_transforms[i], instance_transforms[i + 1], instance_transforms[i + 2], vec4(0, 0, 0, 1)));
+    gl_Position = modelMatrix * vec4(position, 1.0);
+}
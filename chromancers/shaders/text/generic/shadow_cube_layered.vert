@@ -0,0 +1,21 @@
+#version 430 core
+#extension GL_ARB_shader_viewport_layer_array : require
+layout (location = 0) in vec3 position;
+
+uniform mat4 modelMatrix;
+uniform mat4 lightspace_matrices[6];
+uniform int faces[6]; // cube faces overlapped by the caster, one per instance
+
+out vec4 lwFragPos;
+
+// Vertex shader routing each instance of the caster to one of the cube faces it overlaps, selecting the layer directly
+// (no geometry shader amplification, faces the caster doesn't reach are never rasterized)
+// Part of the pointlight shadow cube computation
+void main()
+{
+    int face = faces[gl_InstanceID];
+
+    lwFragPos = modelMatrix * vec4(position, 1.0);
+    gl_Position = lightspace_matrices[face] * lwFragPos;
+    gl_Layer = face;
+}
@@ -10,31 +10,74 @@ in VS_OUT
 
     // Fragment position in paint space
     vec4 pwFragPos;
+
+    // The splat this fragment belongs to
+    flat int splat_index;
 } fs_in;
 
 // The texture that represents the splat mask to apply
 uniform sampler2D splat_mask; // bound to unit0
 
-// The paint map
-uniform layout(binding = 1, rgba8) image2D paint_map;
+// The paint atlas, one image array per storage format
+uniform layout(binding = 1, rgba8) image2DArray paint_atlas_rgba8; // full color
+uniform layout(binding = 2, rg8  ) image2DArray paint_atlas_rg8;   // palette index + coverage
+uniform layout(binding = 3, r8   ) image2DArray paint_atlas_r8;    // palette index (3 bits) + coverage (5 bits)
 
-// The size of the paint map
-uniform int paintmap_size;
+// The location of each paintmap in the atlas
+layout (std430, binding = 3) readonly buffer PaintAtlasEntries
+{
+    PaintAtlasEntry entries[];
+};
 
-// The color of the paintball
-uniform vec4 paintBallColor;
+// The splats being applied
+layout (std430, binding = 4) readonly buffer PaintSplats
+{
+    PaintSplat splats[];
+};
 
-// The direction of the paintball in world coordinates
-uniform vec3 paintBallDirection;
+// Blend a splat into a palette-indexed texel: the coverage accumulates as the rgba alpha would,
+// while the index goes to whichever color ends up contributing the most to the texel
+void blendPalette(inout uint index, inout float coverage, PaintSplat splat, float splatAlpha)
+{
+    float prev_contribution = (index == splat.color_index) ? 0 : coverage * (1 - splatAlpha);
+    if (splatAlpha >= prev_contribution)
+        index = splat.color_index;
+    coverage = mix(coverage, splat.color.a, splatAlpha);
+}
+
+void storePalette(int format, ivec3 texel, PaintSplat splat, float splatAlpha)
+{
+    uint index; float coverage;
+    if (format == 1)
+    {
+        vec2 prev = imageLoad(paint_atlas_rg8, texel).rg;
+        index = uint(round(prev.r * 255)); coverage = prev.g;
 
-// Shader which updates a paintmap through load/store operations
+        blendPalette(index, coverage, splat, splatAlpha);
+        imageStore(paint_atlas_rg8, texel, vec4(float(index) / 255, coverage, 0, 0));
+    }
+    else
+    {
+        uint packed = uint(round(imageLoad(paint_atlas_r8, texel).r * 255));
+        index = packed >> 5; coverage = float(packed & 31u) / 31;
+
+        blendPalette(index, coverage, splat, splatAlpha);
+        packed = (index << 5) | uint(round(coverage * 31));
+        imageStore(paint_atlas_r8, texel, vec4(float(packed) / 255, 0, 0, 0));
+    }
+}
+
+// Shader which updates a paintmap of the atlas through load/store operations
 // given the paintball impact coordinates in paint space
 void main()
 {
-    // Compute the integer coordinates from the interpolated normalized uvs, aka from [0, 1] to [0, paintmap_size] 
+    PaintSplat splat = splats[fs_in.splat_index];
+    PaintAtlasEntry entry = entries[splat.atlas_entry];
+
+    // Compute the integer coordinates from the interpolated normalized uvs, aka from [0, 1] to the paintmap region in its layer
     // This is needed for imageStore as the coordinates required are integers
-    ivec2 uv_pixels = ivec2(fs_in.interp_UV * paintmap_size);
-    vec4 prev_color = imageLoad(paint_map, uv_pixels);
+    ivec2 region_texel = clamp(ivec2(fs_in.interp_UV * entry.texel_region.zw), ivec2(0), entry.texel_region.zw - 1);
+    ivec3 texel = ivec3(entry.texel_region.xy + region_texel, entry.layer);
 	
     // Compute perspective divide and normalize fragments projected coordinates into a [0, 1] range
     vec3 projCoords = fs_in.pwFragPos.xyz / fs_in.pwFragPos.w;
@@ -45,13 +88,19 @@ void main()
 	
     // Computes incidence angle between paint ball direction and face normal
 	// This is just an extra safety and consistency check 
-    float incidence = dot(normalize(paintBallDirection), fs_in.wNormal);
+    float incidence = dot(normalize(splat.direction.xyz), fs_in.wNormal);
 	
     // If dot product < 0 then the face got hit by the paint
     if (incidence < 0)
     {
         // Store new paint color value
-        vec4 final_color = mix(prev_color, paintBallColor, splatMaskAlpha);
-        imageStore(paint_map, uv_pixels, final_color);
+        if (entry.format == 0)
+        {
+            vec4 prev_color = imageLoad(paint_atlas_rgba8, texel);
+            vec4 final_color = mix(prev_color, splat.color, splatMaskAlpha);
+            imageStore(paint_atlas_rgba8, texel, final_color);
+        }
+        else
+            storePalette(entry.format, texel, splat, splatMaskAlpha);
     }
 }
\ No newline at end of file
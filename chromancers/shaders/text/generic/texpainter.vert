@@ -4,11 +4,17 @@ layout (location = 0) in vec3 position;  // vertex position in world coordinates
 layout (location = 1) in vec3 normal;    // vertex normal
 layout (location = 2) in vec2 UV;        // UV texture coordinates
 
-// Paint transform matrix
-uniform mat4 paintSpaceMatrix;
+// The splats being applied, each instance draws the model of its splat target
+layout (std430, binding = 4) readonly buffer PaintSplats
+{
+    PaintSplat splats[];
+};
+
+// Index of the first splat of the draw
+uniform int splats_offset = 0;
 
-// Matrix of the model.
-uniform mat4 modelMatrix;
+// The paint framebuffer is split in tiles_per_side x tiles_per_side tiles, one per splat of a wave
+uniform int tiles_per_side = 1;
 
 out VS_OUT 
 {
@@ -20,18 +26,39 @@ out VS_OUT
 
     // Fragment position in paint space
     vec4 pwFragPos;
+
+    // The splat this vertex belongs to
+    flat int splat_index;
 } vs_out;
 
+out float gl_ClipDistance[4];
+
 // Simple vertex shader, transforming raw vertex position into world then paint space
 // while also relaying other attributes like normals and uvs
 void main()
 {
+    int splat_index = splats_offset + gl_InstanceID;
+    mat4 modelMatrix = splats[splat_index].model_matrix;
+
     mat3 worldNormalMatrix = transpose(inverse(mat3(modelMatrix))); // this matrix updates normals to follow world/model matrix transformations
 
     vs_out.interp_UV = UV;
+    vs_out.splat_index = splat_index;
 
     vs_out.wNormal = normalize(worldNormalMatrix * normal);
-    vs_out.pwFragPos = paintSpaceMatrix * modelMatrix * vec4(position, 1.0f);
+    vs_out.pwFragPos = splats[splat_index].paintspace_matrix * modelMatrix * vec4(position, 1.0f);
+
+    // Clip the geometry outside the splat frustum, as it would spill onto the neighbouring tiles
+    vec4 p = vs_out.pwFragPos;
+    gl_ClipDistance[0] = p.w + p.x;
+    gl_ClipDistance[1] = p.w - p.x;
+    gl_ClipDistance[2] = p.w + p.y;
+    gl_ClipDistance[3] = p.w - p.y;
+
+    // Remap the splat frustum onto its tile
+    uint tile = splats[splat_index].tile;
+    vec2 tile_offset = vec2(tile % uint(tiles_per_side), tile / uint(tiles_per_side)) * 2.0 / tiles_per_side - 1.0 + 1.0 / tiles_per_side;
+    p.xy = p.xy / tiles_per_side + tile_offset * p.w;
 
-    gl_Position = vs_out.pwFragPos;
-}
\ No newline at end of file
+    gl_Position = p;
+}
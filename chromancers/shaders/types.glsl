@@ -1,36 +1,128 @@
 // #version 410 core
 
 // Utility shader containing structure definitions for shader usage
+// (needs constants.glsl to be prepended before it)
 
+// Light structures are laid out for the std140 Lights uniform block (mirror the GPUData structs of light.h)
 struct PointLight
 {
 	vec4  color;
+	vec3  position;
 	float intensity;
-	mat4 lightspace_matrix; // light space matrix is already lightProjMatrix * lightViewMatrix
 
 	float attenuation_constant ;
 	float attenuation_linear   ;
 	float attenuation_quadratic;
-	
-	vec3  position;
+	float padding;
 };
 
 struct DirectionalLight
 {
 	vec4  color;
+	mat4  lightspace_matrices[MAX_SHADOW_CASCADES]; // one per cascade, already lightProjMatrix * lightViewMatrix
+	vec4  cascade_splits;                           // view depth where each cascade ends
+	vec3  direction;
 	float intensity;
-	mat4 lightspace_matrix;
+	int   cascade_count;
+	int   padding0, padding1, padding2;
+};
 
-	vec3 direction;
+// Point light without shadows, shaded only by the fragments of the clusters it reaches (mirrors ClusteredLight::GPUData, std430)
+struct ClusteredLight
+{
+	vec4  color;
+	vec3  position;
+	float intensity;
+	vec3  attenuation; // constant, linear, quadratic
+	float radius;      // distance where its contribution is negligible
 };
 
 struct SpotLight
 {
 	vec4  color;
+	vec3  position;
 	float intensity;
-	mat4 lightspace_matrix;
-
-	vec3 position;
-	vec3 direction;
+	vec3  direction;
 	float cutoffAngle;
-};
\ No newline at end of file
+};
+
+// Location of a paintmap inside the paint atlas texture arrays (mirrors PaintAtlas::GPUEntry)
+struct PaintAtlasEntry
+{
+	vec4  scale_offset; // uv scale (xy) and offset (zw) of the region in its layer
+	ivec4 texel_region; // x, y, width, height of the region in texels
+	int   layer;
+	int   format;       // 0: rgba8, 1: palette rg8, 2: palette packed r8
+	int   padding0, padding1;
+};
+
+// Splat to be applied onto a paintmap of the atlas (mirrors PaintAtlas::GPUSplat)
+struct PaintSplat
+{
+	mat4 model_matrix;
+	mat4 paintspace_matrix;
+	vec4 direction;
+	vec4 color;
+	uint atlas_entry;
+	uint color_index; // palette index of the color (palette formats only)
+	uint tile;        // framebuffer tile the splat is rasterized in
+	uint padding;
+};
+
+// Material attributes (mirrors Material::GPUData), laid out for both the std140 MaterialData block and the std430 multi-draw materials
+struct MaterialData
+{
+	// Material-light attributes
+	vec4 ambient_color ;
+	vec4 diffuse_color ;
+	vec4 specular_color;
+
+	// Ambient, diffuse, specular coefficients
+	float kA;
+	float kD;
+	float kS;
+
+	// shininess coefficients (passed from the application)
+	float shininess;
+
+	// uniforms for GGX model
+	float alpha; // rugosity - 0 : smooth, 1: rough
+	float F0; // fresnel reflectance at normal incidence
+
+	float uv_repeat; // texture repetitions
+
+	// uniform for parallax map
+	float parallax_heightscale;
+
+	// Detail map attributes
+	float detail_alpha_threshold;
+	float detail_diffuse_bias;
+	float detail_normal_bias;
+
+	int paint_atlas_entry; // entry of the paintmap of this material, -1 if not paintable
+
+	int sample_shadow_map; // receive shadows or not
+
+	int sample_diffuse_map;
+	int sample_normal_map;
+	int sample_displacement_map;
+	int sample_detail_diffuse_map;
+	int sample_detail_normal_map;
+
+	// Parallax level of detail (see PARALLAX_ constants)
+	int   parallax_mode;
+	float parallax_steep_distance;
+	float parallax_offset_distance;
+	int   parallax_min_layers;
+	int   parallax_max_layers;
+	int   padding0;
+};
+
+// Data of a single draw of a multi-draw (mirrors MultiDrawBatch::DrawData)
+struct DrawData
+{
+	mat4 model_matrix;
+	uint material_index;   // in the materials of the multi-draw
+	uint point_light_mask; // bit i set if the i-th point light reaches the draw
+	uint padding0, padding1;
+};
@@ -0,0 +1,57 @@
+// #version 410 core
+
+// Utility shader containing the uniform blocks shared by every shader, uploaded once per frame by the application
+// along the clustered lights buffers and the helpers locating a cluster
+// (needs types.glsl and constants.glsl to be prepended before it)
+
+// Camera data of the frame (mirrors engine::scene::FrameData)
+layout (std140, binding = 1) uniform FrameData
+{
+	mat4 viewMatrix;
+	mat4 projectionMatrix;
+	vec3 wCameraPos;
+};
+
+// Lights of the scene (mirrors engine::scene::LightsData)
+layout (std140, binding = 2) uniform Lights
+{
+	PointLight       pointLights      [MAX_POINT_LIGHTS];
+	DirectionalLight directionalLights[MAX_DIR_LIGHTS];
+	SpotLight        spotLights       [MAX_SPOT_LIGHTS];
+
+	uint nPointLights;
+	uint nDirLights;
+	uint nSpotLights;
+};
+
+// Lights without shadows, any number of them (streamed by LightClusters)
+layout (std430, binding = CLUSTERED_LIGHTS_BINDING) buffer ClusteredLights
+{
+	ClusteredLight clusteredLights[];
+};
+
+// Lights reaching each cluster of the view frustum (assigned by light_cluster.comp)
+// Each cluster takes 1 + MAX_LIGHTS_PER_CLUSTER entries: its light count, then the indices of its lights in clusteredLights
+layout (std430, binding = CLUSTER_LIGHTS_BINDING) buffer ClusterLights
+{
+	uint clusterLights[];
+};
+
+// Near and far planes of the camera, recovered from its perspective projection
+float cameraNear() { return projectionMatrix[3][2] / (projectionMatrix[2][2] - 1.0); }
+float cameraFar () { return projectionMatrix[3][2] / (projectionMatrix[2][2] + 1.0); }
+
+// Depth slices are exponential, so clusters keep roughly cubic in view space
+uint clusterSlice(float view_depth)
+{
+	float near = cameraNear();
+	float slice = log(max(view_depth, near) / near) / log(cameraFar() / near) * CLUSTER_GRID_Z;
+	return uint(clamp(slice, 0, CLUSTER_GRID_Z - 1));
+}
+
+// Cluster holding a view space position, given its normalized device coordinates
+uint clusterIndex(vec2 ndc, float view_depth)
+{
+	uvec2 tile = uvec2(clamp((ndc * 0.5 + 0.5) * vec2(CLUSTER_GRID_X, CLUSTER_GRID_Y), vec2(0), vec2(CLUSTER_GRID_X - 1, CLUSTER_GRID_Y - 1)));
+	return (clusterSlice(view_depth) * CLUSTER_GRID_Y + tile.y) * CLUSTER_GRID_X + tile.x;
+}
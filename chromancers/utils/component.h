@@ -32,6 +32,9 @@ namespace engine::components
 		// This method is called by the parent entity when it's aware it is part of a collision happening
 		virtual void on_collision(scene::Entity& other, glm::vec3 contact_point, glm::vec3 normal, glm::vec3 impulse) {};
 
+		// Whether the component is currently moving the parent entity on its own (e.g. an awake rigidbody)
+		virtual bool is_moving() const { return false; }
+
 		const scene::Entity* parent()
 		{
 			return _parent;
@@ -1,62 +1,158 @@
 #pragma once
 
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include <gsl/gsl>
+#include <magic_enum.hpp>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
 #include "../component.h"
 #include "../transform.h"
-#include "../shader.h"
-#include "../framebuffer.h"
+#include "../texture.h"
+#include "../model.h"
+#include "../io.h"
+#include "../paint_atlas.h"
+#include "../scene/entity.h"
 
 namespace engine::components
 {
-	// Component that makes an entity paintable by storing a paintmap and making it react to paintball impacts
+	// Parameters to derive a paintmap resolution from the texel density needed on its entity surface
+	struct PaintmapSizing
+	{
+		float texels_per_meter{ 16.f };
+		unsigned int min_size{ 64 }, max_size{ 4096 };
+		unsigned int tile_size{ 0 }; // When not zero, sizes are rounded to multiples of this instead of powers of two
+	};
+
+	// Component that makes an entity paintable by reserving it a paintmap in a paint atlas and making it react to paintball impacts
 	class PaintableComponent : public Component
 	{
-		using Shader = engine::resources::Shader;
+		using Entity = engine::scene::Entity;
 		using Texture = engine::resources::Texture;
-		using Framebuffer = utils::graphics::opengl::Framebuffer;
+		using PaintAtlas = engine::resources::PaintAtlas;
+		using PaintmapFormat = engine::resources::PaintmapFormat;
 
 	public:
 		constexpr static auto COMPONENT_ID = 2;
 
 	private:
-		Texture paint_map;         // The paintmap itself
+		PaintAtlas* paint_atlas;   // The atlas storing the paintmap
+		unsigned int atlas_entry;  // The entry of the paintmap in the atlas
 		Texture* paint_normal_map; // The normal map for painted zones of the object
-		Texture* splat_tex;        // The texture to apply on paintball impact
 
-		Shader* painter_shader; // The shader which will apply the paintball impacts (splats) onto the paintmap
+		bool modified{ true }; // Whether the paintmap changed since the last time it was persisted
 
-		Framebuffer paint_fbo; // We use an ad-hoc framebuffer simply to avoid polluting the main rendering framebuffer with drawcalls
+		float meters_per_uv; // World-space length covered by a unit of uv-space length on the entity surface
 
 	public:
 
-		PaintableComponent(Entity& parent, Shader& painter_shader, unsigned int paintmap_width, unsigned int paintmap_height, Texture* splat_tex, Texture* paint_normal_map = nullptr) :
+		PaintableComponent(Entity& parent, PaintAtlas& paint_atlas, unsigned int paintmap_width, unsigned int paintmap_height, Texture* paint_normal_map = nullptr, PaintmapFormat paintmap_format = PaintmapFormat::RGBA8) :
 			Component(parent),
-			paint_map { paintmap_width, paintmap_height, {GL_RGBA8, GL_RGBA, GL_FLOAT} },
-			painter_shader{ &painter_shader },
-			splat_tex{ splat_tex },
-			paint_normal_map{ paint_normal_map } 
+			paint_atlas{ &paint_atlas },
+			atlas_entry{ paint_atlas.reserve(paintmap_format, paintmap_width, paintmap_height) },
+			paint_normal_map{ paint_normal_map },
+			meters_per_uv{ meters_per_uv_unit(*parent.model, parent.world_transform().size()) }
 		{
-			// We initialize the paintmap with zeros
-			std::vector<GLfloat> pixels(paintmap_width * paintmap_height * 4, 0.f);
-			
-			const auto& pmap_format = paint_map.format_info();
+			// We link the parent entity's material to its paintmap in the atlas and add a detail normalmap,
+			// these will draw on top of the already existing diffuse and normal maps
+			parent.material->paint_atlas_entry = gsl::narrow<int>(atlas_entry);
+			parent.material->detail_normal_map = paint_normal_map;
+		}
 
-			paint_map.bind();
+		// Creates a paintmap whose resolution is derived from the texel density required on the entity's surface (under its current scale)
+		PaintableComponent(Entity& parent, PaintAtlas& paint_atlas, const PaintmapSizing& sizing, Texture* paint_normal_map = nullptr, PaintmapFormat paintmap_format = PaintmapFormat::RGBA8) :
+			PaintableComponent(parent, paint_atlas, 
+				paintmap_size(parent, sizing), paintmap_size(parent, sizing), 
+				paint_normal_map, paintmap_format)
+		{}
+
+		// World-space length covered by a unit of uv-space length, given by the ratio between the scaled mesh surface area and its uv area
+		static float meters_per_uv_unit(const engine::resources::Model& model, const glm::vec3& scale)
+		{
+			double world_area = 0, uv_area = 0;
+			for (const auto& entry : model.meshes)
 			{
-				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, paintmap_width, paintmap_height, pmap_format.format, pmap_format.data_type, pixels.data());
+				const auto& vertices = entry.mesh.vertices;
+				const auto& indices = entry.mesh.indices;
+				for (size_t i = 0; i + 2 < indices.size(); i += 3)
+				{
+					const auto& v0 = vertices[indices[i]], & v1 = vertices[indices[i + 1]], & v2 = vertices[indices[i + 2]];
+
+					world_area += 0.5 * glm::length(glm::cross(scale * (v1.position - v0.position), scale * (v2.position - v0.position)));
 
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-				glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+					glm::vec2 uv_e1 = v1.texCoords - v0.texCoords, uv_e2 = v2.texCoords - v0.texCoords;
+					uv_area += 0.5 * std::abs(uv_e1.x * uv_e2.y - uv_e1.y * uv_e2.x);
+				}
 			}
-			paint_map.unbind();
 
-			// We add to the parent entity's material a detail diffusemap and a detail normalmap
-			// these will draw on top of the already existing diffuse and normal maps
-			parent.material->detail_diffuse_map = &paint_map;
-			parent.material->detail_normal_map = paint_normal_map;
+			return uv_area > 0 ? gsl::narrow_cast<float>(std::sqrt(world_area / uv_area)) : 0.f;
+		}
+
+		// Paintmap resolution matching the sizing density, rounded to the nearest power of two (or tile multiple) and clamped
+		static unsigned int paintmap_size(float meters_per_uv, const PaintmapSizing& sizing)
+		{
+			float texels = std::max(meters_per_uv * sizing.texels_per_meter, 1.f);
+
+			unsigned int size = sizing.tile_size ?
+				gsl::narrow_cast<unsigned int>(std::max(std::round(texels / sizing.tile_size), 1.f)) * sizing.tile_size :
+				1u << gsl::narrow_cast<unsigned int>(std::round(std::log2(texels)));
+
+			return std::clamp(size, sizing.min_size, sizing.max_size);
+		}
+
+		static unsigned int paintmap_size(const Entity& entity, const PaintmapSizing& sizing)
+		{
+			return paintmap_size(meters_per_uv_unit(*entity.model, entity.world_transform().size()), sizing);
+		}
+
+		// Halves the largest paintmaps until their total memory fits the budget (paintmaps are cleared in the process, so this is meant for setup time)
+		static void apply_memory_budget(const std::vector<PaintableComponent*>& paintables, size_t budget_bytes, unsigned int min_size = 64)
+		{
+			auto total_bytes = [&]() { size_t total = 0; for (auto p : paintables) total += p->size_bytes(); return total; };
+
+			size_t total = total_bytes();
+			while (total > budget_bytes)
+			{
+				PaintableComponent* largest = nullptr;
+				for (auto p : paintables)
+				{
+					if (p->width() / 2 < min_size || p->height() / 2 < min_size) continue;
+					if (!largest || p->size_bytes() > largest->size_bytes()) largest = p;
+				}
+				if (!largest) { utils::io::warn("PAINTABLE - Paintmaps can't fit a memory budget of ", budget_bytes / 1024, " KB"); return; }
+
+				largest->resize_paintmap(largest->width() / 2, largest->height() / 2);
+				total = total_bytes();
+			}
+		}
+
+		// Logs the chosen size, memory usage and resulting texel density of each paintmap
+		static void report(const std::vector<PaintableComponent*>& paintables)
+		{
+			size_t total = 0;
+			for (auto p : paintables)
+			{
+				utils::io::info("PAINTABLE - ", p->parent()->display_name, ": ", p->width(), "x", p->height(), " ", magic_enum::enum_name(p->format()),
+					", ", p->size_bytes() / 1024, " KB, ", p->texel_density(), " texels/m");
+				total += p->size_bytes();
+			}
+			utils::io::info("PAINTABLE - Paintmaps total: ", total / 1024, " KB");
 		}
 
+		// Resizes the paintmap, clearing its content (the atlas is repacked on its next commit)
+		void resize_paintmap(unsigned int width, unsigned int height)
+		{
+			paint_atlas->resize(atlas_entry, width, height);
+			modified = true;
+		}
+
+		// Texels per meter achieved on the entity surface
+		float texel_density() const { return meters_per_uv > 0 ? width() / meters_per_uv : 0.f; }
+
 		int type()
 		{
 			return COMPONENT_ID;
@@ -66,37 +162,35 @@ namespace engine::components
 
 		void update(float delta_time) {}
 
-		void update_paintmap(const glm::mat4& paintspace_matrix, const glm::vec3& paint_direction, const glm::vec4& paint_color)
+		PaintAtlas& atlas() const { return *paint_atlas; }
+		unsigned int entry() const { return atlas_entry; }
+
+		PaintmapFormat format() const { return paint_atlas->region(atlas_entry).format; }
+		unsigned int width () const { return paint_atlas->region(atlas_entry).width; }
+		unsigned int height() const { return paint_atlas->region(atlas_entry).height; }
+		size_t size_bytes() const { return size_t(width()) * height() * PaintAtlas::bytes_per_texel(format()); }
+
+		bool is_modified() const { return modified; }
+		void clear_modified() { modified = false; }
+
+		// Enqueues a copy of the paintmap texels into the given pixel pack buffer (at least size_bytes() large)
+		// The copy is asynchronous: the buffer should be mapped only after a fence placed after this call is signaled
+		void read_paintmap(GLuint pack_buffer) const
 		{
-			paint_fbo.bind();
-			{
-				painter_shader->bind();
-				{
-					glClear(GL_DEPTH_BUFFER_BIT);
-					// Setup uniforms
-					painter_shader->setMat4("paintSpaceMatrix", paintspace_matrix);
-					painter_shader->setVec3("paintBallDirection", paint_direction);
-					painter_shader->setVec4("paintBallColor", paint_color);
-
-					// Setup splat mask
-					glActiveTexture(GL_TEXTURE0);
-					splat_tex->bind();
-					painter_shader->setInt("splat_mask", 0);
-
-					// Bind paintmap and relative informations
-					glBindImageTexture(1, paint_map.id(), 0, GL_FALSE, 0, GL_READ_WRITE, paint_map.format_info().internal_format);
-					painter_shader->setInt("paintmap_size", paint_map.width());
-
-					_parent->custom_draw(*painter_shader);
-					glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
-					// This barrier is needed to ensure that the imageStore operation in the shader 
-					// (which saves the modified paintmap) is executed completely before
-					// proceeding with the next host instructions
-				}
-				painter_shader->unbind();
-			}
-			paint_fbo.unbind();
+			paint_atlas->read(atlas_entry, pack_buffer, size_bytes());
+		}
+
+		// Enqueues an update of the paintmap texels from the given pixel unpack buffer (holding size_bytes() of texels)
+		void write_paintmap(GLuint unpack_buffer)
+		{
+			paint_atlas->write(atlas_entry, unpack_buffer);
 		}
 
+		// Enqueues a splat onto the paintmap, applied along the splats of the other paintables by PaintAtlas::apply_splats()
+		void update_paintmap(const glm::mat4& paintspace_matrix, const glm::vec3& paint_direction, const glm::vec4& paint_color)
+		{
+			paint_atlas->enqueue_splat(atlas_entry, *_parent->model, _parent->world_transform().matrix(), paintspace_matrix, paint_direction, paint_color);
+			modified = true;
+		}
 	};
-}
\ No newline at end of file
+}
@@ -7,6 +7,7 @@
 #include "../io.h"
 
 #include "utils/components/paintable_component.h"
+#include "utils/scene/splat_log.h"
 
 namespace engine::components
 {
@@ -30,6 +31,9 @@ namespace engine::components
 		inline static float paint_far_plane  = 3.f;
 		inline static float distance_bias    = 1.f;
 
+		// Log recording every splat applied (if set)
+		inline static scene::SplatLog* splat_log = nullptr;
+
 		PaintballComponent(scene::Entity& parent, glm::vec4 paint_color) :
 			Component(parent),
 			paint_color { paint_color },
@@ -76,22 +80,16 @@ namespace engine::components
 
 			if (other_paintable)
 			{
-				glm::vec3 paintball_size = _parent->world_transform().size();
-				glm::vec3 paintball_position = _parent->world_transform().position();
-
 				// We use the previous velocity since the current velocity may have factored in a bounce  
 				// in the physics engine before we can destroy the paintball
-				glm::vec3 paintball_direction = glm::normalize(prev_velocity); 
-				glm::vec3 paintball_lateral = glm::normalize(glm::cross(paintball_direction, glm::vec3{0, 1, 0})); 
-				glm::vec3 paintball_up = glm::normalize(glm::cross(paintball_direction, paintball_lateral));
-				
-				// Create paintspace viewprojection
-				float frustum_size = paintball_size.x * 2;
-				glm::mat4 paintProjection = glm::ortho(-frustum_size, frustum_size, -frustum_size, frustum_size, paint_near_plane, paint_far_plane);
-				glm::mat4 paintView = glm::lookAt(paintball_position - paintball_direction * distance_bias, paintball_position + paintball_direction, paintball_up);
+				resources::Splat splat{ _parent->world_transform().position(), glm::normalize(prev_velocity), _parent->world_transform().size().x, paint_color };
+
+				// When logging, we apply the splat as it will be replayed
+				if (splat_log)
+					splat = splat_log->record(splat, other.display_name, { paint_near_plane, paint_far_plane, distance_bias });
 
 				// Make the paintable entity aware of the paintball collision and let it update its paintmap
-				other_paintable->update_paintmap(paintProjection * paintView, paintball_direction, paint_color);
+				other_paintable->update_paintmap(splat.paintspace_matrix(paint_near_plane, paint_far_plane, distance_bias), splat.direction, splat.color);
 			}
 
 			// Set for destruction
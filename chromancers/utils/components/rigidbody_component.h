@@ -78,6 +78,12 @@ namespace engine::components
 			return COMPONENT_ID;
 		}
 
+		// Kinematic bodies never move the entity, the others only while the physics engine keeps them awake
+		bool is_moving() const override
+		{
+			return !is_kinematic && rigid_body->isActive();
+		}
+
 		void on_transform_update()
 		{
 			// Syncs physics position with parent entity transform
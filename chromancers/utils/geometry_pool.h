@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <unordered_map>
+
+#include <glad.h>
+#include <gsl/gsl>
+
+#include "io.h"
+#include "oop.h"
+#include "mesh.h"
+
+namespace engine::resources
+{
+	// Vertex and index buffers shared by many meshes, drawn through a single VAO
+	// Each mesh is copied once into the pool and referenced by its range, so draws of different meshes
+	// need no VAO switch and can be submitted together (e.g. with glMultiDrawElementsIndirect)
+	// N.B. meshes are identified by address, so they must not move after being added (models keep their meshes for their whole life)
+	class GeometryPool : utils::oop::non_copyable, utils::oop::non_movable
+	{
+	public:
+		// Location of a mesh inside the pool, as needed by the indirect draw commands
+		struct Range
+		{
+			GLuint index_count;
+			GLuint first_index;
+			GLint  base_vertex;
+		};
+
+		GeometryPool(size_t vertex_capacity = 1 << 16, size_t index_capacity = 1 << 18)
+		{
+			glCreateVertexArrays(1, &VAO);
+			setup_attributes();
+			create_buffers(vertex_capacity, index_capacity);
+		}
+
+		~GeometryPool()
+		{
+			glDeleteVertexArrays(1, &VAO);
+			glDeleteBuffers(1, &VBO);
+			glDeleteBuffers(1, &EBO);
+		}
+
+		// Returns the range of the mesh in the pool, copying it there the first time
+		const Range& add(const Mesh& mesh)
+		{
+			auto found = ranges.find(&mesh);
+			if (found != ranges.end()) return found->second;
+
+			if (vertex_count + mesh.vertices.size() > vertex_capacity || index_count + mesh.indices.size() > index_capacity)
+				grow(vertex_count + mesh.vertices.size(), index_count + mesh.indices.size());
+
+			glNamedBufferSubData(VBO, vertex_count * sizeof(Vertex), mesh.vertices.size() * sizeof(Vertex), mesh.vertices.data());
+			glNamedBufferSubData(EBO, index_count * sizeof(GLuint), mesh.indices.size() * sizeof(GLuint), mesh.indices.data());
+
+			Range range{ gsl::narrow<GLuint>(mesh.indices.size()), gsl::narrow<GLuint>(index_count), gsl::narrow<GLint>(vertex_count) };
+			vertex_count += mesh.vertices.size();
+			index_count += mesh.indices.size();
+
+			return ranges.emplace(&mesh, range).first->second;
+		}
+
+		void bind() const { glBindVertexArray(VAO); }
+		void unbind() const { glBindVertexArray(0); }
+
+	private:
+		GLuint VAO{ 0 }, VBO{ 0 }, EBO{ 0 };
+		size_t vertex_capacity{ 0 }, index_capacity{ 0 };
+		size_t vertex_count{ 0 }, index_count{ 0 };
+		std::unordered_map<const Mesh*, Range> ranges;
+
+		// Same attribute locations as Mesh::setupMesh, so the pool can be drawn with the same shaders
+		void setup_attributes()
+		{
+			auto attribute = [&](GLuint location, GLint size, size_t offset)
+			{
+				glEnableVertexArrayAttrib(VAO, location);
+				glVertexArrayAttribFormat(VAO, location, size, GL_FLOAT, GL_FALSE, gsl::narrow<GLuint>(offset));
+				glVertexArrayAttribBinding(VAO, location, 0);
+			};
+			attribute(0, 3, offsetof(Vertex, position));
+			attribute(1, 3, offsetof(Vertex, normal));
+			attribute(2, 2, offsetof(Vertex, texCoords));
+			attribute(3, 3, offsetof(Vertex, tangent));
+			attribute(4, 3, offsetof(Vertex, bitangent));
+		}
+
+		void create_buffers(size_t new_vertex_capacity, size_t new_index_capacity)
+		{
+			vertex_capacity = new_vertex_capacity; index_capacity = new_index_capacity;
+
+			glCreateBuffers(1, &VBO);
+			glNamedBufferStorage(VBO, vertex_capacity * sizeof(Vertex), nullptr, GL_DYNAMIC_STORAGE_BIT);
+			glCreateBuffers(1, &EBO);
+			glNamedBufferStorage(EBO, index_capacity * sizeof(GLuint), nullptr, GL_DYNAMIC_STORAGE_BIT);
+
+			glVertexArrayVertexBuffer(VAO, 0, VBO, 0, sizeof(Vertex));
+			glVertexArrayElementBuffer(VAO, EBO);
+		}
+
+		// Moves the content of the pool into bigger buffers (ranges are unchanged)
+		void grow(size_t min_vertices, size_t min_indices)
+		{
+			GLuint old_VBO = VBO, old_EBO = EBO;
+			size_t new_vertex_capacity = std::max(vertex_capacity * 2, min_vertices);
+			size_t new_index_capacity  = std::max(index_capacity  * 2, min_indices);
+			utils::io::info("GEOMETRY POOL - growing to ", new_vertex_capacity, " vertices and ", new_index_capacity, " indices");
+
+			create_buffers(new_vertex_capacity, new_index_capacity);
+			glCopyNamedBufferSubData(old_VBO, VBO, 0, 0, vertex_count * sizeof(Vertex));
+			glCopyNamedBufferSubData(old_EBO, EBO, 0, 0, index_count * sizeof(GLuint));
+
+			glDeleteBuffers(1, &old_VBO);
+			glDeleteBuffers(1, &old_EBO);
+		}
+	};
+}
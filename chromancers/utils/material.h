@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <utility>
 
 #include "shader.h"
 #include "texture.h"
@@ -11,6 +12,9 @@
 #define DETAIL_DIFFUSE_TEX_UNIT 3
 #define DETAIL_NORMAL_TEX_UNIT  4
 #define SHADOW_TEX_UNIT         5
+#define PAINT_ATLAS_TEX_UNIT    11 // after the shadow units, one unit per paintmap format
+
+#define MATERIAL_BINDING 3 // uniform block binding of the material data
 
 namespace engine::resources
 {
@@ -19,6 +23,15 @@ namespace engine::resources
 	{
 		using Color = glm::vec4;
 	public:
+		// How the displacement map offsets the texture coordinates (mirrored by the PARALLAX_ constants of constants.glsl)
+		enum class ParallaxMode : int
+		{
+			none,     // no parallax at all
+			offset,   // a single offset along the view direction
+			steep,    // ray march through max layers (less at grazing angles), interpolating the hit
+			adaptive  // steep with layers scaled down as the texels shrink on screen, offset beyond parallax_steep_distance, none beyond parallax_offset_distance
+		};
+
 		Shader* shader              { nullptr };
 		//Color albedo              { 1 }; TODO use in place of diffuse when ambient and specular are gone
 		Texture* diffuse_map        { nullptr };
@@ -41,11 +54,16 @@ namespace engine::resources
 
 		// Displacement map parameters
 		float parallax_heightscale { 0.05f };
+		ParallaxMode parallax_mode { ParallaxMode::adaptive };
+		float parallax_steep_distance  { 10.f }; // View distance where adaptive parallax falls back to offset
+		float parallax_offset_distance { 30.f }; // View distance where adaptive parallax is disabled
+		int   parallax_min_layers { 4 }, parallax_max_layers { 32 };
 		
 		// Detail map related parameters
 		float detail_alpha_threshold{ 0.75f };
 		float detail_diffuse_bias   { 1.50f };
 		float detail_normal_bias    { 0.25f };
+		int   paint_atlas_entry     { -1 }; // Entry of the paintmap in the bound paint atlas, -1 if not paintable
 
 		// Shadow map parameters
 		bool receive_shadows{ true };
@@ -53,77 +71,70 @@ namespace engine::resources
 		Material() {}
 		Material(Shader& shader) : shader { &shader } {}
 
-		// Bind the shader and set all the relevant properties (including textures if they are available)
+		// Mirrors the MaterialData struct of the lit shaders (read from the std140 MaterialBlock, or from the std430 materials of a multi-draw)
+		struct GPUData
+		{
+			Color ambient_color, diffuse_color, specular_color;
+			float kA, kD, kS, shininess;
+			float alpha, F0, uv_repeat, parallax_heightscale;
+			float detail_alpha_threshold, detail_diffuse_bias, detail_normal_bias;
+			int   paint_atlas_entry;
+			int   sample_shadow_map;
+			int   sample_diffuse_map, sample_normal_map, sample_displacement_map, sample_detail_diffuse_map, sample_detail_normal_map;
+			int   parallax_mode;
+			float parallax_steep_distance, parallax_offset_distance;
+			int   parallax_min_layers, parallax_max_layers;
+			int   padding0{ 0 };
+
+			bool operator==(const GPUData& other) const = default;
+		};
+		static_assert(sizeof(GPUData) == 144, "Material GPU data must match the std140 layout of the MaterialData struct");
+
+		GPUData gpu_data() const
+		{
+			return { ambient_color, diffuse_color, specular_color, kA, kD, kS, shininess, alpha, F0, uv_repeat, parallax_heightscale,
+				detail_alpha_threshold, detail_diffuse_bias, detail_normal_bias, paint_atlas_entry, receive_shadows,
+				diffuse_map != nullptr, normal_map != nullptr, displacement_map != nullptr, detail_diffuse_map != nullptr, detail_normal_map != nullptr,
+				static_cast<int>(parallax_mode), parallax_steep_distance, parallax_offset_distance, parallax_min_layers, parallax_max_layers };
+		}
+
+		// Bind the shader, the material buffer and the textures (the buffer is uploaded again only if a property changed)
 		void bind() const
 		{
 			if (!shader) { utils::io::error("MATERIAL - Shader not provided"); return; }
 			
 			shader->bind();
+			buffer.bind(gpu_data());
+			bind_textures();
+		}
 
-			shader->setVec4("ambient_color", ambient_color);
-			shader->setVec4("diffuse_color", diffuse_color);
-			shader->setVec4("specular_color", specular_color);
-
-			shader->setFloat("kA", kA);
-			shader->setFloat("kD", kD);
-			shader->setFloat("kS", kS);
-
-			shader->setFloat("shininess", shininess);
-			shader->setFloat("alpha", alpha);
-
-			shader->setFloat("uv_repeat", uv_repeat);
-			shader->setFloat("parallax_heightscale", parallax_heightscale);
-
-			shader->setFloat("detail_alpha_threshold", detail_alpha_threshold);
-			shader->setFloat("detail_diffuse_bias", detail_diffuse_bias);
-			shader->setFloat("detail_normal_bias", detail_normal_bias);
-
-			shader->setInt("sample_shadow_map", receive_shadows);
-
-			shader->setInt("sample_diffuse_map", 0);
-			shader->setInt("sample_normal_map", 0);
-			shader->setInt("sample_displacement_map", 0);
-			shader->setInt("sample_detail_diffuse_map", 0);
-			shader->setInt("sample_detail_normal_map", 0);
-
+		// Bind the maps of the material, each one on its own texture unit matching the sampler bindings of the shader
+		void bind_textures() const
+		{
 			if (diffuse_map)
 			{
-				// activate a texture unit per map
 				glActiveTexture(GL_TEXTURE0 + DIFFUSE_TEX_UNIT);
 				diffuse_map->bind();
-				shader->setInt("diffuse_map", DIFFUSE_TEX_UNIT);
-				shader->setInt("sample_diffuse_map", 1);
 			}
-
 			if (normal_map)
 			{
 				glActiveTexture(GL_TEXTURE0 + NORMAL_TEX_UNIT);
 				normal_map->bind();
-				shader->setInt("normal_map", NORMAL_TEX_UNIT);
-				shader->setInt("sample_normal_map", 1);
 			}
-			
 			if (displacement_map)
 			{
 				glActiveTexture(GL_TEXTURE0 + DISPLACEMENT_TEX_UNIT);
 				displacement_map->bind();
-				shader->setInt("displacement_map", DISPLACEMENT_TEX_UNIT); 
-				shader->setInt("sample_displacement_map", 1);
 			}
-
 			if (detail_diffuse_map)
 			{
 				glActiveTexture(GL_TEXTURE0 + DETAIL_DIFFUSE_TEX_UNIT);
 				detail_diffuse_map->bind();
-				shader->setInt("detail_diffuse_map", DETAIL_DIFFUSE_TEX_UNIT);
-				shader->setInt("sample_detail_diffuse_map", 1);
 			}
 			if (detail_normal_map)
 			{
 				glActiveTexture(GL_TEXTURE0 + DETAIL_NORMAL_TEX_UNIT);
 				detail_normal_map->bind();
-				shader->setInt("detail_normal_map", DETAIL_NORMAL_TEX_UNIT);
-				shader->setInt("sample_detail_normal_map", 1);
 			}
 		}
 
@@ -132,45 +143,45 @@ namespace engine::resources
 			if (!shader) { utils::io::error("MATERIAL - Shader not provided"); return; }
 
 			// Mirroring OpenGL state usage, we should have the shader bound at this point
-			
-			// We need to unbind these if we use the same shader for different materials
-			if (diffuse_map)
-			{
-				shader->setInt("sample_diffuse_map", 0);
-				shader->setInt("diffuse_map", 0);
-				diffuse_map->unbind();
-			}
+			// N.B. the sample flags are in the material buffer, so textures left bound are ignored by the next materials
+			shader->unbind();
+		}
 
-			if (normal_map)
-			{
-				shader->setInt("sample_normal_map", 0);
-				shader->setInt("normal_map", 0);
-				normal_map->unbind();
-			}
+	private:
+		// Uniform buffer holding the data of a single material
+		// Copies of a material get their own buffer, created at their first bind
+		class MaterialBuffer
+		{
+			GLuint id{ 0 };
+			GPUData uploaded{}; // last data sent to the buffer
 
-			if (displacement_map)
-			{
-				shader->setInt("sample_displacement_map", 0);
-				shader->setInt("displacement_map", 0); 
-				displacement_map->unbind();
-			}
+		public:
+			MaterialBuffer() = default;
+			MaterialBuffer(const MaterialBuffer& copy) {}
+			MaterialBuffer& operator=(const MaterialBuffer& copy) { return *this; }
 
-			if (detail_diffuse_map)
-			{
-				shader->setInt("sample_detail_diffuse_map", 0);
-				shader->setInt("detail_diffuse_map", 0);
-				detail_diffuse_map->unbind();
-			}
+			MaterialBuffer(MaterialBuffer&& move) noexcept : id{ move.id }, uploaded{ move.uploaded } { move.id = 0; }
+			MaterialBuffer& operator=(MaterialBuffer&& move) noexcept { std::swap(id, move.id); std::swap(uploaded, move.uploaded); return *this; }
 
-			if (detail_normal_map)
+			~MaterialBuffer() { if (id) glDeleteBuffers(1, &id); }
+
+			void bind(const GPUData& data)
 			{
-				shader->setInt("sample_detail_normal_map", 0);
-				shader->setInt("detail_normal_map", 0);
-				detail_normal_map->unbind();
+				if (!id)
+				{
+					glCreateBuffers(1, &id);
+					glNamedBufferStorage(id, sizeof(GPUData), &data, GL_DYNAMIC_STORAGE_BIT);
+					uploaded = data;
+				}
+				else if (!(data == uploaded))
+				{
+					glNamedBufferSubData(id, 0, sizeof(GPUData), &data);
+					uploaded = data;
+				}
+				glBindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BINDING, id, 0, sizeof(GPUData));
 			}
+		};
 
-			shader->unbind();
-		}
-
+		mutable MaterialBuffer buffer;
 	};
 }
\ No newline at end of file
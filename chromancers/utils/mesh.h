@@ -87,6 +87,14 @@ namespace engine::resources
 			glBindVertexArray(0);
 		}
 
+		// Draws the mesh with the parameters of the indirect command at the given offset of the buffer bound to GL_DRAW_INDIRECT_BUFFER
+		void draw_indirect(GLintptr command_offset = 0, GLenum mode = GL_TRIANGLES) const
+		{
+			glBindVertexArray(VAO);
+			glDrawElementsIndirect(mode, GL_UNSIGNED_INT, reinterpret_cast<const void*>(command_offset));
+			glBindVertexArray(0);
+		}
+
 		// Creates and returns a vector of vertex positions from the mesh
 		std::vector<glm::vec3> get_vertices_positions() const
 		{
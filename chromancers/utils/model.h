@@ -106,6 +106,12 @@ namespace engine::resources
 			for (size_t i = 0; i < meshes.size(); i++) { meshes[i].mesh.draw_instanced(amount); }
 		}
 
+		// Draw only the mesh geometry with indirect commands, one per mesh laid out every command_stride bytes from command_offset
+		void draw_indirect(GLintptr command_offset, GLintptr command_stride) const
+		{
+			for (size_t i = 0; i < meshes.size(); i++) { meshes[i].mesh.draw_indirect(command_offset + gsl::narrow<GLintptr>(i) * command_stride); }
+		}
+
 		// Creates and returns a vector of vertex positions from the mesh
 		std::vector<glm::vec3> get_vertices_positions() const
 		{
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstring>
+#include <optional>
+#include <algorithm>
+#include <unordered_map>
+
+#include <glad.h>
+#include <gsl/gsl>
+#include <glm/glm.hpp>
+
+#include "oop.h"
+#include "mesh.h"
+#include "shader.h"
+#include "material.h"
+#include "ring_buffer.h"
+#include "geometry_pool.h"
+
+#define MULTI_DRAW_DATA_BINDING      5 // SSBO binding of the per-draw data of a multi-draw (see multi_draw.glsl)
+#define MULTI_DRAW_MATERIALS_BINDING 6 // SSBO binding of the materials used by a multi-draw
+
+namespace engine::resources
+{
+	// Collects the draws of many meshes and submits them with one glMultiDrawElementsIndirect per bucket
+	// Meshes are drawn from a shared GeometryPool, the model matrix and material of each draw are read by the shader
+	// from SSBOs indexed by gl_DrawID, so only the shader and the bound textures split the draws in buckets:
+	// materials whose maps don't conflict (same texture or none on each unit) share a bucket, since their sample flags ignore the other maps
+	class MultiDrawBatch : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		// Layout of an indirect command, as read by glMultiDrawElementsIndirect
+		struct DrawCommand
+		{
+			GLuint count;
+			GLuint instance_count;
+			GLuint first_index;
+			GLint  base_vertex;
+			GLuint base_instance;
+		};
+
+		// Mirrors the DrawData struct of types.glsl
+		struct DrawData
+		{
+			glm::mat4 model_matrix;
+			GLuint    material_index;   // in the materials of the bucket
+			GLuint    point_light_mask; // bit i set if the i-th point light reaches the draw
+			GLuint    padding[2]{ 0, 0 };
+		};
+		static_assert(sizeof(DrawData) == 80, "Draw data must match the std430 layout of the DrawData struct");
+
+		using Maps = std::array<const Texture*, 5>; // one per material texture unit, from DIFFUSE_TEX_UNIT to DETAIL_NORMAL_TEX_UNIT
+
+		struct Bucket
+		{
+			Shader* shader;
+			Maps maps;
+			std::vector<DrawCommand> commands;
+			std::vector<DrawData> draws;
+			std::vector<Material::GPUData> materials;
+			std::unordered_map<const Material*, GLuint> material_indices;
+			size_t draws_offset{ 0 }, materials_offset{ 0 }, commands_offset{ 0 }; // in the upload of the batch
+		};
+
+		static constexpr size_t RING_SEGMENT_SIZE = 1 << 18;
+
+		GeometryPool& geometry;
+		utils::graphics::opengl::PersistentRingBuffer ring{ GL_SHADER_STORAGE_BUFFER, RING_SEGMENT_SIZE };
+		size_t alignment{ 1 };
+
+		std::vector<Bucket> buckets;
+		std::optional<utils::graphics::opengl::PersistentRingBuffer::Allocation> upload; // of every bucket, kept while the batch is submitted again
+		size_t _submitted_draws{ 0 }, _submitted_calls{ 0 };
+
+	public:
+		MultiDrawBatch(GeometryPool& geometry) : geometry{ geometry }
+		{
+			GLint offset_alignment = 1;
+			glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+			alignment = std::max<size_t>(offset_alignment, 1);
+		}
+
+		// Queues a draw of the mesh with the given material, using a shader supporting multi-draws (see multi_draw.glsl)
+		void add(const Mesh& mesh, const Material& material, Shader& shader, const glm::mat4& model_matrix, GLuint point_light_mask = ~0u)
+		{
+			const GeometryPool::Range& range = geometry.add(mesh);
+			Bucket& bucket = find_bucket(shader, material);
+			upload.reset();
+
+			auto [material_entry, inserted] = bucket.material_indices.try_emplace(&material, gsl::narrow<GLuint>(bucket.materials.size()));
+			if (inserted) bucket.materials.push_back(material.gpu_data());
+
+			bucket.commands.push_back({ range.index_count, 1, range.first_index, range.base_vertex, 0 });
+			bucket.draws.push_back({ model_matrix, material_entry->second, point_light_mask });
+		}
+
+		// Issues a multi-draw for every bucket, then clears them unless kept to be submitted again (e.g. by a depth prepass, then by the lit pass):
+		// the buckets are uploaded by the first submit only, the following ones just draw them again
+		void submit(bool keep = false)
+		{
+			if (buckets.empty()) return;
+			_submitted_draws = 0; _submitted_calls = 0;
+
+			if (!upload) upload_buckets();
+			std::byte* data = static_cast<std::byte*>(upload->data);
+
+			geometry.bind();
+			for (Bucket& bucket : buckets)
+			{
+				size_t draws_size     = bucket.draws.size()     * sizeof(DrawData);
+				size_t materials_size = bucket.materials.size() * sizeof(Material::GPUData);
+
+				auto range_of = [&](size_t offset, size_t size) { return utils::graphics::opengl::PersistentRingBuffer::Allocation{ data + offset, upload->offset + gsl::narrow<GLintptr>(offset), size }; };
+				ring.bind_range(MULTI_DRAW_DATA_BINDING, range_of(bucket.draws_offset, draws_size), draws_size);
+				ring.bind_range(MULTI_DRAW_MATERIALS_BINDING, range_of(bucket.materials_offset, materials_size), materials_size);
+				glBindBuffer(GL_DRAW_INDIRECT_BUFFER, ring.id());
+
+				bucket.shader->bind();
+				for (size_t unit = 0; unit < bucket.maps.size(); unit++)
+				{
+					if (!bucket.maps[unit]) continue;
+					glActiveTexture(GL_TEXTURE0 + DIFFUSE_TEX_UNIT + gsl::narrow<GLenum>(unit));
+					bucket.maps[unit]->bind();
+				}
+
+				glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, reinterpret_cast<const void*>(upload->offset + bucket.commands_offset),
+					gsl::narrow<GLsizei>(bucket.commands.size()), 0);
+
+				_submitted_draws += bucket.commands.size();
+				_submitted_calls++;
+			}
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+			geometry.unbind();
+			glUseProgram(0);
+
+			if (!keep) clear();
+		}
+
+		// Drops the queued draws (and their upload) without drawing them
+		void clear()
+		{
+			buckets.clear();
+			upload.reset();
+		}
+
+		// Statistics of the last submit which had something to draw
+		size_t submitted_draws() const { return _submitted_draws; }
+		size_t submitted_calls() const { return _submitted_calls; }
+
+	private:
+		size_t align_up(size_t value) const { return (value + alignment - 1) / alignment * alignment; }
+
+		// Draw data, materials and commands of every bucket are written in a single ring allocation before the first draw reading them,
+		// so the fence closing its segment is always placed after the last submit of the batch (the next allocation comes with the next batch)
+		void upload_buckets()
+		{
+			size_t size = 0;
+			for (Bucket& bucket : buckets)
+			{
+				bucket.draws_offset     = align_up(size);
+				bucket.materials_offset = align_up(bucket.draws_offset     + bucket.draws.size()     * sizeof(DrawData));
+				bucket.commands_offset  = align_up(bucket.materials_offset + bucket.materials.size() * sizeof(Material::GPUData));
+				size = bucket.commands_offset + bucket.commands.size() * sizeof(DrawCommand);
+			}
+
+			upload = ring.allocate(size);
+			std::byte* data = static_cast<std::byte*>(upload->data);
+			for (const Bucket& bucket : buckets)
+			{
+				std::memcpy(data + bucket.draws_offset,     bucket.draws.data(),     bucket.draws.size()     * sizeof(DrawData));
+				std::memcpy(data + bucket.materials_offset, bucket.materials.data(), bucket.materials.size() * sizeof(Material::GPUData));
+				std::memcpy(data + bucket.commands_offset,  bucket.commands.data(),  bucket.commands.size()  * sizeof(DrawCommand));
+			}
+		}
+
+		static Maps maps_of(const Material& material)
+		{
+			return { material.diffuse_map, material.normal_map, material.displacement_map, material.detail_diffuse_map, material.detail_normal_map };
+		}
+
+		// Finds a bucket of the shader whose bound maps don't conflict with the material ones (or creates it), then adds the material maps to it
+		Bucket& find_bucket(Shader& shader, const Material& material)
+		{
+			Maps maps = maps_of(material);
+			auto compatible = [&](const Bucket& bucket)
+			{
+				if (bucket.shader != &shader) return false;
+				for (size_t unit = 0; unit < maps.size(); unit++)
+					if (maps[unit] && bucket.maps[unit] && maps[unit] != bucket.maps[unit]) return false;
+				return true;
+			};
+
+			auto found = std::find_if(buckets.begin(), buckets.end(), compatible);
+			Bucket& bucket = found != buckets.end() ? *found : buckets.emplace_back(Bucket{ &shader });
+			for (size_t unit = 0; unit < maps.size(); unit++)
+				if (maps[unit]) bucket.maps[unit] = maps[unit];
+			return bucket;
+		}
+	};
+}
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <limits>
+#include <algorithm>
+#include <bit>
+
+#include <gsl/gsl>
+#include <magic_enum.hpp>
+
+#include <glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "oop.h"
+#include "io.h"
+#include "utils.h"
+#include "shader.h"
+#include "texture.h"
+#include "model.h"
+#include "material.h"
+#include "framebuffer.h"
+
+#define MAX_PAINT_PALETTE_COLORS 8
+
+#define PAINT_ATLAS_ENTRIES_BINDING 3 // SSBO binding of the paint atlas entries
+#define PAINT_SPLATS_BINDING        4 // SSBO binding of the splats being applied
+
+namespace engine::resources
+{
+	using Framebuffer = utils::graphics::opengl::Framebuffer;
+
+	// Storage formats available for a paintmap
+	enum class PaintmapFormat
+	{
+		RGBA8,       // Full color per texel (4 bytes)
+		PALETTE_RG8, // Palette color index in R, paint coverage in G (2 bytes)
+		PALETTE_R8   // Palette color index (3 bits) packed with paint coverage (5 bits) (1 byte)
+	};
+
+	// Small set of paint colors shared by every palette-indexed paintmap
+	class PaintPalette
+	{
+		inline static std::vector<glm::vec4> colors;
+
+	public:
+		// Returns the palette index of the color, registering it if not already present.
+		// When the palette is full, the index of the nearest registered color is returned instead
+		static unsigned int index_of(const glm::vec4& color)
+		{
+			constexpr float epsilon = 1e-3f;
+
+			unsigned int nearest = 0;
+			float nearest_distance = std::numeric_limits<float>::max();
+			for (unsigned int i = 0; i < colors.size(); ++i)
+			{
+				glm::vec4 diff = colors[i] - color;
+				float distance = glm::dot(diff, diff);
+				if (distance < epsilon) return i;
+				if (distance < nearest_distance) { nearest = i; nearest_distance = distance; }
+			}
+
+			if (colors.size() < MAX_PAINT_PALETTE_COLORS)
+			{
+				colors.push_back(color);
+				return gsl::narrow<unsigned int>(colors.size() - 1);
+			}
+
+			return nearest;
+		}
+
+		// Uploads the palette to a shader which resolves palette-indexed paintmaps
+		static void setup(const Shader& shader)
+		{
+			if (colors.empty()) return;
+			shader.setVec4V("paint_palette", gsl::narrow<int>(colors.size()), colors.data());
+		}
+
+		static const std::vector<glm::vec4>& get_colors() { return colors; }
+
+		// Replaces the whole palette (e.g. when restoring paintmaps whose indices refer to a saved palette)
+		static void set_colors(const std::vector<glm::vec4>& new_colors) 
+		{ 
+			colors.assign(new_colors.begin(), new_colors.begin() + std::min<size_t>(new_colors.size(), MAX_PAINT_PALETTE_COLORS));
+		}
+	};
+
+	// A paint impact on a surface, from which the paint-space projection used to apply it onto a paintmap is derived
+	struct Splat
+	{
+		glm::vec3 position;  // World position of the impact
+		glm::vec3 direction; // Normalized direction of the paint when impacting
+		float     size;      // Size of the splat (half the extent of the paint-space frustum)
+		glm::vec4 color;     // Paint color
+
+		// Paint-space viewprojection: an orthographic projection looking along the paint direction
+		glm::mat4 paintspace_matrix(float near_plane, float far_plane, float distance_bias) const
+		{
+			glm::vec3 lateral = glm::normalize(glm::cross(direction, glm::vec3{0, 1, 0})); 
+			glm::vec3 up = glm::normalize(glm::cross(direction, lateral));
+
+			float frustum_size = size * 2;
+			glm::mat4 projection = glm::ortho(-frustum_size, frustum_size, -frustum_size, frustum_size, near_plane, far_plane);
+			glm::mat4 view = glm::lookAt(position - direction * distance_bias, position + direction, up);
+
+			return projection * view;
+		}
+	};
+
+	// Class that packs the paintmaps of every paintable entity into one texture array per storage format:
+	// lit shaders sample every paintmap through the same textures (locating them with the per-entity entries stored in an SSBO),
+	// while splats are applied in batches, rasterizing the splats of different entities in a single instanced draw per model
+	class PaintAtlas : utils::oop::non_copyable, utils::oop::non_movable
+	{
+	public:
+		constexpr static size_t FORMATS_AMOUNT = 3;
+		constexpr static size_t MAX_BATCH_SPLATS = 4096; // splats uploaded at once when applying them
+
+		// Area of a texture array layer assigned to a paintmap
+		struct Region
+		{
+			PaintmapFormat format;
+			unsigned int layer{ 0 }, x{ 0 }, y{ 0 }, width, height;
+		};
+
+	private:
+		// Mirrors the PaintAtlasEntry shader struct (std430 layout)
+		struct GPUEntry
+		{
+			glm::vec4  scale_offset; // uv scale (xy) and offset (zw) of the region in its layer
+			glm::ivec4 texel_region; // x, y, width, height of the region in texels
+			GLint layer, format, padding[2];
+		};
+
+		// Mirrors the PaintSplat shader struct (std430 layout)
+		struct GPUSplat
+		{
+			glm::mat4 model_matrix;
+			glm::mat4 paintspace_matrix;
+			glm::vec4 direction;
+			glm::vec4 color;
+			GLuint atlas_entry, color_index, tile, padding;
+		};
+
+		struct PendingSplat
+		{
+			const Model* model;
+			GPUSplat splat;
+		};
+
+		// Draw of the splats of a batch sharing the same model
+		struct SplatDraw
+		{
+			const Model* model;
+			GLint first;
+			GLsizei count;
+			bool ends_wave; // splats of the next wave may overlap these, so a barrier is needed after this draw
+		};
+
+		struct FormatArray
+		{
+			GLuint texture{ 0 };
+			unsigned int layer_size{ 0 }, layers{ 0 };
+		};
+
+		std::vector<Region> regions; // One per reserved paintmap (the entry index)
+		std::array<FormatArray, FORMATS_AMOUNT> arrays;
+		bool committed{ false };
+
+		std::vector<std::vector<PendingSplat>> pending_splats; // Pending splats per entry, in application order
+		size_t pending_amount{ 0 };
+
+		GLuint entries_ssbo{ 0 }, splats_ssbo{ 0 };
+
+		Shader* painter_shader;  // The shader which will apply the splats onto the paintmaps
+		Uniform<int> splats_offset_uniform; // set for every draw of a batch
+		Texture* splat_mask;     // The texture to apply on paintball impact
+		unsigned int tiles_per_side;
+		Framebuffer paint_fbo;   // Ad-hoc framebuffer used to rasterize splats, each splat of a wave in its own tile
+
+	public:
+		PaintAtlas(Shader& painter_shader, Texture& splat_mask, unsigned int tiles_per_side = 4, unsigned int tile_size = 256) :
+			painter_shader{ &painter_shader },
+			splats_offset_uniform{ painter_shader.uniform<int>("splats_offset") },
+			splat_mask{ &splat_mask },
+			tiles_per_side{ tiles_per_side },
+			paint_fbo{ tiles_per_side * tile_size, tiles_per_side * tile_size }
+		{
+			glGenBuffers(1, &entries_ssbo);
+			glGenBuffers(1, &splats_ssbo);
+		}
+
+		~PaintAtlas()
+		{
+			for (auto& array : arrays) glDeleteTextures(1, &array.texture);
+			glDeleteBuffers(1, &entries_ssbo);
+			glDeleteBuffers(1, &splats_ssbo);
+		}
+
+		// Reserves space for a paintmap and returns its entry index, the space is actually allocated by commit()
+		unsigned int reserve(PaintmapFormat format, unsigned int width, unsigned int height)
+		{
+			regions.push_back({ format, 0, 0, 0, width, height });
+			pending_splats.emplace_back();
+			committed = false;
+			return gsl::narrow<unsigned int>(regions.size() - 1);
+		}
+
+		// Changes the size of a reserved paintmap (every paintmap is cleared by the following commit)
+		void resize(unsigned int entry, unsigned int width, unsigned int height)
+		{
+			regions[entry].width = width; regions[entry].height = height;
+			committed = false;
+		}
+
+		// Packs the reserved paintmaps into layers and (re)creates the texture arrays, clearing every paintmap.
+		// Each paintmap gets a power of two block and blocks are placed in decreasing size along a Z-order curve,
+		// so they always end up aligned and tightly packed (the largest block sets the layer size)
+		void commit()
+		{
+			std::vector<GPUEntry> entries(regions.size());
+
+			for (size_t f = 0; f < FORMATS_AMOUNT; ++f)
+			{
+				FormatArray& array = arrays[f];
+				glDeleteTextures(1, &array.texture);
+				array = {};
+
+				std::vector<unsigned int> format_entries;
+				for (unsigned int i = 0; i < regions.size(); ++i)
+					if (static_cast<size_t>(regions[i].format) == f) format_entries.push_back(i);
+				if (format_entries.empty()) continue;
+
+				auto block_size = [&](unsigned int entry) { return std::bit_ceil(std::max(regions[entry].width, regions[entry].height)); };
+				std::sort(format_entries.begin(), format_entries.end(), [&](unsigned int a, unsigned int b) { return block_size(a) > block_size(b); });
+
+				array.layer_size = block_size(format_entries.front());
+				unsigned int unit = block_size(format_entries.back());
+				size_t units_per_layer = size_t(array.layer_size / unit) * (array.layer_size / unit);
+
+				size_t cursor = 0;
+				for (unsigned int entry : format_entries)
+				{
+					size_t block_units = size_t(block_size(entry) / unit) * (block_size(entry) / unit);
+					if (cursor + block_units > units_per_layer) { ++array.layers; cursor = 0; }
+
+					glm::uvec2 position = morton_decode(cursor) * unit;
+					Region& region = regions[entry];
+					region.layer = array.layers; region.x = position.x; region.y = position.y;
+					cursor += block_units;
+
+					float layer_size = static_cast<float>(array.layer_size);
+					entries[entry] =
+					{
+						{ region.width / layer_size, region.height / layer_size, region.x / layer_size, region.y / layer_size },
+						{ region.x, region.y, region.width, region.height },
+						gsl::narrow<GLint>(region.layer), gsl::narrow<GLint>(f)
+					};
+				}
+				++array.layers;
+
+				// Palette indices can't be interpolated, the filtering is done on decoded colors in the lit shader
+				GLint filter = static_cast<PaintmapFormat>(f) == PaintmapFormat::RGBA8 ? GL_LINEAR : GL_NEAREST;
+				Texture::FormatInfo info = format_info(static_cast<PaintmapFormat>(f));
+
+				glGenTextures(1, &array.texture);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+				glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, info.internal_format, array.layer_size, array.layer_size, array.layers);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, filter);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, filter);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+				glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+				// We initialize the paintmaps with zeros (no staging copy needed on the host)
+				glClearTexImage(array.texture, 0, info.format, info.data_type, nullptr);
+			}
+
+			utils::graphics::opengl::setup_buffer_object(entries_ssbo, GL_SHADER_STORAGE_BUFFER, PAINT_ATLAS_ENTRIES_BINDING,
+				sizeof(GPUEntry), entries.size(), GL_STATIC_DRAW, entries.data());
+
+			committed = true;
+		}
+
+		const Region& region(unsigned int entry) const { return regions[entry]; }
+
+		// Memory used by the texture arrays (including the space left unused by the packing)
+		size_t memory_bytes() const
+		{
+			size_t total = 0;
+			for (size_t f = 0; f < FORMATS_AMOUNT; ++f)
+				total += size_t(arrays[f].layer_size) * arrays[f].layer_size * arrays[f].layers * bytes_per_texel(static_cast<PaintmapFormat>(f));
+			return total;
+		}
+
+		// Logs the layers allocated for each format
+		void report() const
+		{
+			for (size_t f = 0; f < FORMATS_AMOUNT; ++f)
+			{
+				if (!arrays[f].layers) continue;
+				utils::io::info("PAINT ATLAS - ", magic_enum::enum_name(static_cast<PaintmapFormat>(f)), ": ", arrays[f].layers, " layers of ",
+					arrays[f].layer_size, "x", arrays[f].layer_size);
+			}
+			utils::io::info("PAINT ATLAS - Total: ", memory_bytes() / 1024, " KB");
+		}
+
+		// Enqueues a copy of the paintmap texels into the given pixel pack buffer
+		// The copy is asynchronous: the buffer should be mapped only after a fence placed after this call is signaled
+		void read(unsigned int entry, GLuint pack_buffer, size_t buffer_size)
+		{
+			if (!committed) commit();
+			const Region& r = regions[entry];
+			Texture::FormatInfo info = format_info(r.format);
+
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+			glPixelStorei(GL_PACK_ALIGNMENT, 1);
+			glGetTextureSubImage(arrays[static_cast<size_t>(r.format)].texture, 0, r.x, r.y, r.layer, r.width, r.height, 1,
+				info.format, info.data_type, gsl::narrow<GLsizei>(buffer_size), nullptr);
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		}
+
+		// Enqueues an update of the paintmap texels from the given pixel unpack buffer
+		void write(unsigned int entry, GLuint unpack_buffer)
+		{
+			if (!committed) commit();
+			const Region& r = regions[entry];
+			Texture::FormatInfo info = format_info(r.format);
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpack_buffer);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			glTextureSubImage3D(arrays[static_cast<size_t>(r.format)].texture, 0, r.x, r.y, r.layer, r.width, r.height, 1, info.format, info.data_type, nullptr);
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+
+		// Enqueues a splat onto the paintmap of an entry, drawn with the given model and model matrix
+		// (splats are applied in batches by apply_splats())
+		void enqueue_splat(unsigned int entry, const Model& model, const glm::mat4& model_matrix, const glm::mat4& paintspace_matrix,
+			const glm::vec3& paint_direction, const glm::vec4& paint_color)
+		{
+			GLuint color_index = regions[entry].format != PaintmapFormat::RGBA8 ? PaintPalette::index_of(paint_color) : 0;
+			pending_splats[entry].push_back({ &model, { model_matrix, paintspace_matrix, glm::vec4{ paint_direction, 0 }, paint_color, entry, color_index, 0, 0 } });
+			++pending_amount;
+		}
+
+		size_t pending() const { return pending_amount; }
+
+		// Applies every pending splat. Splats are grouped in waves holding at most one splat per entry (up to one per framebuffer tile):
+		// the splats of a wave never touch the same texels, so they are drawn together (one instanced draw per model)
+		// and only waves need to be separated by a memory barrier
+		void apply_splats()
+		{
+			if (!pending_amount) return;
+			if (!committed) commit();
+
+			// Entries with splats to apply, with the index of their next splat
+			std::vector<std::pair<unsigned int, size_t>> cursors;
+			for (unsigned int i = 0; i < pending_splats.size(); ++i)
+				if (!pending_splats[i].empty()) cursors.push_back({ i, 0 });
+
+			const size_t tiles_amount = size_t(tiles_per_side) * tiles_per_side;
+
+			std::vector<GPUSplat> batch; batch.reserve(MAX_BATCH_SPLATS);
+			std::vector<SplatDraw> draws;
+			std::vector<PendingSplat*> wave; wave.reserve(tiles_amount);
+
+			begin_painting();
+			while (!cursors.empty())
+			{
+				// Gather a wave
+				wave.clear();
+				for (size_t c = 0; c < cursors.size() && wave.size() < tiles_amount;)
+				{
+					auto& [entry, next] = cursors[c];
+					wave.push_back(&pending_splats[entry][next]);
+					if (++next == pending_splats[entry].size()) cursors.erase(cursors.begin() + c); else ++c;
+				}
+				std::sort(wave.begin(), wave.end(), [](const PendingSplat* a, const PendingSplat* b) { return a->model < b->model; });
+
+				if (batch.size() + wave.size() > MAX_BATCH_SPLATS) { draw_batch(batch, draws); batch.clear(); draws.clear(); }
+
+				// Each splat of the wave gets its own tile, splats sharing the same model are drawn together
+				for (size_t i = 0; i < wave.size(); ++i)
+				{
+					wave[i]->splat.tile = gsl::narrow<GLuint>(i);
+					if (draws.empty() || draws.back().ends_wave || draws.back().model != wave[i]->model)
+						draws.push_back({ wave[i]->model, gsl::narrow<GLint>(batch.size()), 0, false });
+					batch.push_back(wave[i]->splat);
+					++draws.back().count;
+				}
+				draws.back().ends_wave = true;
+			}
+			draw_batch(batch, draws);
+			end_painting();
+
+			for (auto& entry_splats : pending_splats) entry_splats.clear();
+			pending_amount = 0;
+		}
+
+		// Binds the texture arrays and the entries to a shader which samples paintmaps (the shader should be bound), along the palette
+		void bind(const Shader& shader) const
+		{
+			static constexpr UniformName sampler_names[FORMATS_AMOUNT] = { "paint_atlas_rgba8", "paint_atlas_rg8", "paint_atlas_r8" };
+			for (size_t f = 0; f < FORMATS_AMOUNT; ++f)
+			{
+				glActiveTexture(GL_TEXTURE0 + PAINT_ATLAS_TEX_UNIT + gsl::narrow<GLenum>(f));
+				glBindTexture(GL_TEXTURE_2D_ARRAY, arrays[f].texture);
+				shader.setInt(sampler_names[f], PAINT_ATLAS_TEX_UNIT + gsl::narrow<int>(f));
+			}
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PAINT_ATLAS_ENTRIES_BINDING, entries_ssbo);
+
+			PaintPalette::setup(shader);
+		}
+
+		// Texture format used to store a paintmap of the given format
+		static Texture::FormatInfo format_info(PaintmapFormat format)
+		{
+			switch (format)
+			{
+			case PaintmapFormat::PALETTE_RG8: return { GL_RG8 , GL_RG , GL_UNSIGNED_BYTE };
+			case PaintmapFormat::PALETTE_R8 : return { GL_R8  , GL_RED, GL_UNSIGNED_BYTE };
+			default:                          return { GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE };
+			}
+		}
+
+		// Amount of bytes used by a single texel of a paintmap of the given format
+		static size_t bytes_per_texel(PaintmapFormat format)
+		{
+			switch (format)
+			{
+			case PaintmapFormat::PALETTE_RG8: return 2;
+			case PaintmapFormat::PALETTE_R8 : return 1;
+			default:                          return 4;
+			}
+		}
+
+	private:
+		void begin_painting()
+		{
+			paint_fbo.bind();
+			painter_shader->bind();
+
+			// Splats are clipped to their frustum, as the rest of the framebuffer belongs to other splats
+			for (int i = 0; i < 4; ++i) glEnable(GL_CLIP_DISTANCE0 + i);
+
+			// Setup splat mask
+			glActiveTexture(GL_TEXTURE0);
+			splat_mask->bind();
+			painter_shader->setInt("splat_mask", 0);
+
+			// Bind paintmaps, each format has its own image unit (1: rgba8, 2: rg8, 3: r8) as the image format is fixed in the shader
+			for (size_t f = 0; f < FORMATS_AMOUNT; ++f)
+			{
+				if (!arrays[f].texture) continue;
+				glBindImageTexture(gsl::narrow<GLuint>(1 + f), arrays[f].texture, 0, GL_TRUE, 0, GL_READ_WRITE, format_info(static_cast<PaintmapFormat>(f)).internal_format);
+			}
+			painter_shader->setInt("tiles_per_side", tiles_per_side);
+
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PAINT_ATLAS_ENTRIES_BINDING, entries_ssbo);
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, PAINT_SPLATS_BINDING, splats_ssbo);
+		}
+
+		void draw_batch(std::vector<GPUSplat>& batch, const std::vector<SplatDraw>& draws)
+		{
+			if (batch.empty()) return;
+
+			// Orphan the previous storage, so we don't wait for the previous batch draws to complete
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, splats_ssbo);
+			glBufferData(GL_SHADER_STORAGE_BUFFER, MAX_BATCH_SPLATS * sizeof(GPUSplat), nullptr, GL_STREAM_DRAW);
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, batch.size() * sizeof(GPUSplat), batch.data());
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+			bool new_wave = true;
+			for (const SplatDraw& draw : draws)
+			{
+				if (new_wave) glClear(GL_DEPTH_BUFFER_BIT);
+
+				splats_offset_uniform.set(draw.first);
+				draw.model->draw_instanced(draw.count);
+
+				// This barrier is needed to ensure that the imageStore operations of a wave are completed
+				// before the next wave (whose splats may overlap) is processed
+				if (draw.ends_wave) glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+				new_wave = draw.ends_wave;
+			}
+		}
+
+		void end_painting()
+		{
+			for (int i = 0; i < 4; ++i) glDisable(GL_CLIP_DISTANCE0 + i);
+
+			painter_shader->unbind();
+			paint_fbo.unbind();
+
+			// The paintmaps will then be sampled as textures or read back
+			glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+		}
+
+		// Position of the n-th element of a Z-order curve (deinterleaving the bits of n)
+		static glm::uvec2 morton_decode(size_t n)
+		{
+			auto compact = [](uint64_t x)
+			{
+				x &= 0x5555555555555555ull;
+				x = (x | (x >> 1))  & 0x3333333333333333ull;
+				x = (x | (x >> 2))  & 0x0F0F0F0F0F0F0F0Full;
+				x = (x | (x >> 4))  & 0x00FF00FF00FF00FFull;
+				x = (x | (x >> 8))  & 0x0000FFFF0000FFFFull;
+				x = (x | (x >> 16)) & 0x00000000FFFFFFFFull;
+				return static_cast<unsigned int>(x);
+			};
+			return { compact(n), compact(n >> 1) };
+		}
+	};
+}
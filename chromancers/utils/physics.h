@@ -25,15 +25,13 @@ namespace engine::physics
     class GLDebugDrawer : public btIDebugDraw
     {
         int m_debugMode;
-        Camera* camera;
-        Shader* shader;
+        Shader* shader; // camera matrices come from the FrameData uniform block
 
 		GLuint vao, vbo, ebo;
 
     public:
-        GLDebugDrawer(Camera& camera, Shader& shader) :
+        GLDebugDrawer(Shader& shader) :
             m_debugMode(0),
-            camera(&camera),
             shader(&shader)
         {
 			glGenVertexArrays(1, &vao);
@@ -80,8 +78,6 @@ namespace engine::physics
             //use program
             shader->bind();
             shader->setVec3("colorIn", colors);
-            shader->setMat4("projectionMatrix", camera->projectionMatrix());
-            shader->setMat4("viewMatrix", camera->viewMatrix());
 
             //use geometry
             glBindVertexArray(vao);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+
+#include <glad.h>
+
+#include "oop.h"
+#include "utils.h"
+
+namespace utils::graphics::opengl
+{
+	// Counts a pipeline statistic (e.g. GL_FRAGMENT_SHADER_INVOCATIONS) over the commands issued between begin() and end()
+	// Each measure is read back only when its query slot comes around again, a few frames later, so it never stalls the pipeline
+	// (a tag can be given to each measure, to tell which setup the result read back belongs to)
+	// N.B. when the context lacks ARB_pipeline_statistics_query (core since 4.6) nothing is measured and the result stays 0
+	class PipelineStatisticsQuery : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		static constexpr unsigned int SLOTS = 3;
+
+		GLenum target;
+		bool _available;
+		std::array<GLuint, SLOTS> queries{};
+		std::array<bool, SLOTS> pending{};
+		std::array<int, SLOTS> tags{};
+		unsigned int slot{ 0 };
+		GLuint64 _result{ 0 };
+		int _result_tag{ 0 };
+
+	public:
+		PipelineStatisticsQuery(GLenum target) : target{ target }, _available{ has_extension("GL_ARB_pipeline_statistics_query") }
+		{
+			if (_available) glGenQueries(SLOTS, queries.data());
+		}
+
+		~PipelineStatisticsQuery()
+		{
+			if (_available) glDeleteQueries(SLOTS, queries.data());
+		}
+
+		void begin()
+		{
+			if (!_available) return;
+
+			// The slot was ended SLOTS measures ago, its result is ready by now
+			if (pending[slot])
+			{
+				glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &_result);
+				_result_tag = tags[slot];
+				pending[slot] = false;
+			}
+			glBeginQuery(target, queries[slot]);
+		}
+
+		void end(int tag = 0)
+		{
+			if (!_available) return;
+
+			glEndQuery(target);
+			pending[slot] = true;
+			tags[slot] = tag;
+			slot = (slot + 1) % SLOTS;
+		}
+
+		bool available() const { return _available; }
+
+		// Latest measure read back, and the tag it was ended with
+		GLuint64 result() const { return _result; }
+		int result_tag() const { return _result_tag; }
+	};
+}
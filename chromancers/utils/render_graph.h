@@ -0,0 +1,256 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+
+#include <glad.h>
+#include <gsl/gsl>
+
+#include "io.h"
+#include "texture.h"
+#include "framebuffer.h"
+
+namespace utils::graphics::opengl
+{
+	// Frame graph of render passes drawing into framebuffers (render targets) owned by the graph.
+	// Passes declare the targets they read and write, so that every frame the graph:
+	// - culls disabled passes, passes missing a required input and passes whose outputs nobody uses
+	// - assigns the targets to a pool of framebuffers, letting targets whose lifetimes don't overlap share the same framebuffer
+	// Passes are executed in the order they were added, which must already respect their dependencies
+	class RenderGraph
+	{
+		using Texture = engine::resources::Texture;
+
+	public:
+		using TargetHandle = unsigned int;
+
+		// Properties of a render target, targets can share a framebuffer only if these match
+		struct TargetDesc
+		{
+			Texture::FormatInfo color_format{ GL_RGBA, GL_RGBA, GL_UNSIGNED_BYTE };
+			Texture::FormatInfo depth_format{ GL_DEPTH_COMPONENT, GL_DEPTH_COMPONENT, GL_FLOAT };
+			unsigned int size_divisor{ 1 }; // the target is sized as the graph size divided by this
+
+			bool operator==(const TargetDesc& other) const
+			{
+				auto same_format = [](const Texture::FormatInfo& a, const Texture::FormatInfo& b)
+					{ return a.internal_format == b.internal_format && a.format == b.format && a.data_type == b.data_type; };
+				return same_format(color_format, other.color_format) && same_format(depth_format, other.depth_format) && size_divisor == other.size_divisor;
+			}
+		};
+
+		class Pass
+		{
+			friend class RenderGraph;
+
+			std::string _name;
+			std::function<void(RenderGraph&)> execute;
+			std::function<bool()> enabled;
+			std::vector<TargetHandle> reads, optional_reads, writes;
+			bool _side_effect{ false };
+			bool active{ false };
+
+		public:
+			Pass(std::string name, std::function<void(RenderGraph&)> execute) : _name{ std::move(name) }, execute{ std::move(execute) } {}
+
+			// The pass needs the target written by a previous pass, otherwise it is culled
+			Pass& read(TargetHandle target) { reads.push_back(target); return *this; }
+			// The pass uses the target if a previous pass wrote it (check with RenderGraph::available())
+			Pass& read_optional(TargetHandle target) { optional_reads.push_back(target); return *this; }
+			Pass& write(TargetHandle target) { writes.push_back(target); return *this; }
+			// The pass has effects outside the graph (e.g. presenting on the default framebuffer) so it is never culled for unused outputs
+			Pass& side_effect() { _side_effect = true; return *this; }
+			// The pass runs only in the frames where the condition holds
+			Pass& enabled_if(std::function<bool()> condition) { enabled = std::move(condition); return *this; }
+
+			const std::string& name() const { return _name; }
+			bool is_active() const { return active; }
+		};
+
+	private:
+		struct Target
+		{
+			std::string name;
+			TargetDesc desc;
+			int framebuffer{ -1 }; // index in the pool, -1 if not assigned this frame
+			int first_use, last_use;
+			bool written;
+		};
+
+		struct PooledFramebuffer
+		{
+			TargetDesc desc;
+			std::unique_ptr<Framebuffer> framebuffer;
+			int busy_until;
+			bool used; // assigned to a target in the last compile
+		};
+
+		unsigned int width, height;
+		std::vector<Target> targets;
+		std::vector<Pass> passes;
+		std::vector<PooledFramebuffer> pool;
+		size_t reported_pool_size{ 0 };
+
+	public:
+		RenderGraph(unsigned int width, unsigned int height) : width{ width }, height{ height } {}
+
+		// Removes every pass and target (the framebuffers pool is kept and reused by the following ones)
+		void reset()
+		{
+			passes.clear();
+			targets.clear();
+		}
+
+		TargetHandle create_target(std::string name, const TargetDesc& desc = {})
+		{
+			targets.push_back({ std::move(name), desc });
+			return gsl::narrow<TargetHandle>(targets.size() - 1);
+		}
+
+		Pass& add_pass(std::string name, std::function<void(RenderGraph&)> execute)
+		{
+			return passes.emplace_back(std::move(name), std::move(execute));
+		}
+
+		// The framebuffer assigned to a target in the current frame (valid only while executing the passes using it)
+		Framebuffer& framebuffer(TargetHandle target)
+		{
+			return *pool[targets[target].framebuffer].framebuffer;
+		}
+
+		// Whether a target was written by an active pass in the current frame
+		bool available(TargetHandle target) const { return targets[target].written; }
+
+		// Resizes every framebuffer of the pool, releasing the ones left unused by the last frame
+		void resize(unsigned int new_width, unsigned int new_height)
+		{
+			width = new_width; height = new_height;
+
+			std::erase_if(pool, [](const PooledFramebuffer& pooled) { return !pooled.used; });
+			for (auto& pooled : pool)
+				pooled.framebuffer->resize(target_width(pooled.desc), target_height(pooled.desc));
+		}
+
+		// Culls the passes, assigns the framebuffers and executes the active passes
+		void execute()
+		{
+			compile();
+			for (Pass& pass : passes)
+				if (pass.active) pass.execute(*this);
+		}
+
+		const std::vector<Pass>& get_passes() const { return passes; }
+
+		size_t active_passes() const { return std::count_if(passes.begin(), passes.end(), [](const Pass& p) { return p.active; }); }
+
+		// Memory used by the framebuffers of the pool
+		size_t memory_bytes() const
+		{
+			size_t total = 0;
+			for (const auto& pooled : pool) total += target_bytes(pooled.desc);
+			return total;
+		}
+
+		// Memory that would be used by giving every target its own framebuffer (no culling nor aliasing)
+		size_t unaliased_memory_bytes() const
+		{
+			size_t total = 0;
+			for (const auto& target : targets) total += target_bytes(target.desc);
+			return total;
+		}
+
+		void report() const
+		{
+			utils::io::info("RENDER GRAPH - ", targets.size(), " targets: ", unaliased_memory_bytes() / 1024, " KB with a framebuffer each, ",
+				memory_bytes() / 1024, " KB allocated in ", pool.size(), " framebuffers (", active_passes(), "/", passes.size(), " passes active)");
+		}
+
+	private:
+		void compile()
+		{
+			// Forward: drop the disabled passes and the ones missing a required input
+			for (auto& target : targets) target.written = false;
+			for (Pass& pass : passes)
+			{
+				pass.active = (!pass.enabled || pass.enabled()) &&
+					std::all_of(pass.reads.begin(), pass.reads.end(), [&](TargetHandle t) { return targets[t].written; });
+				if (pass.active)
+					for (TargetHandle t : pass.writes) targets[t].written = true;
+			}
+
+			// Backward: keep only the passes contributing to a side effect
+			std::vector<bool> needed(targets.size(), false);
+			for (auto pass = passes.rbegin(); pass != passes.rend(); ++pass)
+			{
+				if (!pass->active) continue;
+
+				pass->active = pass->_side_effect || std::any_of(pass->writes.begin(), pass->writes.end(), [&](TargetHandle t) { return needed[t]; });
+				if (!pass->active) continue;
+
+				for (TargetHandle t : pass->reads) needed[t] = true;
+				for (TargetHandle t : pass->optional_reads) needed[t] = true;
+			}
+
+			// Lifetimes of the targets, as the range of active passes using them
+			for (auto& target : targets) { target.first_use = -1; target.last_use = -1; target.written = false; target.framebuffer = -1; }
+			for (int i = 0; i < gsl::narrow<int>(passes.size()); ++i)
+			{
+				if (!passes[i].active) continue;
+
+				auto use = [&](TargetHandle t) { if (targets[t].first_use < 0) targets[t].first_use = i; targets[t].last_use = i; };
+				for (TargetHandle t : passes[i].writes) { use(t); targets[t].written = true; }
+				for (TargetHandle t : passes[i].reads) use(t);
+				for (TargetHandle t : passes[i].optional_reads) if (targets[t].written) use(t);
+			}
+
+			// Assign framebuffers in order of first use, reusing any compatible one which is not busy anymore
+			for (auto& pooled : pool) { pooled.busy_until = -1; pooled.used = false; }
+			for (int i = 0; i < gsl::narrow<int>(passes.size()); ++i)
+			{
+				for (auto& target : targets)
+				{
+					if (target.first_use != i) continue;
+
+					auto free = std::find_if(pool.begin(), pool.end(), [&](const PooledFramebuffer& p) { return p.busy_until < i && p.desc == target.desc; });
+					if (free == pool.end())
+					{
+						pool.push_back({ target.desc, std::make_unique<Framebuffer>(target_width(target.desc), target_height(target.desc),
+							target.desc.color_format, target.desc.depth_format) });
+						free = pool.end() - 1;
+					}
+
+					free->busy_until = target.last_use;
+					free->used = true;
+					target.framebuffer = gsl::narrow<int>(std::distance(pool.begin(), free));
+				}
+			}
+
+			// Log whenever the pool grows
+			if (pool.size() != reported_pool_size) { reported_pool_size = pool.size(); report(); }
+		}
+
+		unsigned int target_width (const TargetDesc& desc) const { return std::max(width  / desc.size_divisor, 1u); }
+		unsigned int target_height(const TargetDesc& desc) const { return std::max(height / desc.size_divisor, 1u); }
+
+		size_t target_bytes(const TargetDesc& desc) const
+		{
+			return size_t(target_width(desc)) * target_height(desc) * (texel_bytes(desc.color_format) + texel_bytes(desc.depth_format));
+		}
+
+		// Approximate size of a texel of the given format (unsized formats are counted as the driver usually allocates them)
+		static size_t texel_bytes(const Texture::FormatInfo& format)
+		{
+			switch (format.internal_format)
+			{
+			case GL_RGBA16F: case GL_RG32F: return 8;
+			case GL_RGBA32F:                return 16;
+			case GL_RG8: case GL_R16F:      return 2;
+			case GL_R8:                     return 1;
+			default:                        return 4; // RGB(A)8, R32F, depth
+			}
+		}
+	};
+}
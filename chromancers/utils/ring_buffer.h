@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstddef>
+#include <algorithm>
+#include <array>
+
+#include <glad.h>
+
+#include "io.h"
+#include "oop.h"
+
+namespace utils::graphics::opengl
+{
+	// Buffer object persistently mapped for writing, used as a ring to stream data which changes every draw (e.g. instance transforms)
+	// The ring is split in segments: before writing into a segment again, we wait for the fence placed when the previous use of it ended,
+	// so the CPU never overwrites data the GPU has yet to read, and the driver never has to reallocate or synchronize implicitly
+	class PersistentRingBuffer : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		static constexpr unsigned int SEGMENTS = 3; // triple buffering
+		static constexpr GLbitfield MAP_FLAGS = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+		GLenum target;
+		GLuint _id{ 0 };
+		std::byte* mapped{ nullptr };
+		size_t segment_size{ 0 };
+		size_t alignment{ 1 };
+
+		unsigned int segment{ 0 }; // segment being written
+		size_t offset{ 0 };        // next free byte of the buffer
+		std::array<GLsync, SEGMENTS> fences{};
+
+	public:
+		// Region of the ring returned to a writer, valid until it is bound and drawn
+		struct Allocation
+		{
+			void*    data;
+			GLintptr offset;
+			size_t   size;
+		};
+
+		PersistentRingBuffer(GLenum target, size_t segment_size) : target{ target }
+		{
+			GLint offset_alignment = 1;
+			glGetIntegerv(target == GL_SHADER_STORAGE_BUFFER ? GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT : GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+			alignment = std::max<size_t>(offset_alignment, 1);
+			create(segment_size);
+		}
+
+		~PersistentRingBuffer()
+		{
+			release();
+		}
+
+		// Reserves size bytes to be written through the returned pointer (the region is aligned for glBindBufferRange)
+		Allocation allocate(size_t size)
+		{
+			// Requests bigger than a segment make the whole ring grow
+			if (size > segment_size)
+				grow(size);
+
+			size_t start = align_up(offset);
+			if (start + size > (segment + 1) * segment_size)
+			{
+				next_segment();
+				start = offset;
+			}
+			offset = start + size;
+
+			return { mapped + start, static_cast<GLintptr>(start), size };
+		}
+
+		// Binds the first used_size bytes of an allocation to an indexed binding point (e.g. an SSBO binding)
+		void bind_range(GLuint index, const Allocation& allocation, size_t used_size) const
+		{
+			glBindBufferRange(target, index, _id, allocation.offset, static_cast<GLsizeiptr>(std::max<size_t>(used_size, 1)));
+		}
+
+		GLuint id() const { return _id; }
+		size_t capacity() const { return segment_size * SEGMENTS; }
+
+	private:
+		size_t align_up(size_t value) const { return (value + alignment - 1) / alignment * alignment; }
+
+		// Fences the segment we were writing and moves to the next one, waiting for the GPU to be done with it
+		void next_segment()
+		{
+			fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			segment = (segment + 1) % SEGMENTS;
+			offset = segment * segment_size;
+
+			if (GLsync fence = fences[segment])
+			{
+				while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1'000'000) == GL_TIMEOUT_EXPIRED) {}
+				glDeleteSync(fence);
+				fences[segment] = nullptr;
+			}
+		}
+
+		void create(size_t new_segment_size)
+		{
+			segment_size = align_up(new_segment_size);
+			segment = 0; offset = 0;
+
+			glCreateBuffers(1, &_id);
+			glNamedBufferStorage(_id, static_cast<GLsizeiptr>(segment_size * SEGMENTS), nullptr, MAP_FLAGS);
+			mapped = static_cast<std::byte*>(glMapNamedBufferRange(_id, 0, static_cast<GLsizeiptr>(segment_size * SEGMENTS), MAP_FLAGS));
+		}
+
+		// Releases the buffer (its deletion is deferred by the driver until the draws using it are completed)
+		void release()
+		{
+			for (GLsync& fence : fences) { if (fence) glDeleteSync(fence); fence = nullptr; }
+			if (_id)
+			{
+				glUnmapNamedBuffer(_id);
+				glDeleteBuffers(1, &_id);
+				_id = 0; mapped = nullptr;
+			}
+		}
+
+		void grow(size_t min_segment_size)
+		{
+			size_t new_segment_size = std::max(segment_size * 2, min_segment_size);
+			utils::io::info("RING BUFFER - growing from ", capacity() / 1024, " KB to ", align_up(new_segment_size) * SEGMENTS / 1024, " KB");
+			release();
+			create(new_segment_size);
+		}
+	};
+}
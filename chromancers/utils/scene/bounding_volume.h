@@ -19,6 +19,9 @@ namespace engine::scene
 
 		virtual bool isOnOrForwardPlane(const Plane& plane) const = 0;
 
+		// Whether the volume, placed by the transform, overlaps the given world space sphere (e.g. the reach of a light)
+		virtual bool intersectsSphere(const glm::vec3& sphere_center, float sphere_radius, const Transform& transform) const = 0;
+
 		bool isOnFrustum(const Frustum& camFrustum) const
 		{
 			return (isOnOrForwardPlane(camFrustum.leftFace) &&
@@ -90,6 +93,18 @@ namespace engine::scene
 				globalSphere.isOnOrForwardPlane(camFrustum.topFace) &&
 				globalSphere.isOnOrForwardPlane(camFrustum.bottomFace));
 		};
+
+		bool intersectsSphere(const glm::vec3& sphere_center, float sphere_radius, const Transform& transform) const final
+		{
+			const glm::vec3 globalScale = transform.size();
+			const glm::vec3 globalCenter{ transform.matrix() * glm::vec4(center, 1.f) };
+			const float maxScale = std::max(std::max(globalScale.x, globalScale.y), globalScale.z);
+
+			// Same global radius as the frustum test, compared squared against the distance between the centers
+			const float reach = radius * (maxScale * 0.5f) + sphere_radius;
+			const glm::vec3 offset = globalCenter - sphere_center;
+			return glm::dot(offset, offset) <= reach * reach;
+		}
 	};
 
 }
\ No newline at end of file
@@ -5,8 +5,19 @@
 
 #include "../utils.h"
 
+#define FRAME_DATA_BINDING 1
+
 namespace engine::scene
 {
+	// Per-frame camera data, mirrors the std140 FrameData uniform block shared by every shader
+	struct FrameData
+	{
+		glm::mat4 view_matrix;
+		glm::mat4 projection_matrix;
+		glm::vec3 camera_position;
+		float     padding;
+	};
+
 	// Class for managing a simple first person camera
 	class Camera
 	{ 
@@ -71,6 +82,14 @@ namespace engine::scene
 			return proj_matrix;
 		}
 
+		float near_plane() const { return _near_plane; }
+		float far_plane () const { return _far_plane;  }
+
+		FrameData frame_data()
+		{
+			return { view_matrix, proj_matrix, _position };
+		}
+
 		utils::math::Frustum frustum()
 		{
 			utils::math::Frustum frustum;
@@ -35,6 +35,15 @@ namespace engine::scene
 		}
 	}
 
+	bool EntityBase::is_moving() const
+	{
+		for (auto& c : components)
+		{
+			if (c->is_moving()) return true;
+		}
+		return false;
+	}
+
 	void EntityBase::on_collision(Entity& other, glm::vec3 contact_point, glm::vec3 norm, glm::vec3 impulse)
 	{
 		// Invoke the on_collision event for each component
@@ -101,7 +110,7 @@ namespace engine::scene
 		bounding_volume = std::make_unique<BoundingSphere>(drawable);
 	}
 
-	void Entity::draw() const noexcept
+	void Entity::draw(uint32_t point_light_mask) const noexcept
 	{
 		if (!(material))         { utils::io::error("ENTITY - Entity ", display_name, " has no material"); return; }
 		if (!(model   ))         { utils::io::error("ENTITY - Entity ", display_name, " has no model")   ; return; }
@@ -112,6 +121,7 @@ namespace engine::scene
 
 		current_shader.bind();
 		current_shader.setMat4("modelMatrix", _world_transform.matrix());
+		current_shader.setUint("point_light_mask", point_light_mask);
 
 		// If the model has materials of its own, use them
 		if (model->has_material())
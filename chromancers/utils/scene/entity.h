@@ -92,6 +92,9 @@ namespace engine::scene
 
 		const SceneState& scene_state() const;
 
+		// Whether any component is currently moving the entity (e.g. an awake rigidbody)
+		bool is_moving() const;
+
 #pragma region transform_stuff
 		const Transform& local_transform() const noexcept;
 		const Transform& world_transform() const noexcept;
@@ -131,6 +134,8 @@ namespace engine::scene
 
 		std::unique_ptr<BoundingVolume> bounding_volume; 
 
+		bool dynamic_shadow_caster{ false }; // Drawn by every shadow pass even when not moving, instead of being cached with the static casters
+
 		Entity(std::string display_name, Model& drawable, Material& material);
 
 		// Emplaces a component into the entity's collection given its construction arguments and returns a raw ptr to it
@@ -144,8 +149,8 @@ namespace engine::scene
 		// Draws the entity using the provided shader instead of the one included in the material
 		void custom_draw(const Shader& shader) const noexcept;
 
-		// Draws the entity using its material
-		void draw() const noexcept;
+		// Draws the entity using its material, shading only the point lights in the mask (bit i for the i-th light, see Scene::point_light_influences)
+		void draw(uint32_t point_light_mask = ~0u) const noexcept;
 
 	};
 }
\ No newline at end of file
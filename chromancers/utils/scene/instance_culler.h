@@ -0,0 +1,306 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include <algorithm>
+
+#include <glad.h>
+#include <gsl/gsl>
+#include <glm/glm.hpp>
+
+#include "../io.h"
+#include "../oop.h"
+#include "../utils.h"
+#include "../model.h"
+#include "../shader.h"
+#include "../texture.h"
+
+#include "bounding_volume.h"
+
+#define INSTANCE_CULL_INPUT_BINDING    7  // SSBO binding of the transforms of every instance of a group
+#define INSTANCE_CULL_VISIBLE_BINDING  8  // SSBO binding of the compacted transforms of the visible instances
+#define INSTANCE_CULL_COMMANDS_BINDING 9  // SSBO binding of the indirect commands of a group
+#define HIZ_TEX_UNIT                   14 // after the paint atlas units, so culling never disturbs the bound material
+
+namespace engine::scene
+{
+	// Culls groups of instances on the GPU (see instance_cull.comp): a compute pass tests the bounding sphere of every instance
+	// against the camera frustum, and optionally against a Hi-Z pyramid of the occluders depth, then appends the visible transforms
+	// to a compacted list and counts them directly into the indirect commands drawing the group
+	// The CPU only keeps the transforms up to date (see ResidentInstances), the draws never wait for it to read back which instances are visible nor how many
+	class GPUInstanceCuller : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		using Shader = engine::resources::Shader;
+		using Model = engine::resources::Model;
+		using Texture = engine::resources::Texture;
+
+	public:
+		// Layout of an indirect command, as read by glDrawElementsIndirect
+		struct DrawCommand
+		{
+			GLuint count;
+			GLuint instance_count;
+			GLuint first_index;
+			GLint  base_vertex;
+			GLuint base_instance;
+		};
+
+		// Regions of the culler buffers written for a group, valid until the next begin()
+		struct Group
+		{
+			GLintptr   visible_offset;
+			GLsizeiptr visible_size;
+			GLintptr   commands_offset;
+		};
+
+		static constexpr size_t INSTANCE_SIZE = 3 * sizeof(glm::vec4); // rows of the affine part of the transform
+
+		GPUInstanceCuller(Shader& cull_shader, Shader& hiz_shader) : cull_shader{ &cull_shader }, hiz_shader{ &hiz_shader }
+		{
+			GLint offset_alignment = 1;
+			glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &offset_alignment);
+			alignment = std::max<size_t>(offset_alignment, 1);
+
+			create_buffer(visible_buffer, visible_capacity, 1 << 20, 0);
+			create_buffer(commands_buffer, commands_capacity, 1 << 12, GL_DYNAMIC_STORAGE_BIT);
+		}
+
+		~GPUInstanceCuller()
+		{
+			glDeleteBuffers(1, &visible_buffer);
+			glDeleteBuffers(1, &commands_buffer);
+			if (hiz) glDeleteTextures(1, &hiz);
+			for (CountReadback& readback : count_readbacks) release_readback(readback);
+		}
+
+		// Starts a new frame: the regions used by the groups of the previous one are recycled,
+		// after copying their visible counts aside to be read back once the GPU is done with them
+		void begin()
+		{
+			collect_counts();
+			copy_counts();
+
+			visible_used = 0; commands_used = 0;
+			last_groups.clear();
+		}
+
+		// Culls the count instances whose transforms (3 rows each) are stored in the given buffer from the given offset
+		// The occlusion test is performed only along the frustum one, and if the pyramid was built from the same view projection
+		Group cull(GLuint transforms, GLintptr transforms_offset, size_t count, const Model& model,
+			const BoundingSphere& sphere, const utils::math::Frustum& frustum, const glm::mat4& view_projection, bool frustum_culling, bool occlusion_culling)
+		{
+			size_t command_count = model.meshes.size();
+			Group group{ reserve(visible_buffer, visible_capacity, visible_used, count * INSTANCE_SIZE, 0), gsl::narrow<GLsizeiptr>(count * INSTANCE_SIZE),
+				reserve(commands_buffer, commands_capacity, commands_used, command_count * sizeof(DrawCommand), GL_DYNAMIC_STORAGE_BIT) };
+
+			// Commands start with no instances, the culling pass counts the visible ones
+			std::vector<DrawCommand> commands;
+			for (const auto& mesh_entry : model.meshes)
+				commands.push_back({ gsl::narrow<GLuint>(mesh_entry.mesh.indices.size()), 0, 0, 0, 0 });
+			glNamedBufferSubData(commands_buffer, group.commands_offset, command_count * sizeof(DrawCommand), commands.data());
+
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, INSTANCE_CULL_INPUT_BINDING, transforms, transforms_offset, gsl::narrow<GLsizeiptr>(std::max<size_t>(count * INSTANCE_SIZE, 1)));
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, INSTANCE_CULL_VISIBLE_BINDING, visible_buffer, group.visible_offset, group.visible_size);
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, INSTANCE_CULL_COMMANDS_BINDING, commands_buffer, group.commands_offset, command_count * sizeof(DrawCommand));
+
+			std::array<glm::vec4, 6> planes;
+			const utils::math::Plane* faces[6] = { &frustum.leftFace, &frustum.rightFace, &frustum.topFace, &frustum.bottomFace, &frustum.nearFace, &frustum.farFace };
+			for (size_t i = 0; i < planes.size(); i++) planes[i] = glm::vec4(faces[i]->normal, faces[i]->distance);
+
+			bool use_occlusion = frustum_culling && occlusion_culling && hiz && view_projection == hiz_view_projection;
+
+			cull_shader->bind();
+			cull_shader->setUint("instance_count", gsl::narrow<unsigned int>(count));
+			cull_shader->setUint("command_count", gsl::narrow<unsigned int>(command_count));
+			cull_shader->setVec4("bounding_sphere", glm::vec4(sphere.center, sphere.radius));
+			cull_shader->setBool("frustum_culling", frustum_culling);
+			cull_shader->setVec4V("frustum_planes", gsl::narrow<int>(planes.size()), planes.data());
+			cull_shader->setBool("occlusion_culling", use_occlusion);
+			if (use_occlusion)
+			{
+				glBindTextureUnit(HIZ_TEX_UNIT, hiz);
+				cull_shader->setInt("hiz", HIZ_TEX_UNIT);
+				cull_shader->setInt("hiz_levels", hiz_levels);
+				cull_shader->setMat4("hiz_view_projection", hiz_view_projection);
+			}
+
+			glDispatchCompute(gsl::narrow<GLuint>((count + 63) / 64), 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+			cull_shader->unbind();
+
+			last_groups.push_back(group);
+			return group;
+		}
+
+		// Draws the visible instances of a culled group with the bound shader, which reads their transforms (3 rows each) at SSBO binding 0
+		void draw(const Group& group, const Model& model) const
+		{
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, visible_buffer, group.visible_offset, std::max<GLsizeiptr>(group.visible_size, 1));
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands_buffer);
+			model.draw_indirect(group.commands_offset, sizeof(DrawCommand));
+			glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+		}
+
+		// Builds the Hi-Z pyramid used for occlusion culling from a depth buffer rendered with the given view projection
+		void build_hiz(const Texture& depth, const glm::mat4& view_projection)
+		{
+			if (!hiz || hiz_width != depth.width() || hiz_height != depth.height())
+				create_hiz(depth.width(), depth.height());
+
+			hiz_shader->bind();
+			hiz_shader->setInt("source", HIZ_TEX_UNIT);
+
+			// Level 0 is a copy of the depth buffer, then each level reduces the previous one
+			for (int level = 0; level < hiz_levels; level++)
+			{
+				glBindTextureUnit(HIZ_TEX_UNIT, level == 0 ? depth.id() : hiz);
+				hiz_shader->setInt("source_level", level - 1);
+				glBindImageTexture(0, hiz, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+				GLuint width = std::max(hiz_width >> level, 1u), height = std::max(hiz_height >> level, 1u);
+				glDispatchCompute((width + 7) / 8, (height + 7) / 8, 1);
+				glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+			}
+			hiz_shader->unbind();
+
+			hiz_view_projection = view_projection;
+		}
+
+		// Visible instances counted a few frames ago, the latest count read back without stalling (only meant for debugging)
+		size_t visible_instances() const { return _visible_instances; }
+
+		// Self-test support: culls the given instances against the frustum only and waits for the count of the kept ones
+		// (stalls until the GPU is done, so only for checks run on demand; the count is left out of visible_instances)
+		size_t count_visible(GLuint transforms, size_t count, const Model& model, const BoundingSphere& sphere, const utils::math::Frustum& frustum)
+		{
+			Group group = cull(transforms, 0, count, model, sphere, frustum, glm::mat4{ 1 }, true, false);
+			last_groups.pop_back();
+
+			GLuint visible = 0;
+			glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+			glGetNamedBufferSubData(commands_buffer, group.commands_offset + offsetof(DrawCommand, instance_count), sizeof(GLuint), &visible);
+			return visible;
+		}
+
+	private:
+		Shader* cull_shader;
+		Shader* hiz_shader;
+		size_t alignment{ 1 };
+
+		GLuint visible_buffer{ 0 }, commands_buffer{ 0 };
+		size_t visible_capacity{ 0 }, commands_capacity{ 0 };
+		size_t visible_used{ 0 }, commands_used{ 0 };
+		std::vector<Group> last_groups;
+
+		// Visible counts of a frame copied into a mapped buffer, read once its fence is signaled (as many slots as the frames in flight)
+		struct CountReadback
+		{
+			GLuint buffer{ 0 };
+			const GLuint* mapped{ nullptr };
+			size_t capacity{ 0 }, count{ 0 };
+			GLsync fence{ nullptr };
+		};
+		static constexpr unsigned int COUNT_READBACK_SLOTS = 3;
+		std::array<CountReadback, COUNT_READBACK_SLOTS> count_readbacks{};
+		unsigned int count_readback_slot{ 0 };
+		size_t _visible_instances{ 0 };
+
+		GLuint hiz{ 0 };
+		GLuint hiz_width{ 0 }, hiz_height{ 0 };
+		int hiz_levels{ 0 };
+		glm::mat4 hiz_view_projection{ 0 };
+
+		size_t align_up(size_t value) const { return (value + alignment - 1) / alignment * alignment; }
+
+		void create_buffer(GLuint& buffer, size_t& capacity, size_t size, GLbitfield flags)
+		{
+			capacity = size;
+			glCreateBuffers(1, &buffer);
+			glNamedBufferStorage(buffer, gsl::narrow<GLsizeiptr>(capacity), nullptr, flags);
+		}
+
+		// Reserves an aligned region of a buffer, recreating it bigger if needed
+		// (the regions of the previous groups don't need to be preserved, since their draws were already issued)
+		GLintptr reserve(GLuint& buffer, size_t& capacity, size_t& used, size_t size, GLbitfield flags)
+		{
+			size_t offset = align_up(used);
+			if (offset + size > capacity)
+			{
+				utils::io::info("INSTANCE CULLER - growing buffer from ", capacity / 1024, " KB to ", std::max(capacity * 2, size) / 1024, " KB");
+				glDeleteBuffers(1, &buffer);
+				create_buffer(buffer, capacity, std::max(capacity * 2, size), flags);
+				offset = 0;
+				last_groups.clear(); // their regions are gone with the old buffer
+			}
+			used = offset + size;
+			return gsl::narrow<GLintptr>(offset);
+		}
+
+		// Copies the instance count of each group of the last frame into the next readback slot (skipped if that slot is still in flight)
+		void copy_counts()
+		{
+			CountReadback& readback = count_readbacks[count_readback_slot];
+			if (last_groups.empty() || readback.fence) return;
+
+			if (readback.capacity < last_groups.size())
+			{
+				release_readback(readback);
+				readback.capacity = std::max<size_t>(last_groups.size(), 64);
+				constexpr GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+				glCreateBuffers(1, &readback.buffer);
+				glNamedBufferStorage(readback.buffer, gsl::narrow<GLsizeiptr>(readback.capacity * sizeof(GLuint)), nullptr, flags);
+				readback.mapped = static_cast<const GLuint*>(glMapNamedBufferRange(readback.buffer, 0, gsl::narrow<GLsizeiptr>(readback.capacity * sizeof(GLuint)), flags));
+			}
+
+			for (size_t i = 0; i < last_groups.size(); i++)
+				glCopyNamedBufferSubData(commands_buffer, readback.buffer, last_groups[i].commands_offset + offsetof(DrawCommand, instance_count),
+					gsl::narrow<GLintptr>(i * sizeof(GLuint)), sizeof(GLuint));
+			readback.count = last_groups.size();
+			readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			count_readback_slot = (count_readback_slot + 1) % COUNT_READBACK_SLOTS;
+		}
+
+		// Sums the counts of the readback slots whose copy is done, without waiting for the others
+		void collect_counts()
+		{
+			for (unsigned int i = 1; i <= COUNT_READBACK_SLOTS; i++)
+			{
+				CountReadback& readback = count_readbacks[(count_readback_slot + i) % COUNT_READBACK_SLOTS]; // oldest first, so the newest count wins
+				if (!readback.fence) continue;
+
+				GLenum status = glClientWaitSync(readback.fence, 0, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) continue;
+
+				glDeleteSync(readback.fence);
+				readback.fence = nullptr;
+				_visible_instances = 0;
+				for (size_t group = 0; group < readback.count; group++) _visible_instances += readback.mapped[group];
+			}
+		}
+
+		static void release_readback(CountReadback& readback)
+		{
+			if (readback.fence) glDeleteSync(readback.fence);
+			if (readback.buffer)
+			{
+				glUnmapNamedBuffer(readback.buffer);
+				glDeleteBuffers(1, &readback.buffer);
+			}
+			readback = {};
+		}
+
+		void create_hiz(GLuint width, GLuint height)
+		{
+			if (hiz) glDeleteTextures(1, &hiz);
+			hiz_width = width; hiz_height = height;
+			hiz_levels = 1 + static_cast<int>(std::floor(std::log2(std::max(width, height))));
+
+			glCreateTextures(GL_TEXTURE_2D, 1, &hiz);
+			glTextureStorage2D(hiz, hiz_levels, GL_R32F, width, height);
+			glTextureParameteri(hiz, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+			glTextureParameteri(hiz, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		}
+	};
+}
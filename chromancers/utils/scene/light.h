@@ -1,9 +1,19 @@
 #pragma once
 
+#include <array>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <limits>
+#include <bit>
+#include <cmath>
+
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
 #include "../io.h"
+#include "../oop.h"
+#include "../utils.h"
 #include "../shader.h"
 #include "../texture.h"
 #include "../framebuffer.h"
@@ -13,9 +23,215 @@
 #define MAX_SPOT_LIGHTS  3
 #define MAX_DIR_LIGHTS   3
 #define MAX_LIGHTS MAX_POINT_LIGHTS+MAX_SPOT_LIGHTS+MAX_DIR_LIGHTS
+#define MAX_SHADOW_CASCADES 4
+
+#define LIGHTS_BINDING 2
 
 namespace engine::scene
 {
+	// Depth precision of the shadowmaps: 16 bit halves the memory and the bandwidth of every shadow pass and lookup,
+	// but its fixed steps need a larger bias on long ranges (e.g. the far cascades of a directional light)
+	enum class ShadowFormat { depth16, depth32f };
+
+	inline GLenum shadow_internal_format(ShadowFormat format) { return format == ShadowFormat::depth16 ? GL_DEPTH_COMPONENT16 : GL_DEPTH_COMPONENT32F; }
+	inline size_t shadow_texel_bytes(ShadowFormat format) { return format == ShadowFormat::depth16 ? 2 : 4; }
+
+	// Makes the lookups of a shadowmap compare against a reference depth (sampler*Shadow in the shaders), with linear filtering
+	// the hardware blends the results of the 4 nearest texels, so every fetch is already a 2x2 PCF
+	inline void set_shadow_compare(GLenum target)
+	{
+		glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(target, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+		glTexParameteri(target, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	}
+
+	// Depth of the static shadow casters of the scene as seen by a light, rendered again only when they or the light change
+	// Each frame the light copies it into its own shadowmap and draws only the dynamic casters on top (see Scene::draw_shadow_casters),
+	// or skips the shadow pass altogether if there are none and the shadowmap already holds the cached depth alone
+	// Every layer (cube face or cascade) is tracked on its own, with its own light signature, so a shadow pass can update just some of them (see ShadowScheduler)
+	class StaticShadowCache : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		using BasicFramebuffer = utils::graphics::opengl::BasicFramebuffer;
+		using ShadowCasters = Scene::ShadowCasters;
+
+	public:
+		static constexpr unsigned int MAX_LAYERS = 6;
+		using Signatures = std::array<uint32_t, MAX_LAYERS>; // of everything affecting the view of each layer of a light (e.g. its lightspace matrix)
+
+		static inline bool enabled{ true }; // When disabled, every shadow pass draws all the casters from scratch
+
+	private:
+		GLenum target; // GL_TEXTURE_CUBE_MAP or GL_TEXTURE_2D_ARRAY, as the shadowmap of the light
+		GLuint depthmap{ 0 };
+		unsigned int resolution{ 0 }, layers{ 0 };
+		GLenum format{ GL_DEPTH_COMPONENT32F };
+		BasicFramebuffer framebuffer;
+
+		std::array<std::optional<uint32_t>, MAX_LAYERS> signatures; // of the static casters and the light state each layer was rendered with
+		std::array<bool, MAX_LAYERS> dynamic_drawn{};              // whether each layer of the shadowmap holds dynamic casters on top of the cached depth
+
+	public:
+		StaticShadowCache(GLenum target) : target{ target } {}
+
+		~StaticShadowCache()
+		{
+			if (depthmap) glDeleteTextures(1, &depthmap);
+		}
+
+		// Follows the format of the shadowmaps of the light (needed to copy into them), the cached depth is rendered again with the next pass
+		void set_format(ShadowFormat new_format)
+		{
+			GLenum internal_format = shadow_internal_format(new_format);
+			if (format == internal_format) return;
+
+			format = internal_format;
+			resolution = 0; // recreated and outdated
+			signatures.fill(std::nullopt);
+		}
+
+		// Video memory taken by the cached depth
+		size_t memory() const { return depthmap && resolution ? size_t(resolution) * resolution * layers * (format == GL_DEPTH_COMPONENT16 ? 2 : 4) : 0; }
+
+		// Whether the cached depth of some layer no longer matches the light or the static casters
+		bool is_stale(const Scene::ShadowCastersState& casters, const Signatures& light_signatures, unsigned int shadow_layers) const
+		{
+			uint32_t casters_signature = casters.static_signature;
+			for (unsigned int layer = 0; layer < shadow_layers; layer++)
+			{
+				if (layer >= layers || signatures[layer] != signature_of(casters_signature, light_signatures[layer])) return true;
+			}
+			return false;
+		}
+
+		// Layers of the shadowmap which a shadow pass would change if performed now
+		uint32_t outdated_layers(const Scene::ShadowCastersState& casters, const Signatures& light_signatures, unsigned int shadow_resolution, unsigned int shadow_layers) const
+		{
+			if (!enabled || shadow_resolution != resolution || shadow_layers != layers) return mask_of(shadow_layers);
+
+			bool dynamic = casters.dynamic;
+			uint32_t casters_signature = casters.static_signature;
+			uint32_t outdated = 0;
+			for (unsigned int layer = 0; layer < layers; layer++)
+			{
+				if (signatures[layer] != signature_of(casters_signature, light_signatures[layer]) || dynamic || dynamic_drawn[layer]) outdated |= 1u << layer;
+			}
+			return outdated;
+		}
+
+		// Renders the requested layers of the shadowmap of a light, given its framebuffer and the signatures of its layers
+		// draw_casters binds the shadow shader with the light uniforms and draws the requested casters into the given layers of the bound framebuffer,
+		// whose depth attachment is the given texture (the shadowmap or the cached depth)
+		template <typename DrawCasters>
+		void render(const Scene::ShadowCastersState& casters, BasicFramebuffer& shadow_framebuffer, GLuint shadowmap, unsigned int shadow_resolution, unsigned int shadow_layers,
+			const Signatures& light_signatures, uint32_t requested_layers, DrawCasters draw_casters)
+		{
+			requested_layers &= mask_of(shadow_layers);
+			if (!requested_layers) return;
+
+			if (!enabled)
+			{
+				signatures.fill(std::nullopt);
+				shadow_framebuffer.bind();
+				clear(shadowmap, shadow_resolution, shadow_layers, requested_layers);
+				draw_casters(ShadowCasters::all, shadowmap, requested_layers);
+				shadow_framebuffer.unbind();
+				return;
+			}
+
+			if (shadow_resolution != resolution || shadow_layers != layers) create(shadow_resolution, shadow_layers);
+
+			bool dynamic = casters.dynamic;
+			uint32_t casters_signature = casters.static_signature;
+			std::array<uint32_t, MAX_LAYERS> layer_signatures{};
+			uint32_t stale = 0, updated = 0;
+			for (unsigned int layer = 0; layer < layers; layer++)
+			{
+				if (!(requested_layers & (1u << layer))) continue;
+
+				layer_signatures[layer] = signature_of(casters_signature, light_signatures[layer]);
+				if (signatures[layer] != layer_signatures[layer]) stale |= 1u << layer;
+				if ((stale & (1u << layer)) || dynamic || dynamic_drawn[layer]) updated |= 1u << layer; // otherwise nothing changed since the last copy
+			}
+
+			if (stale)
+			{
+				framebuffer.bind();
+				clear(depthmap, resolution, layers, stale);
+				draw_casters(ShadowCasters::static_only, depthmap, stale);
+				framebuffer.unbind();
+			}
+
+			// Restore the static depth, then let the dynamic casters depth test against it
+			for (unsigned int layer = 0; layer < layers; layer++)
+			{
+				if (!(updated & (1u << layer))) continue;
+
+				glCopyImageSubData(depthmap, target, 0, 0, 0, layer, shadowmap, target, 0, 0, 0, layer, resolution, resolution, 1);
+				signatures[layer] = layer_signatures[layer];
+				dynamic_drawn[layer] = dynamic;
+			}
+			if (dynamic && updated)
+			{
+				shadow_framebuffer.bind();
+				draw_casters(ShadowCasters::dynamic_only, shadowmap, updated);
+				shadow_framebuffer.unbind();
+			}
+		}
+
+	private:
+		static uint32_t mask_of(unsigned int layer_count) { return (1u << layer_count) - 1; }
+
+		static uint32_t signature_of(uint32_t casters_signature, uint32_t light_signature)
+		{
+			return utils::strings::hash_fnv1a(&light_signature, sizeof(light_signature), casters_signature);
+		}
+
+		// Clears the given layers of a depth texture attached to the bound framebuffer
+		static void clear(GLuint texture, unsigned int texture_resolution, unsigned int texture_layers, uint32_t cleared_layers)
+		{
+			if (cleared_layers == mask_of(texture_layers)) { glClear(GL_DEPTH_BUFFER_BIT); return; }
+
+			float far_depth = 1.f;
+			for (unsigned int layer = 0; layer < texture_layers; layer++)
+			{
+				if (cleared_layers & (1u << layer))
+					glClearTexSubImage(texture, 0, 0, 0, layer, texture_resolution, texture_resolution, 1, GL_DEPTH_COMPONENT, GL_FLOAT, &far_depth);
+			}
+		}
+
+		// Creates the cached depth with the same format of the shadowmaps, so it can be copied into them
+		void create(unsigned int new_resolution, unsigned int new_layers)
+		{
+			resolution = new_resolution;
+			layers = new_layers;
+			signatures.fill(std::nullopt);
+
+			if (depthmap) glDeleteTextures(1, &depthmap);
+			glGenTextures(1, &depthmap);
+			glBindTexture(target, depthmap);
+			if (target == GL_TEXTURE_CUBE_MAP)
+			{
+				for (unsigned int i = 0; i < 6; ++i)
+					glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, format, resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+			}
+			else
+				glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, format, resolution, resolution, layers, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+			glTexParameteri(target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			glBindTexture(target, 0);
+
+			framebuffer.resize(resolution, resolution);
+			framebuffer.bind();
+			{
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthmap, 0);
+				glDrawBuffer(GL_NONE); // NO COLOR ATTACHMENT NEEDED
+				glReadBuffer(GL_NONE);
+			}
+			framebuffer.unbind();
+		}
+	};
+
 	// Class representing a generic light source in the game world
 	class Light
 	{
@@ -30,18 +246,38 @@ namespace engine::scene
 			color{ color }, intensity{ intensity }
 		{}
 
-		// Given a scene of entities, computes a shadowmap from the lights POV
+		static constexpr uint32_t ALL_SHADOW_LAYERS = 0x3F; // every face of a shadow cube, or every cascade of a directional shadowmap
+
+		// Given a scene of entities, computes a shadowmap from the lights POV, updating only the requested layers (cube faces or cascades)
 		// each type of light will have their own way to compute the map
-		virtual void compute_shadowmap(engine::scene::Scene& scene) {};
+		// The state of the casters is gathered once per frame by the caller (see Scene::shadow_casters_state) and shared by every light
+		virtual void compute_shadowmap(engine::scene::Scene& scene, const engine::scene::Scene::ShadowCastersState& casters, uint32_t layers = ALL_SHADOW_LAYERS) {};
+
+		// Layers of the shadowmap which would change if computed now, each one costing shadow_layer_texels() (see ShadowScheduler)
+		virtual uint32_t outdated_shadow_layers(const engine::scene::Scene::ShadowCastersState& casters) { return 0; }
+		virtual size_t shadow_layer_texels() const { return 0; }
 
-		// Setups the light uniforms onto the given shader
-		virtual void setup(const Shader& shader, size_t index) = 0;
+		// Video memory taken by the shadowmap and its static cache
+		virtual size_t shadow_memory() const { return 0; }
+
+		// How urgently the shadowmap should be updated compared to the other lights ones
+		virtual float shadow_priority(engine::scene::Scene& scene, const engine::scene::Scene::ShadowCastersState& casters) { return 1.f; }
+
+		// Layers of the shadowmap created since their last update (after a resize, format or cascades change), holding undefined depth
+		// until computed: they must not wait for the budget
+		uint32_t undefined_shadow_layers() const { return undefined_layers; }
 
 	protected:
-		void setBaseLightAttributes(const Shader& shader, const std::string& prefix)
+		uint32_t undefined_layers{ 0 };
+
+		// Distance where a light attenuated as in the shaders (including their 0.001 offset) falls below cutoff times its brightest channel at the source
+		float attenuation_radius(float cutoff, float constant, float linear, float quadratic) const
 		{
-			shader.setVec4 (prefix + "color", color);
-			shader.setFloat(prefix + "intensity", intensity);
+			float brightest = intensity * std::max({ color.r, color.g, color.b });
+			float c = constant + 0.001f - brightest / cutoff;
+			if (c >= 0) return 0;
+			if (quadratic <= 0) return linear > 0 ? -c / linear : std::numeric_limits<float>::infinity();
+			return (-linear + std::sqrt(linear * linear - 4 * quadratic * c)) / (2 * quadratic);
 		}
 	};
 
@@ -49,10 +285,23 @@ namespace engine::scene
 	class PointLight : public Light
 	{
 	public:
+		// Ways of drawing the casters into the faces of the shadow cube
+		enum class CubeShadowPath
+		{
+			geometry_shader, // every triangle is emitted to all the faces (shadow_cube.geom), the fallback when the others have no shader
+			layered,         // casters are culled per face and instanced once per overlapped face, selecting gl_Layer in the vertex shader
+			per_face         // casters are culled per face and drawn once per overlapped face, attaching one face at a time
+		};
+
 		//Struct to hold information about settings used for generating a shadowmap
 		struct ShadowMapSettings
 		{
-			Shader* shader = nullptr; 
+			Shader* shader = nullptr;         // geometry shader path (shadow_cube.vert/geom/frag)
+			Shader* layered_shader = nullptr; // layered path (shadow_cube_layered.vert), needs ARB_shader_viewport_layer_array
+			Shader* face_shader = nullptr;    // per face path (shadow_cube_face.vert)
+			Shader* instanced_shader = nullptr; // instanced casters of the scene, with the geometry shader (shadow_cube_instanced.vert/geom/frag), none if not set
+			CubeShadowPath path = CubeShadowPath::geometry_shader;
+			ShadowFormat format = ShadowFormat::depth32f;
 			unsigned int resolution = 1024;
 			float frustum_near = 1.f; 
 			float frustum_far = 25.f;
@@ -62,6 +311,11 @@ namespace engine::scene
 		// Dedicated framebuffer for computing the shadowmap
 		utils::graphics::opengl::BasicFramebuffer depthmap_framebuffer;
 		unsigned int depthCubemap; // OpenGL id for the shadow cubemap
+		StaticShadowCache static_cache{ GL_TEXTURE_CUBE_MAP };
+		size_t caster_face_draws{ 0 }; // Casters drawn into a face by the last shadow pass (all of them 6 times with the geometry shader)
+
+		// Contribution below which entities are considered out of reach, an 8 bit color step by default so the cut is not noticeable
+		static inline float influence_cutoff{ 1.f / 256.f };
 
 		// Light attributes
 		glm::vec3 position; // Light world position 
@@ -71,6 +325,16 @@ namespace engine::scene
 		float attenuation_linear      = 0.1f;
 		float attenuation_quadratic   = 0.02f;
 
+		// Mirrors the PointLight struct of the shaders (std140)
+		struct GPUData
+		{
+			glm::vec4 color;
+			glm::vec3 position;
+			float     intensity;
+			float     attenuation_constant, attenuation_linear, attenuation_quadratic;
+			float     padding;
+		};
+
 		PointLight(const glm::vec3& position, 
 			const glm::vec4& color = { 1.0f, 1.0f, 1.0f, 1.0f }, const float intensity = { 1.0f }, ShadowMapSettings shadowmap_settings = {}) :
 			Light{ color, intensity }, 
@@ -79,17 +343,19 @@ namespace engine::scene
 			position{ position } 
 		{
 			glGenTextures(1, &depthCubemap);
+			static_cache.set_format(shadowmap_settings.format);
 			create_depth_cubemap(shadowmap_settings.resolution);
 		}
 
-		void setup(const Shader& shader, size_t index)
+		GPUData gpu_data() const
+		{
+			return { color, position, intensity, attenuation_constant, attenuation_linear, attenuation_quadratic };
+		}
+
+		// Distance where the light falls below the influence cutoff, lit entities farther than that don't evaluate it (see Scene::point_light_influences)
+		float influence_radius() const
 		{
-			std::string prefix = "pointLights[" + std::to_string(index) + "].";
-			setBaseLightAttributes(shader, prefix);
-			shader.setVec3 (prefix + "position", position);
-			shader.setFloat(prefix + "attenuation_constant" , attenuation_constant);
-			shader.setFloat(prefix + "attenuation_linear"   , attenuation_linear);
-			shader.setFloat(prefix + "attenuation_quadratic", attenuation_quadratic);
+			return attenuation_radius(influence_cutoff, attenuation_constant, attenuation_linear, attenuation_quadratic);
 		}
 
 		void resize_shadowmap(unsigned int new_resolution)
@@ -102,7 +368,47 @@ namespace engine::scene
 			create_depth_cubemap(new_resolution);
 		}
 
-		void compute_shadowmap(engine::scene::Scene& scene) override
+		void set_shadow_format(ShadowFormat new_format)
+		{
+			if (shadowmap_settings.format == new_format) return;
+
+			shadowmap_settings.format = new_format;
+			static_cache.set_format(new_format);
+			create_depth_cubemap(shadowmap_settings.resolution);
+		}
+
+		uint32_t outdated_shadow_layers(const Scene::ShadowCastersState& casters) override
+		{
+			return static_cache.outdated_layers(casters, shadow_signatures(compute_lightspace_matrices()), shadowmap_settings.resolution, 6);
+		}
+
+		size_t shadow_layer_texels() const override
+		{
+			return size_t(shadowmap_settings.resolution) * shadowmap_settings.resolution;
+		}
+
+		size_t shadow_memory() const override
+		{
+			return shadow_layer_texels() * 6 * shadow_texel_bytes(shadowmap_settings.format) + static_cache.memory();
+		}
+
+		// Higher when the light moved (its shadows are wrong, not just late) or dynamic casters are in its range, lower when far from the camera
+		float shadow_priority(engine::scene::Scene& scene, const Scene::ShadowCastersState& casters) override
+		{
+			float priority = 1.f;
+			if (static_cache.is_stale(casters, shadow_signatures(compute_lightspace_matrices()), 6)) priority *= 4.f;
+
+			for (const Entity* caster : casters.dynamic_casters)
+			{
+				if (glm::distance(caster->world_transform().position(), position) < shadowmap_settings.frustum_far) { priority *= 2.f; break; }
+			}
+
+			if (scene.current_camera)
+				priority /= 1.f + glm::distance(scene.current_camera->position(), position) / shadowmap_settings.frustum_far;
+			return priority;
+		}
+
+		void compute_shadowmap(engine::scene::Scene& scene, const Scene::ShadowCastersState& caster_state, uint32_t layers = ALL_SHADOW_LAYERS) override
 		{
 			if (!shadowmap_settings.shader)
 			{
@@ -110,76 +416,174 @@ namespace engine::scene
 				return;
 			}
 
-			std::vector<glm::mat4> lightspace_matrices = compute_lightspace_matrices();
-			const unsigned int SHADOW_WIDTH = shadowmap_settings.resolution, SHADOW_HEIGHT = shadowmap_settings.resolution;
+			std::array<glm::mat4, 6> lightspace_matrices = compute_lightspace_matrices();
+
+			// Use the requested path if its shader is available, falling back towards the geometry shader one
+			CubeShadowPath path = shadowmap_settings.path;
+			if (path == CubeShadowPath::layered && !shadowmap_settings.layered_shader) path = CubeShadowPath::per_face;
+			if (path == CubeShadowPath::per_face && !shadowmap_settings.face_shader) path = CubeShadowPath::geometry_shader;
 
 			// Shadow pass
-			depthmap_framebuffer.bind();
+			caster_face_draws = 0;
+			static_cache.render(caster_state, depthmap_framebuffer, depthCubemap, shadowmap_settings.resolution, 6, shadow_signatures(lightspace_matrices), layers,
+				[&](Scene::ShadowCasters casters, GLuint target, uint32_t faces)
 			{
-				glClear(GL_DEPTH_BUFFER_BIT);
+				draw_instanced_casters(scene, casters, faces, lightspace_matrices);
+				if (path != CubeShadowPath::geometry_shader)
+				{
+					draw_culled_casters(scene, casters, target, faces, lightspace_matrices, path == CubeShadowPath::layered);
+					return;
+				}
 
 				shadowmap_settings.shader->bind();
 				{
 					// Geom shader uniform setting
-					for (int index = 0; index < lightspace_matrices.size(); index++)
-					{
-						shadowmap_settings.shader->setMat4("lightspace_matrices[" + std::to_string(index) + "]", lightspace_matrices[index]);
-					}
+					shadowmap_settings.shader->setMat4V("lightspace_matrices", gsl::narrow<int>(lightspace_matrices.size()), lightspace_matrices.data());
+					shadowmap_settings.shader->setInt("face_mask", gsl::narrow<int>(faces));
 
 					// Frag shader uniform setting
 					shadowmap_settings.shader->setVec3("lightPos", position);
 					shadowmap_settings.shader->setFloat("far_plane", shadowmap_settings.frustum_far);
 
 					// Draw the scene from point lights pov
-					bool cull_option = scene.use_frustum_culling;
-					scene.use_frustum_culling = false;
-					scene.draw_except_instanced(shadowmap_settings.shader);
-					scene.use_frustum_culling = cull_option; // restore previous culling option
+					scene.draw_shadow_casters(*shadowmap_settings.shader, casters);
+					caster_face_draws += std::popcount(faces) * scene.find_shadow_casters(casters).size();
 				}
 				shadowmap_settings.shader->unbind();
-			}
-			depthmap_framebuffer.unbind();
+			});
+			undefined_layers &= ~layers;
 		}
 	private:
 
+		// The cached static depth is valid as long as the light keeps its position and frustum (the same for every face)
+		StaticShadowCache::Signatures shadow_signatures(const std::array<glm::mat4, 6>& lightspace_matrices) const
+		{
+			uint32_t signature = utils::strings::hash_fnv1a(lightspace_matrices.data(), sizeof(lightspace_matrices));
+			signature = utils::strings::hash_fnv1a(&shadowmap_settings.frustum_far, sizeof(float), signature);
+
+			StaticShadowCache::Signatures signatures;
+			signatures.fill(signature);
+			return signatures;
+		}
+
+		// Draws the instanced casters within the light range into the requested faces, amplified by the geometry shader (one draw per shadow model)
+		void draw_instanced_casters(Scene& scene, Scene::ShadowCasters casters, uint32_t faces, const std::array<glm::mat4, 6>& lightspace_matrices)
+		{
+			if (!shadowmap_settings.instanced_shader) return;
+
+			Shader& shader = *shadowmap_settings.instanced_shader;
+			shader.bind();
+			shader.setMat4V("lightspace_matrices", gsl::narrow<int>(lightspace_matrices.size()), lightspace_matrices.data());
+			shader.setInt("face_mask", gsl::narrow<int>(faces));
+			shader.setVec3("lightPos", position);
+			shader.setFloat("far_plane", shadowmap_settings.frustum_far);
+			scene.draw_instanced_shadow_casters(scene.prepare_instanced_shadow_casters(casters, Scene::LightInfluence{ position, shadowmap_settings.frustum_far }));
+			shader.unbind();
+		}
+
+		// Draws each caster only into the requested cube faces whose frustum it overlaps, the far planes limiting them to the light range
+		// Layered draws instance the caster once per overlapped face, otherwise each face of the target cubemap is attached and drawn in turn
+		void draw_culled_casters(Scene& scene, Scene::ShadowCasters casters, GLuint target, uint32_t faces, const std::array<glm::mat4, 6>& lightspace_matrices, bool layered)
+		{
+			std::array<utils::math::Frustum, 6> face_frustums;
+			for (size_t face = 0; face < face_frustums.size(); face++) face_frustums[face] = utils::math::frustum_from_matrix(lightspace_matrices[face]);
+
+			// Faces overlapped by each caster
+			struct CasterFaces
+			{
+				const Entity* caster;
+				std::array<GLint, 6> faces;
+				int count;
+			};
+			std::vector<CasterFaces> visible_casters;
+			for (const Entity* caster : scene.find_shadow_casters(casters))
+			{
+				if (!caster->model) continue;
+
+				CasterFaces entry{ caster, {}, 0 };
+				for (GLint face = 0; face < 6; face++)
+				{
+					if ((faces & (1u << face)) && caster->bounding_volume->isOnFrustum(face_frustums[face], caster->world_transform()))
+						entry.faces[entry.count++] = face;
+				}
+				if (entry.count > 0) visible_casters.push_back(entry);
+			}
+
+			Shader& shader = layered ? *shadowmap_settings.layered_shader : *shadowmap_settings.face_shader;
+			shader.bind();
+			shader.setVec3("lightPos", position);
+			shader.setFloat("far_plane", shadowmap_settings.frustum_far);
+
+			if (layered)
+			{
+				shader.setMat4V("lightspace_matrices", gsl::narrow<int>(lightspace_matrices.size()), lightspace_matrices.data());
+				for (const CasterFaces& entry : visible_casters)
+				{
+					shader.setMat4("modelMatrix", entry.caster->world_transform().matrix());
+					shader.setIntV("faces", entry.count, entry.faces.data());
+					entry.caster->model->draw_instanced(entry.count);
+					caster_face_draws += entry.count;
+				}
+			}
+			else
+			{
+				for (GLint face = 0; face < 6; face++)
+				{
+					if (!(faces & (1u << face))) continue;
+
+					glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, target, 0);
+					shader.setMat4("lightspace_matrix", lightspace_matrices[face]);
+					for (const CasterFaces& entry : visible_casters)
+					{
+						if (std::find(entry.faces.begin(), entry.faces.begin() + entry.count, face) == entry.faces.begin() + entry.count) continue;
+
+						shader.setMat4("modelMatrix", entry.caster->world_transform().matrix());
+						entry.caster->model->draw();
+						caster_face_draws++;
+					}
+				}
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, 0); // attach the whole cubemap again
+			}
+			shader.unbind();
+		}
+
 		// Computes a lightspace matrix for each face of the cubemap given the shadowmap settings
-		std::vector<glm::mat4> compute_lightspace_matrices()
+		std::array<glm::mat4, 6> compute_lightspace_matrices()
 		{
 			const unsigned int SHADOW_WIDTH = shadowmap_settings.resolution, SHADOW_HEIGHT = shadowmap_settings.resolution;
 
 			// We calculate it by perspective since the point light is part of the scene 
 			// and has relative distance to its objects, unlike directional lights 
 			float aspect = (float)SHADOW_WIDTH/(float)SHADOW_HEIGHT;
-			float near = 1.0f;
-			float far = 25.0f;
+			float near = shadowmap_settings.frustum_near;
+			float far = shadowmap_settings.frustum_far;
 
 			// With a 90 fov we can ensure the viewing field fills the cube face and doesnt underflow or overflow
 			glm::mat4 shadowProj = glm::perspective(glm::radians(90.0f), aspect, near, far); 
 
 			// Create a lightspace matrix for each face
-			std::vector<glm::mat4> shadowTransforms;
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3( 1.0, 0.0, 0.0), glm::vec3(0.0,-1.0, 0.0)));
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0,-1.0, 0.0)));
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0)));
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3( 0.0,-1.0, 0.0), glm::vec3(0.0, 0.0,-1.0)));
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 0.0, 1.0), glm::vec3(0.0,-1.0, 0.0)));
-			shadowTransforms.push_back(shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 0.0,-1.0), glm::vec3(0.0,-1.0, 0.0)));
-
-			return shadowTransforms;
+			return {
+				shadowProj * glm::lookAt(position, position + glm::vec3( 1.0, 0.0, 0.0), glm::vec3(0.0,-1.0, 0.0)),
+				shadowProj * glm::lookAt(position, position + glm::vec3(-1.0, 0.0, 0.0), glm::vec3(0.0,-1.0, 0.0)),
+				shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 1.0, 0.0), glm::vec3(0.0, 0.0, 1.0)),
+				shadowProj * glm::lookAt(position, position + glm::vec3( 0.0,-1.0, 0.0), glm::vec3(0.0, 0.0,-1.0)),
+				shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 0.0, 1.0), glm::vec3(0.0,-1.0, 0.0)),
+				shadowProj * glm::lookAt(position, position + glm::vec3( 0.0, 0.0,-1.0), glm::vec3(0.0,-1.0, 0.0))
+			};
 		}
 
 		// Create a depth cubemap
 		void create_depth_cubemap(unsigned int resolution)
 		{
+			undefined_layers = ALL_SHADOW_LAYERS;
 			glBindTexture(GL_TEXTURE_CUBE_MAP, depthCubemap);
 
 			// Create a 2D texture for each face of the cubemap
 			for (unsigned int i = 0; i < 6; ++i)
-				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT, 
+				glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, shadow_internal_format(shadowmap_settings.format), 
 								 resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL); 
 
-			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+			set_shadow_compare(GL_TEXTURE_CUBE_MAP);
 			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 			glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);  
@@ -202,38 +606,119 @@ namespace engine::scene
 		struct ShadowMapSettings
 		{
 			Shader* shader = nullptr; 
+			Shader* instanced_shader = nullptr; // instanced casters of the scene (shadow_map_instanced.vert), none if not set
+			ShadowFormat format = ShadowFormat::depth32f;
 			unsigned int resolution = 1024;
-			float frustum_size = 50.f;
-			float frustum_near = 1.f; 
-			float frustum_far = 50.f;
-			float distance_bias = 20.f;
+			unsigned int cascades = 3;     // Slices of the camera frustum covered by their own shadowmap layer (up to MAX_SHADOW_CASCADES)
+			float shadow_distance = 60.f;  // View depth where the last cascade ends, farther fragments are unshadowed
+			float split_lambda = 0.75f;    // Blend between uniform (0) and logarithmic (1) splits of the shadow distance
+			float distance_bias = 20.f;    // Extra distance behind each cascade, so casters outside the camera frustum still cast into it
 		} shadowmap_settings;
 
 		// Dedicated framebuffer for computing the shadowmap
 		utils::graphics::opengl::BasicFramebuffer depthmap_framebuffer;
-		unsigned int depthmap;
-		glm::mat4 lightspace_matrix{1};
+		unsigned int depthmap; // 2D texture array, one layer per cascade
+		// Lightspace matrix and view depth where each cascade ends, as its layer was last rendered (uploaded to the shaders)
+		// A cascade skipped by the shadow scheduler keeps the ones matching its depth, so its shadows stay put until its update
+		std::array<glm::mat4, MAX_SHADOW_CASCADES> lightspace_matrices;
+		std::array<float, MAX_SHADOW_CASCADES> cascade_splits{};
+		StaticShadowCache static_cache{ GL_TEXTURE_2D_ARRAY };
 
 		// Light attributes
 		glm::vec3 direction; 
 
+		// Mirrors the DirectionalLight struct of the shaders (std140)
+		struct GPUData
+		{
+			glm::vec4 color;
+			glm::mat4 lightspace_matrices[MAX_SHADOW_CASCADES];
+			glm::vec4 cascade_splits;
+			glm::vec3 direction;
+			float     intensity;
+			int       cascade_count;
+			int       padding[3]{ 0, 0, 0 };
+		};
+
 		DirectionalLight(const glm::vec3& direction, const glm::vec4& color = { 1.0f, 1.0f, 1.0f, 1.0f }, float intensity = 1.0f, ShadowMapSettings shadowmap_settings = {}) :
 			Light{ color, intensity }, 
 			direction{ glm::normalize(direction) },
 			shadowmap_settings{ shadowmap_settings },
 			depthmap_framebuffer{ shadowmap_settings.resolution, shadowmap_settings.resolution }
 		{
+			this->shadowmap_settings.cascades = std::clamp(shadowmap_settings.cascades, 1u, unsigned(MAX_SHADOW_CASCADES));
+			lightspace_matrices.fill(glm::mat4{ 1 });
+			fitted_matrices.fill(glm::mat4{ 1 });
 			glGenTextures(1, &depthmap);
+			static_cache.set_format(shadowmap_settings.format);
 			create_depthmap(shadowmap_settings.resolution);
 		}
 
-		void setup(const Shader& shader, size_t index)
+		GPUData gpu_data() const
 		{
-			std::string prefix = "directionalLights[" + std::to_string(index) + "].";
-			lightspace_matrix = compute_lightspace_matrix();
-			setBaseLightAttributes(shader, prefix);
-			shader.setVec3(prefix + "direction", direction);
-			shader.setMat4(prefix + "lightspace_matrix", lightspace_matrix);
+			GPUData data{ color, {}, glm::vec4(cascade_splits[0], cascade_splits[1], cascade_splits[2], cascade_splits[3]), direction, intensity, 
+				gsl::narrow<int>(shadowmap_settings.cascades) };
+			std::copy(lightspace_matrices.begin(), lightspace_matrices.end(), data.lightspace_matrices);
+			return data;
+		}
+
+		// Fits each cascade to its slice of the camera frustum, used by the next shadow pass (the shaders get it once its layer is rendered)
+		// Every slice is enclosed in a bounding sphere, so the cascade size doesn't change as the camera rotates, 
+		// and its origin is snapped to whole shadow texels, so the shadow edges don't shimmer as the camera moves
+		void fit_cascades(Camera& camera)
+		{
+			const unsigned int cascades = shadowmap_settings.cascades;
+			const float near = camera.near_plane(), far = camera.far_plane();
+			const float shadow_far = std::clamp(shadowmap_settings.shadow_distance, near, far);
+
+			// Frustum corners in world space, near ones first
+			glm::mat4 inverse_view_projection = glm::inverse(camera.projectionMatrix() * camera.viewMatrix());
+			std::array<glm::vec3, 8> corners;
+			for (int i = 0; i < 8; i++)
+			{
+				glm::vec4 corner = inverse_view_projection * glm::vec4(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f, 1.f);
+				corners[i] = glm::vec3(corner) / corner.w;
+			}
+
+			glm::vec3 up = std::abs(direction.y) > 0.99f ? glm::vec3(0.f, 0.f, 1.f) : glm::vec3(0.f, 1.f, 0.f);
+			float slice_near = near;
+			for (unsigned int cascade = 0; cascade < cascades; cascade++)
+			{
+				// Practical split scheme, blending logarithmic and uniform splits
+				float ratio = float(cascade + 1) / cascades;
+				float log_split = near * std::pow(shadow_far / near, ratio);
+				float uniform_split = near + (shadow_far - near) * ratio;
+				float slice_far = shadowmap_settings.split_lambda * log_split + (1.f - shadowmap_settings.split_lambda) * uniform_split;
+
+				// Corners of the slice along the frustum edges, and their bounding sphere
+				std::array<glm::vec3, 8> slice;
+				for (int i = 0; i < 4; i++)
+				{
+					glm::vec3 edge = corners[i + 4] - corners[i];
+					slice[i]     = corners[i] + edge * ((slice_near - near) / (far - near));
+					slice[i + 4] = corners[i] + edge * ((slice_far  - near) / (far - near));
+				}
+				glm::vec3 center{ 0 };
+				for (const glm::vec3& corner : slice) center += corner / 8.f;
+				float radius = 0;
+				for (const glm::vec3& corner : slice) radius = std::max(radius, glm::length(corner - center));
+				radius = std::ceil(radius * 16.f) / 16.f;
+
+				float depth = 2.f * radius + shadowmap_settings.distance_bias;
+				glm::mat4 light_view = glm::lookAt(center - direction * (radius + shadowmap_settings.distance_bias), center, up);
+				glm::mat4 light_projection = glm::ortho(-radius, radius, -radius, radius, 0.f, depth);
+
+				// Snap the projected world origin to a whole texel
+				float half_resolution = shadowmap_settings.resolution * .5f;
+				glm::vec4 origin = light_projection * light_view * glm::vec4(0.f, 0.f, 0.f, 1.f);
+				glm::vec2 texel_origin = glm::vec2(origin) * half_resolution;
+				glm::vec2 offset = (glm::round(texel_origin) - texel_origin) / half_resolution;
+				light_projection[3][0] += offset.x;
+				light_projection[3][1] += offset.y;
+
+				fitted_matrices[cascade] = light_projection * light_view;
+				fitted_splits[cascade] = slice_far;
+				slice_near = slice_far;
+			}
 		}
 
 		void resize_shadowmap(unsigned int new_resolution)
@@ -246,65 +731,191 @@ namespace engine::scene
 			create_depthmap(new_resolution);
 		}
 
-		void compute_shadowmap(engine::scene::Scene& scene) override
+		void set_cascades(unsigned int new_cascades)
+		{
+			new_cascades = std::clamp(new_cascades, 1u, unsigned(MAX_SHADOW_CASCADES));
+			if (shadowmap_settings.cascades == new_cascades) return;
+
+			shadowmap_settings.cascades = new_cascades;
+			create_depthmap(shadowmap_settings.resolution);
+		}
+
+		void set_shadow_format(ShadowFormat new_format)
+		{
+			if (shadowmap_settings.format == new_format) return;
+
+			shadowmap_settings.format = new_format;
+			static_cache.set_format(new_format);
+			create_depthmap(shadowmap_settings.resolution);
+		}
+
+		uint32_t outdated_shadow_layers(const Scene::ShadowCastersState& casters) override
+		{
+			return static_cache.outdated_layers(casters, shadow_signatures(), shadowmap_settings.resolution, shadowmap_settings.cascades);
+		}
+
+		size_t shadow_layer_texels() const override
+		{
+			return size_t(shadowmap_settings.resolution) * shadowmap_settings.resolution;
+		}
+
+		size_t shadow_memory() const override
+		{
+			return shadow_layer_texels() * shadowmap_settings.cascades * shadow_texel_bytes(shadowmap_settings.format) + static_cache.memory();
+		}
+
+		// Higher when the cascades moved (their shadows are wrong, not just late) or dynamic casters are around
+		float shadow_priority(engine::scene::Scene& scene, const Scene::ShadowCastersState& casters) override
+		{
+			float priority = 1.f;
+			if (static_cache.is_stale(casters, shadow_signatures(), shadowmap_settings.cascades)) priority *= 4.f;
+			if (casters.dynamic) priority *= 2.f;
+			return priority;
+		}
+
+		void compute_shadowmap(engine::scene::Scene& scene, const Scene::ShadowCastersState& caster_state, uint32_t layers = ALL_SHADOW_LAYERS) override
 		{
 			if (!shadowmap_settings.shader)
 			{
 				utils::io::warn("DIR LIGHT - Shader for shadow map computation not set!");
 				return;
 			}
-			
+
 			// Shadow pass
-			depthmap_framebuffer.bind();
+			static_cache.render(caster_state, depthmap_framebuffer, depthmap, shadowmap_settings.resolution, shadowmap_settings.cascades, shadow_signatures(), layers,
+				[&](Scene::ShadowCasters casters, GLuint target, uint32_t cascades)
 			{
-				glClear(GL_DEPTH_BUFFER_BIT);
+				draw_cascades(scene, casters, target, cascades);
+			});
 
-				shadowmap_settings.shader->bind();
+			// The requested cascades now hold the depth of the fitted ones (either drawn or already matching them)
+			for (unsigned int cascade = 0; cascade < shadowmap_settings.cascades; cascade++)
+			{
+				if (!(layers & (1u << cascade))) continue;
+				lightspace_matrices[cascade] = fitted_matrices[cascade];
+				cascade_splits[cascade] = fitted_splits[cascade];
+			}
+			undefined_layers &= ~layers;
+		}
+
+	private:
+		// Cascades fitted to the camera in the current frame, committed to lightspace_matrices and cascade_splits when their layer is rendered
+		std::array<glm::mat4, MAX_SHADOW_CASCADES> fitted_matrices;
+		std::array<float, MAX_SHADOW_CASCADES> fitted_splits{};
+
+		// Draws the casters overlapping each requested cascade into its layer of the target
+		void draw_cascades(Scene& scene, Scene::ShadowCasters casters, GLuint target, uint32_t cascades)
+		{
+			std::vector<Entity*> candidates = scene.find_shadow_casters(casters);
+
+			// Instanced casters are selected and streamed once, then drawn into every cascade changing just the matrix
+			Scene::InstancedShadowBatch instanced_casters;
+			if (shadowmap_settings.instanced_shader) instanced_casters = scene.prepare_instanced_shadow_casters(casters);
+
+			// Casters between the light and a cascade are clamped onto its near plane rather than clipped
+			glEnable(GL_DEPTH_CLAMP);
+			shadowmap_settings.shader->bind();
+			for (unsigned int cascade = 0; cascade < shadowmap_settings.cascades; cascade++)
+			{
+				if (!(cascades & (1u << cascade))) continue;
+
+				utils::math::Frustum frustum = utils::math::frustum_from_matrix(fitted_matrices[cascade]);
+				frustum.nearFace.distance = -std::numeric_limits<float>::infinity(); // as they are clamped, casters behind the light still count
+
+				glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, 0, cascade);
+				shadowmap_settings.shader->setMat4("lightSpaceMatrix", fitted_matrices[cascade]);
+				for (const Entity* caster : candidates)
 				{
-					shadowmap_settings.shader->setMat4("lightSpaceMatrix", lightspace_matrix);
+					if (!caster->model || !caster->bounding_volume->isOnFrustum(frustum, caster->world_transform())) continue;
 
-					// Draw the scene from point lights pov
-					bool cull_option = scene.use_frustum_culling;
-					scene.use_frustum_culling = false;
-					scene.draw_except_instanced(shadowmap_settings.shader);
-					scene.use_frustum_culling = cull_option; // restore previous culling option
+					shadowmap_settings.shader->setMat4("modelMatrix", caster->world_transform().matrix());
+					caster->model->draw();
+				}
+
+				if (!instanced_casters.draws.empty())
+				{
+					shadowmap_settings.instanced_shader->bind();
+					shadowmap_settings.instanced_shader->setMat4("lightSpaceMatrix", fitted_matrices[cascade]);
+					scene.draw_instanced_shadow_casters(instanced_casters);
+					shadowmap_settings.shader->bind();
 				}
-				shadowmap_settings.shader->unbind();
 			}
-			depthmap_framebuffer.unbind();
+			shadowmap_settings.shader->unbind();
+			glDisable(GL_DEPTH_CLAMP);
+
+			glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, target, 0); // attach every cascade again
+		}
+
+		// The cached static depth of a cascade is valid as long as its fitted lightspace matrix doesn't change
+		StaticShadowCache::Signatures shadow_signatures() const
+		{
+			StaticShadowCache::Signatures signatures{};
+			for (unsigned int cascade = 0; cascade < shadowmap_settings.cascades; cascade++)
+				signatures[cascade] = utils::strings::hash_fnv1a(&fitted_matrices[cascade], sizeof(glm::mat4));
+			return signatures;
 		}
 
-	private:
 		void create_depthmap(unsigned int resolution)
 		{
-			glBindTexture(GL_TEXTURE_2D, depthmap);
+			undefined_layers = (1u << shadowmap_settings.cascades) - 1;
+			glBindTexture(GL_TEXTURE_2D_ARRAY, depthmap);
 
-			// Create a 2D texture depth tex
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT,
-					resolution, resolution, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+			// Create a 2D texture array depth tex, one layer per cascade
+			glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, shadow_internal_format(shadowmap_settings.format),
+					resolution, resolution, shadowmap_settings.cascades, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			set_shadow_compare(GL_TEXTURE_2D_ARRAY);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-			// Attach the whole cubemap as depth attachment to the framebuffer as we'll do a geom shader trick to render all faces at once
+			// Attach the whole array as depth attachment, the shadow pass selects one cascade at a time
 			depthmap_framebuffer.bind();
 			{
-				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthmap, 0);
+				glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthmap, 0);
 				glDrawBuffer(GL_NONE); // NO COLOR ATTACHMENT NEEDED
 				glReadBuffer(GL_NONE);
 			}
 			depthmap_framebuffer.unbind();
 		}
+	};
+
+	// Class representing a point light source without shadows, shaded through the light clusters (see LightClusters)
+	// so any number of them can light the scene, each fragment paying only for the ones reaching it
+	class ClusteredLight : public Light
+	{
+	public:
+		static constexpr float CUTOFF = 1.f / 64.f; // Contribution below which the light is considered out of reach (the shaders fade it out before)
+
+		glm::vec3 position;
+
+		// Attenuation values 
+		float attenuation_constant    = 1.0f;
+		float attenuation_linear      = 0.7f;
+		float attenuation_quadratic   = 1.8f;
+
+		// Mirrors the ClusteredLight struct of the shaders (std430)
+		struct GPUData
+		{
+			glm::vec4 color;
+			glm::vec3 position;
+			float     intensity;
+			glm::vec3 attenuation;
+			float     radius;
+		};
+
+		ClusteredLight(const glm::vec3& position, const glm::vec4& color = { 1.0f, 1.0f, 1.0f, 1.0f }, const float intensity = 1.0f) :
+			Light{ color, intensity }, 
+			position{ position } {}
+
+		// Distance where the light falls below the cutoff
+		float radius() const
+		{
+			return attenuation_radius(CUTOFF, attenuation_constant, attenuation_linear, attenuation_quadratic);
+		}
 
-		// Computes a lightspace matrix given the shadowmap settings
-		glm::mat4 compute_lightspace_matrix()
+		GPUData gpu_data() const
 		{
-			float frustum_size = shadowmap_settings.frustum_size;
-			glm::mat4 lightProjection = glm::ortho(-frustum_size, frustum_size, -frustum_size, frustum_size, shadowmap_settings.frustum_near, shadowmap_settings.frustum_far);
-			glm::mat4 lightView = glm::lookAt(-direction * shadowmap_settings.distance_bias, glm::vec3(0.f), glm::vec3(0.0f, 1.0f, 0.0f));
-			return lightProjection * lightView;
+			return { color, position, intensity, { attenuation_constant, attenuation_linear, attenuation_quadratic }, radius() };
 		}
 	};
 
@@ -316,17 +927,44 @@ namespace engine::scene
 		glm::vec3 direction;
 		float cutoffAngle;
 
+		// Mirrors the SpotLight struct of the shaders (std140)
+		struct GPUData
+		{
+			glm::vec4 color;
+			glm::vec3 position;
+			float     intensity;
+			glm::vec3 direction;
+			float     cutoffAngle;
+		};
+
 		SpotLight(const glm::vec3& position, const glm::vec3& direction, float cutoffAngle, const glm::vec4& color = { 1.0f, 1.0f, 1.0f, 1.0f }, const float intensity = 1.0f ) :
 			Light{ color, intensity }, 
 			position{ position }, direction{ direction }, cutoffAngle{ cutoffAngle } {}
 
-		void setup(const Shader& shader, size_t index)
+		GPUData gpu_data() const
+		{
+			return { color, position, intensity, direction, cutoffAngle };
+		}
+	};
+
+	static_assert(sizeof(PointLight::GPUData) == 48 && sizeof(DirectionalLight::GPUData) == 320 && sizeof(SpotLight::GPUData) == 48 && sizeof(ClusteredLight::GPUData) == 48, 
+		"Light GPU data must match the std140 (std430 for clustered lights) layout of the shader structs");
+
+	// Mirrors the std140 Lights uniform block shared by the lit shaders
+	struct LightsData
+	{
+		PointLight::GPUData       point_lights      [MAX_POINT_LIGHTS]{};
+		DirectionalLight::GPUData directional_lights[MAX_DIR_LIGHTS]{};
+		SpotLight::GPUData        spot_lights       [MAX_SPOT_LIGHTS]{};
+
+		unsigned int n_point_lights{ 0 }, n_dir_lights{ 0 }, n_spot_lights{ 0 }, padding{ 0 };
+
+		// Gathers the data of the given lights (the ones exceeding the shader arrays are ignored)
+		LightsData(const std::vector<PointLight*>& points = {}, const std::vector<DirectionalLight*>& directionals = {}, const std::vector<SpotLight*>& spots = {})
 		{
-			std::string prefix = "spotLights[" + std::to_string(index) + "].";
-			setBaseLightAttributes(shader, prefix);
-			shader.setVec3 (prefix + "position", position);
-			shader.setVec3 (prefix + "direction", direction);
-			shader.setFloat(prefix + "cutoffAngle", cutoffAngle);
+			for (auto light : points)       if (n_point_lights < MAX_POINT_LIGHTS) point_lights      [n_point_lights++] = light->gpu_data();
+			for (auto light : directionals) if (n_dir_lights   < MAX_DIR_LIGHTS)   directional_lights[n_dir_lights++]   = light->gpu_data();
+			for (auto light : spots)        if (n_spot_lights  < MAX_SPOT_LIGHTS)  spot_lights       [n_spot_lights++]  = light->gpu_data();
 		}
 	};
 }
\ No newline at end of file
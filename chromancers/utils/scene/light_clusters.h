@@ -0,0 +1,80 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <glad.h>
+#include <gsl/gsl>
+
+#include "../oop.h"
+#include "../shader.h"
+#include "../ring_buffer.h"
+
+#include "light.h"
+
+// Mirror the clustered lighting constants of constants.glsl
+#define CLUSTER_GRID_X 16
+#define CLUSTER_GRID_Y 9
+#define CLUSTER_GRID_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 32
+#define CLUSTERED_LIGHTS_BINDING 10 // SSBO binding of the clustered lights
+#define CLUSTER_LIGHTS_BINDING   11 // SSBO binding of the lights reaching each cluster
+
+namespace engine::scene
+{
+	// Clustered forward lighting: the view frustum is split in a grid of clusters (screen tiles times exponential depth slices)
+	// and each frame a compute pass (see light_cluster.comp) assigns the clustered lights to the clusters their sphere reaches,
+	// so the lit shaders only shade the lights of the cluster of each fragment, up to MAX_LIGHTS_PER_CLUSTER of them
+	// The lights are streamed every frame through a ring buffer, since they are expected to move (e.g. paint glows)
+	class LightClusters : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		using Shader = engine::resources::Shader;
+		using PersistentRingBuffer = utils::graphics::opengl::PersistentRingBuffer;
+
+	public:
+		static constexpr size_t CLUSTER_COUNT = CLUSTER_GRID_X * CLUSTER_GRID_Y * CLUSTER_GRID_Z;
+
+		bool enabled{ true }; // When disabled, no cluster is reached by any light
+
+		// The assignment shader must be compiled with the utils shaders, since it reads the FrameData block
+		LightClusters(Shader& assign_shader) : assign_shader{ &assign_shader }
+		{
+			glCreateBuffers(1, &clusters_buffer);
+			glNamedBufferStorage(clusters_buffer, CLUSTER_COUNT * (MAX_LIGHTS_PER_CLUSTER + 1) * sizeof(GLuint), nullptr, 0);
+		}
+
+		~LightClusters()
+		{
+			glDeleteBuffers(1, &clusters_buffer);
+		}
+
+		// Uploads the lights and assigns them to the clusters of the camera in the FrameData block, 
+		// leaving both buffers bound for the lit shaders drawing this frame
+		void update(const std::vector<ClusteredLight*>& lights)
+		{
+			size_t count = enabled ? lights.size() : 0;
+			auto allocation = ring.allocate(std::max<size_t>(count, 1) * sizeof(ClusteredLight::GPUData));
+			ClusteredLight::GPUData* data = static_cast<ClusteredLight::GPUData*>(allocation.data);
+			for (size_t i = 0; i < count; i++) data[i] = lights[i]->gpu_data();
+
+			ring.bind_range(CLUSTERED_LIGHTS_BINDING, allocation, count * sizeof(ClusteredLight::GPUData));
+			glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHTS_BINDING, clusters_buffer);
+
+			assign_shader->bind();
+			assign_shader->setUint("light_count", gsl::narrow<unsigned int>(count));
+			glDispatchCompute(gsl::narrow<GLuint>((CLUSTER_COUNT + 63) / 64), 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+			assign_shader->unbind();
+
+			_light_count = count;
+		}
+
+		size_t light_count() const { return _light_count; }
+
+	private:
+		Shader* assign_shader;
+		GLuint clusters_buffer{ 0 };
+		PersistentRingBuffer ring{ GL_SHADER_STORAGE_BUFFER, 1 << 14 };
+		size_t _light_count{ 0 };
+	};
+}
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <future>
+#include <fstream>
+#include <filesystem>
+#include <chrono>
+#include <cstring>
+
+#include <glad.h>
+#include <glm/glm.hpp>
+
+#include "../oop.h"
+#include "../io.h"
+#include "../utils.h"
+#include "../components/paintable_component.h"
+
+#include "scene.h"
+#include "entity.h"
+
+namespace engine::scene
+{
+	// Class that saves and restores the paintmaps of a scene to/from a compact file without stalling the rendering loop:
+	// saving reads the paintmaps back through PBOs, then compresses and writes them on a worker thread,
+	// loading reads and decompresses on a worker thread, then streams the uploads over the following frames (one paintmap per frame)
+	class PaintPersistence : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		using PaintableComponent = engine::components::PaintableComponent;
+		using PaintPalette       = engine::resources::PaintPalette;
+
+		constexpr static uint32_t FILE_MAGIC   = 0x4D504843; // "CHPM" (little endian)
+		constexpr static uint32_t FILE_VERSION = 1;
+
+		// A paintmap as stored in the file, identified by the display name of its entity
+		struct Entry
+		{
+			std::string key;
+			uint32_t width{ 0 }, height{ 0 }, format{ 0 };
+			std::vector<uint8_t> data; // rle compressed texels in the file and in the cache, raw texels when waiting to be uploaded
+		};
+
+		using EntryMap = std::unordered_map<std::string, Entry>;
+
+		// Whole content of a paint file
+		struct PaintFile
+		{
+			std::vector<glm::vec4> palette;
+			EntryMap entries;
+		};
+
+		// Result of a load operation
+		struct LoadResult
+		{
+			PaintFile compressed;
+			std::vector<Entry> decompressed;
+		};
+
+		// Paintmap whose readback is in flight
+		struct Readback
+		{
+			std::string key;
+			PaintableComponent* paintable;
+			GLuint pbo;
+		};
+
+		Scene* scene;
+		std::string file_path;
+
+		std::vector<Readback> readbacks;
+		GLsync readback_fence{ nullptr };
+
+		EntryMap saved_entries; // Compressed entries of the last save/load, reused for paintmaps not modified since then
+
+		std::future<EntryMap>   save_task;
+		std::future<LoadResult> load_task;
+		std::vector<Entry> pending_uploads;
+
+	public:
+		PaintPersistence(Scene& scene, std::string file_path) : scene{ &scene }, file_path{ std::move(file_path) } {}
+
+		~PaintPersistence()
+		{
+			flush();
+		}
+
+		// Whether a save or a load is still in progress
+		bool busy() const
+		{
+			return readback_fence || save_task.valid() || load_task.valid() || !pending_uploads.empty();
+		}
+
+		// Starts saving the paintmaps of the scene, only paintmaps modified since the last save/load are read back
+		void save()
+		{
+			if (busy()) { utils::io::warn("PAINT PERSISTENCE - Operation already in progress, save ignored"); return; }
+
+			for (PaintableComponent* paintable : scene->find_components<PaintableComponent>())
+			{
+				const std::string& key = paintable->parent()->display_name;
+				if (!paintable->is_modified() && saved_entries.contains(key)) continue;
+
+				GLuint pbo;
+				glGenBuffers(1, &pbo);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+				glBufferData(GL_PIXEL_PACK_BUFFER, paintable->size_bytes(), nullptr, GL_STREAM_READ);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+				paintable->read_paintmap(pbo);
+				paintable->clear_modified(); // later paints will be caught by the next save
+				readbacks.push_back({ key, paintable, pbo });
+			}
+
+			readback_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glFlush(); // make sure the fence gets to the gpu, so it will be eventually signaled
+		}
+
+		// Starts loading the paintmaps of the scene from the paint file (if it exists)
+		void load()
+		{
+			if (busy()) { utils::io::warn("PAINT PERSISTENCE - Operation already in progress, load ignored"); return; }
+			if (!std::filesystem::exists(file_path)) { utils::io::info("PAINT PERSISTENCE - No paint file found at ", file_path); return; }
+
+			load_task = std::async(std::launch::async, [path = file_path]()
+				{
+					LoadResult result;
+					result.compressed = read_file(path);
+
+					for (const auto& [key, entry] : result.compressed.entries)
+					{
+						Entry raw{ key, entry.width, entry.height, entry.format };
+						raw.data.resize(size_t(entry.width) * entry.height * engine::resources::PaintAtlas::bytes_per_texel(engine::resources::PaintmapFormat(entry.format)));
+
+						if (utils::compression::rle_decode(entry.data.data(), entry.data.size(), raw.data.data(), raw.data.size()))
+							result.decompressed.push_back(std::move(raw));
+						else
+							utils::io::error("PAINT PERSISTENCE - Corrupted paintmap data for ", key);
+					}
+					return result;
+				});
+		}
+
+		// Advances the pending operations without blocking, to be called once per frame
+		void update()
+		{
+			if (readback_fence)
+			{
+				GLenum status = glClientWaitSync(readback_fence, 0, 0);
+				if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED)
+					finish_readback();
+			}
+
+			if (is_ready(save_task)) finish_save();
+			if (is_ready(load_task)) finish_load();
+
+			if (!pending_uploads.empty()) upload_next();
+		}
+
+		// Completes every pending operation, blocking until done
+		void flush()
+		{
+			if (readback_fence)
+			{
+				glClientWaitSync(readback_fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+				finish_readback();
+			}
+
+			if (save_task.valid()) finish_save();
+			if (load_task.valid()) finish_load();
+
+			while (!pending_uploads.empty()) upload_next();
+		}
+
+	private:
+		template <typename T>
+		static bool is_ready(const std::future<T>& task)
+		{
+			return task.valid() && task.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+		}
+
+		// Gathers the read back texels and hands them to a worker thread which will compress and write them along the unmodified ones
+		void finish_readback()
+		{
+			std::vector<Entry> raw_entries;
+			for (Readback& readback : readbacks)
+			{
+				Entry raw{ readback.key, readback.paintable->width(), readback.paintable->height(), static_cast<uint32_t>(readback.paintable->format()) };
+				raw.data.resize(readback.paintable->size_bytes());
+
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+				const void* texels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, raw.data.size(), GL_MAP_READ_BIT);
+				if (texels) std::memcpy(raw.data.data(), texels, raw.data.size());
+				glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+				glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+				glDeleteBuffers(1, &readback.pbo);
+
+				raw_entries.push_back(std::move(raw));
+			}
+			readbacks.clear();
+
+			glDeleteSync(readback_fence);
+			readback_fence = nullptr;
+
+			// Only the entries of the paintables currently in the scene end up in the file
+			EntryMap entries;
+			for (PaintableComponent* paintable : scene->find_components<PaintableComponent>())
+			{
+				const std::string& key = paintable->parent()->display_name;
+				auto it = saved_entries.find(key);
+				if (it != saved_entries.end()) entries.insert(*it); // overwritten below if it was read back
+			}
+
+			save_task = std::async(std::launch::async,
+				[path = file_path, palette = PaintPalette::get_colors(), raw_entries = std::move(raw_entries), entries = std::move(entries)]() mutable
+				{
+					for (const Entry& raw : raw_entries)
+					{
+						Entry compressed{ raw.key, raw.width, raw.height, raw.format, utils::compression::rle_encode(raw.data.data(), raw.data.size()) };
+						entries.insert_or_assign(raw.key, std::move(compressed));
+					}
+
+					write_file(path, palette, entries);
+					return std::move(entries);
+				});
+		}
+
+		void finish_save()
+		{
+			saved_entries = save_task.get();
+			utils::io::info("PAINT PERSISTENCE - Saved ", saved_entries.size(), " paintmaps to ", file_path);
+		}
+
+		void finish_load()
+		{
+			LoadResult result = load_task.get();
+
+			// Palette-indexed paintmaps refer to the palette they were painted with
+			if (!result.compressed.palette.empty()) PaintPalette::set_colors(result.compressed.palette);
+
+			saved_entries   = std::move(result.compressed.entries);
+			pending_uploads = std::move(result.decompressed);
+		}
+
+		// Uploads a single loaded paintmap through a pixel unpack buffer, so the texture update doesn't wait on the gpu
+		void upload_next()
+		{
+			Entry entry = std::move(pending_uploads.back());
+			pending_uploads.pop_back();
+
+			for (PaintableComponent* paintable : scene->find_components<PaintableComponent>())
+			{
+				if (paintable->parent()->display_name != entry.key) continue;
+
+				if (paintable->width() != entry.width || paintable->height() != entry.height || static_cast<uint32_t>(paintable->format()) != entry.format)
+				{
+					utils::io::warn("PAINT PERSISTENCE - Saved paintmap for ", entry.key, " doesn't match the current paintmap size or format, skipped");
+					saved_entries.erase(entry.key);
+					return;
+				}
+
+				GLuint pbo;
+				glGenBuffers(1, &pbo);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, entry.data.size(), entry.data.data(), GL_STREAM_DRAW);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				paintable->write_paintmap(pbo);
+				paintable->clear_modified();
+
+				glDeleteBuffers(1, &pbo); // the deletion is deferred by the driver until the upload is done
+				return;
+			}
+
+			utils::io::warn("PAINT PERSISTENCE - No paintable entity named ", entry.key, " in the scene, skipped");
+		}
+
+#pragma region file_io
+		template <typename T>
+		static void write_value(std::ofstream& out, const T& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+		template <typename T>
+		static bool read_value(std::ifstream& in, T& value) { return bool(in.read(reinterpret_cast<char*>(&value), sizeof(T))); }
+
+		// File layout: magic, version, palette size, palette colors, entries amount,
+		// then for each entry: key length, key, width, height, format, compressed size, compressed data
+		static void write_file(const std::string& path, const std::vector<glm::vec4>& palette, const EntryMap& entries)
+		{
+			std::filesystem::path final_path{ path }, temp_path{ path + ".tmp" };
+			if (final_path.has_parent_path()) std::filesystem::create_directories(final_path.parent_path());
+
+			{
+				std::ofstream out{ temp_path, std::ios::binary | std::ios::trunc };
+				if (!out) { utils::io::error("PAINT PERSISTENCE - Could not write paint file ", path); return; }
+
+				write_value(out, FILE_MAGIC);
+				write_value(out, FILE_VERSION);
+
+				write_value(out, static_cast<uint32_t>(palette.size()));
+				for (const glm::vec4& color : palette) write_value(out, color);
+
+				write_value(out, static_cast<uint32_t>(entries.size()));
+				for (const auto& [key, entry] : entries)
+				{
+					write_value(out, static_cast<uint32_t>(key.size()));
+					out.write(key.data(), key.size());
+					write_value(out, entry.width);
+					write_value(out, entry.height);
+					write_value(out, entry.format);
+					write_value(out, static_cast<uint32_t>(entry.data.size()));
+					out.write(reinterpret_cast<const char*>(entry.data.data()), entry.data.size());
+				}
+			}
+
+			// Replace the previous file only once the new one is complete
+			std::error_code ec;
+			std::filesystem::rename(temp_path, final_path, ec);
+			if (ec) utils::io::error("PAINT PERSISTENCE - Could not replace paint file ", path, " (", ec.message(), ")");
+		}
+
+		static PaintFile read_file(const std::string& path)
+		{
+			PaintFile file;
+			std::ifstream in{ path, std::ios::binary | std::ios::ate };
+			const std::streamoff file_size = in ? static_cast<std::streamoff>(in.tellg()) : 0;
+			in.seekg(0);
+			// Sizes read from the file are only trusted if that many bytes are actually left
+			auto fits = [&](uint64_t bytes) { return in && bytes <= static_cast<uint64_t>(file_size - static_cast<std::streamoff>(in.tellg())); };
+
+			uint32_t magic, version, palette_size, entries_amount;
+			if (!read_value(in, magic) || !read_value(in, version) || magic != FILE_MAGIC || version != FILE_VERSION)
+			{
+				utils::io::error("PAINT PERSISTENCE - ", path, " is not a valid paint file");
+				return file;
+			}
+
+			if (!read_value(in, palette_size) || palette_size > MAX_PAINT_PALETTE_COLORS) return file;
+			file.palette.resize(palette_size);
+			for (glm::vec4& color : file.palette)
+			{
+				if (!read_value(in, color))
+				{
+					utils::io::error("PAINT PERSISTENCE - ", path, " is corrupt, nothing was loaded");
+					return PaintFile{};
+				}
+			}
+
+			if (!read_value(in, entries_amount)) return file;
+			for (uint32_t i = 0; i < entries_amount; ++i)
+			{
+				Entry entry;
+				uint32_t key_size, data_size;
+				if (!read_value(in, key_size) || !fits(key_size)) break;
+				entry.key.resize(key_size);
+				if (!in.read(entry.key.data(), key_size)) break;
+
+				if (!read_value(in, entry.width) || !read_value(in, entry.height) || !read_value(in, entry.format) || !read_value(in, data_size) || !fits(data_size)) break;
+				entry.data.resize(data_size);
+				if (!in.read(reinterpret_cast<char*>(entry.data.data()), data_size)) break;
+
+				file.entries.insert_or_assign(entry.key, std::move(entry));
+			}
+
+			if (file.entries.size() != entries_amount) utils::io::warn("PAINT PERSISTENCE - ", path, " is truncated or corrupt, some paintmaps were not loaded");
+			return file;
+		}
+#pragma endregion file_io
+	};
+}
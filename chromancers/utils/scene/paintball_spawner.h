@@ -42,16 +42,23 @@ namespace engine::scene
 		float fire_cooldown_timer { 1.f / rounds_per_second }; // Inner variable for the amount of time left before the next paintball is generated and shot
 		unsigned int amount_to_spawn{ 1 }; // The amount of paintballs to spawn in a step (useful for when we the fire_cooldown_timer is smaller than the delta time, avoiding framerate ties to the application)
 
+		// Id of the instanced group of this spawner's paintballs, created using this spawner's address (or any other unique value) 
+		// so that all paintballs generated by this spawner belong in the same instanced group in the scene
+		// This ensures they all use the same shared material
+		std::string group_instance_id;
+
 	public:
 		PaintballSpawner(PhysicsEngine<Entity>& physics_engine, utils::random::generator& rng, Shader& paintball_shader) :
 			physics_engine{physics_engine},
 			rng{rng},
-			paintball_material{paintball_shader}
+			paintball_material{paintball_shader},
+			group_instance_id{ "paintballs" + std::to_string((unsigned long long)(void**)this) }
 		{}
 
 		void update(float delta_time)
 		{
 			// We update the material values in case they were changed by UI or other external entities
+			// (the material buffer is uploaded again only if the color actually changed)
 			paintball_material.diffuse_color = paint_color; 
 			paintball_material.ambient_color = paint_color;
 
@@ -81,11 +88,6 @@ namespace engine::scene
 
 		void shoot_pb(glm::vec3 spawn_position, glm::vec3 spawn_orientation, glm::vec3 shoot_direction)
 		{
-			// Create a group_id using this spawner's address(or any other unique value) 
-			// so that all paintballs generated by this spawner belong in the same instanced group in the scene
-			// This ensures they all use the same shared material
-			std::string this_spawner_address = std::to_string((unsigned long long)(void**)this);
-			std::string group_instance_id = "paintballs" + this_spawner_address;
 			Entity* paintball = current_scene->emplace_instanced_entity(group_instance_id, "paintball", "This is a paintball", *paintball_model, paintball_material);
 
 			// Setting paintball entity transform
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include <glad.h>
+#include <gsl/gsl>
+#include <glm/glm.hpp>
+
+#include "../oop.h"
+
+#include "entity.h"
+
+namespace engine::scene
+{
+	// Transforms of the instances of a group kept in a GPU buffer across frames, read by the culling pass (see GPUInstanceCuller)
+	// An instance takes a slot when it is added and gives it back when it is removed (the last slot is moved into it),
+	// in between its transform is written again only while it moves, so the instances at rest cost nothing to the CPU
+	class ResidentInstances : utils::oop::non_copyable, utils::oop::non_movable
+	{
+	public:
+		static constexpr size_t INSTANCE_SIZE = 3 * sizeof(glm::vec4); // rows of the affine part of the transform
+
+		ResidentInstances() = default;
+
+		~ResidentInstances()
+		{
+			if (buffer) glDeleteBuffers(1, &buffer);
+		}
+
+		void add(const Entity& entity)
+		{
+			if (slots.contains(&entity)) return;
+
+			slots[&entity] = instances.size();
+			instances.push_back(&entity);
+			transforms.resize(instances.size() * 3);
+			dirty.push_back(true); // read by the next update, once the spawner has placed it
+		}
+
+		void remove(const Entity& entity)
+		{
+			auto found = slots.find(&entity);
+			if (found == slots.end()) return;
+
+			// The last instance takes the slot left free
+			size_t slot = found->second, last = instances.size() - 1;
+			slots.erase(found);
+			if (slot != last)
+			{
+				instances[slot] = instances[last];
+				slots[instances[slot]] = slot;
+				std::copy_n(transforms.begin() + last * 3, 3, transforms.begin() + slot * 3);
+				dirty[slot] = dirty[last];
+				mark(slot);
+			}
+			instances.pop_back();
+			transforms.resize(instances.size() * 3);
+			dirty.pop_back();
+		}
+
+		// Writes the transforms of the new, moved and moving instances into the buffer, in a single upload of the range they span
+		void update()
+		{
+			for (size_t slot = 0; slot < instances.size(); slot++)
+			{
+				if (!instances[slot]->is_moving() && !dirty[slot]) continue;
+
+				const glm::mat4& transform = instances[slot]->world_transform().matrix();
+				for (int row = 0; row < 3; row++)
+					transforms[slot * 3 + row] = { transform[0][row], transform[1][row], transform[2][row], transform[3][row] };
+				mark(slot);
+				dirty[slot] = false;
+			}
+
+			if (instances.size() > capacity)
+			{
+				// Recreated bigger, with every transform
+				if (buffer) glDeleteBuffers(1, &buffer);
+				capacity = std::max(instances.size(), capacity * 2);
+				glCreateBuffers(1, &buffer);
+				glNamedBufferStorage(buffer, gsl::narrow<GLsizeiptr>(capacity * INSTANCE_SIZE), nullptr, GL_DYNAMIC_STORAGE_BIT);
+				dirty_begin = 0; dirty_end = instances.size();
+			}
+
+			dirty_end = std::min(dirty_end, instances.size());
+			if (dirty_begin < dirty_end)
+			{
+				glNamedBufferSubData(buffer, gsl::narrow<GLintptr>(dirty_begin * INSTANCE_SIZE), gsl::narrow<GLsizeiptr>((dirty_end - dirty_begin) * INSTANCE_SIZE),
+					transforms.data() + dirty_begin * 3);
+			}
+			_uploaded = dirty_end > dirty_begin ? dirty_end - dirty_begin : 0;
+			dirty_begin = SIZE_MAX; dirty_end = 0;
+		}
+
+		GLuint id() const { return buffer; }
+		size_t size() const { return instances.size(); }
+
+		// Instances written by the last update (including the unchanged ones between the first and last written)
+		size_t uploaded() const { return _uploaded; }
+
+	private:
+		GLuint buffer{ 0 };
+		size_t capacity{ 0 }; // in instances
+
+		std::vector<const Entity*> instances;                   // of each slot
+		std::unordered_map<const Entity*, size_t> slots;        // of each instance
+		std::vector<glm::vec4> transforms;                      // copy of the buffer, 3 rows per slot
+		std::vector<bool> dirty;                                // slots whose transform has to be read again from their instance
+		size_t dirty_begin{ SIZE_MAX }, dirty_end{ 0 };         // range of slots to upload
+		size_t _uploaded{ 0 };
+
+		void mark(size_t slot)
+		{
+			dirty_begin = std::min(dirty_begin, slot);
+			dirty_end = std::max(dirty_end, slot + 1);
+		}
+	};
+}
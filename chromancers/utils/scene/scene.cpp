@@ -33,7 +33,12 @@ namespace engine::scene
 		// Delete marked instanced entities
 		for (const auto& [group_id, entity_id] : marked_for_removal_instanced)
 		{
-			instanced_entities_groups[group_id].erase(entity_id);
+			entity_map& group = instanced_entities_groups[group_id];
+			auto found = group.find(entity_id);
+			if (found == group.end()) continue;
+
+			resident_instances[group_id].remove(*found->second);
+			group.erase(found);
 		}
 
 		// Clear marks
@@ -83,6 +88,16 @@ namespace engine::scene
 		draw_internal(entities, {}, custom_shader);
 	}
 
+	void Scene::prepare_except_instanced()
+	{
+		prepare_draws(entities);
+	}
+
+	void Scene::draw_prepared(bool keep)
+	{
+		submit_draws(keep);
+	}
+
 	void Scene::draw_only_instanced(Shader* custom_shader)
 	{
 		draw_internal({}, instanced_entities_groups, custom_shader);
@@ -125,9 +140,161 @@ namespace engine::scene
 		draw_internal(draw_entities, draw_groups, custom_shader);
 	}
 
-	void Scene::draw_internal(entity_map entities, entity_group_map instanced_entities_groups, Shader* custom_shader)
+	bool Scene::is_dynamic_caster(const Entity& entity)
 	{
-		// Draw independent entities
+		return entity.dynamic_shadow_caster || entity.is_moving();
+	}
+
+	Scene::ShadowCastersState Scene::shadow_casters_state() const
+	{
+		ShadowCastersState state{ utils::strings::hash_fnv1a("static casters") };
+		for (auto& [id, entity] : entities)
+		{
+			const Entity* caster = entity.get();
+			if (is_dynamic_caster(*caster)) { state.dynamic_casters.push_back(caster); continue; }
+
+			state.static_signature = utils::strings::hash_fnv1a(&caster, sizeof(caster), state.static_signature);
+			state.static_signature = utils::strings::hash_fnv1a(&caster->world_transform().matrix(), sizeof(glm::mat4), state.static_signature);
+		}
+
+		state.dynamic = !state.dynamic_casters.empty();
+		if (instanced_shadow_casters)
+		{
+			for (auto& [group_id, instanced_group] : instanced_entities_groups)
+			{
+				if (!instanced_group.empty() && shadow_models.contains(instanced_group.begin()->second->model)) { state.dynamic = true; break; }
+			}
+		}
+		return state;
+	}
+
+	uint32_t Scene::point_light_mask_of(const Entity& entity) const
+	{
+		if (!use_light_culling) return ~0u;
+
+		uint32_t mask = 0;
+		for (size_t i = 0; i < point_light_influences.size() && i < 32; i++)
+		{
+			const LightInfluence& influence = point_light_influences[i];
+			if (entity.bounding_volume->intersectsSphere(influence.position, influence.radius, entity.world_transform()))
+				mask |= 1u << i;
+		}
+		return mask;
+	}
+
+	bool Scene::is_caster_of(const Entity& entity, ShadowCasters casters)
+	{
+		return casters == ShadowCasters::all || (casters == ShadowCasters::dynamic_only) == is_dynamic_caster(entity);
+	}
+
+	std::vector<Entity*> Scene::find_shadow_casters(ShadowCasters casters)
+	{
+		std::vector<Entity*> found;
+		for (auto& [id, entity] : entities)
+		{
+			if (is_caster_of(*entity, casters)) found.push_back(entity.get());
+		}
+		return found;
+	}
+
+	Scene::InstancedShadowBatch Scene::prepare_instanced_shadow_casters(ShadowCasters casters, std::optional<LightInfluence> range)
+	{
+		InstancedShadowBatch batch;
+		instanced_shadow_instances = 0;
+		if (!instanced_shadow_casters || casters == ShadowCasters::static_only || shadow_models.empty()) return batch;
+
+		struct Candidate
+		{
+			float distance; // squared, from the camera
+			const Entity* entity;
+			const engine::resources::Model* shadow_model;
+		};
+		std::vector<Candidate> candidates;
+
+		utils::math::Frustum frustum = current_camera ? current_camera->frustum() : utils::math::Frustum{};
+		glm::vec3 camera_position = current_camera ? current_camera->position() : glm::vec3{ 0 };
+		for (auto& [group_id, instanced_group] : instanced_entities_groups)
+		{
+			if (instanced_group.empty()) continue;
+			auto shadow_model = shadow_models.find(instanced_group.begin()->second->model);
+			if (shadow_model == shadow_models.end()) continue;
+
+			for (auto& [id, instanced_entity] : instanced_group)
+			{
+				const Transform& transform = instanced_entity->world_transform();
+				if (range && !instanced_entity->bounding_volume->intersectsSphere(range->position, range->radius, transform)) continue;
+				if (instanced_shadow_visible_only && current_camera && !instanced_entity->bounding_volume->isOnFrustum(frustum, transform)) continue;
+
+				glm::vec3 offset = transform.position() - camera_position;
+				candidates.push_back({ glm::dot(offset, offset), instanced_entity.get(), shadow_model->second });
+			}
+		}
+
+		// Over budget, keep the instances nearest to the camera, whose shadows are the most noticeable
+		if (candidates.size() > instanced_shadow_budget)
+		{
+			auto nearer = [](const Candidate& a, const Candidate& b) { return a.distance < b.distance; };
+			std::nth_element(candidates.begin(), candidates.begin() + instanced_shadow_budget, candidates.end(), nearer);
+			candidates.resize(instanced_shadow_budget);
+		}
+
+		// One range of transforms for each shadow model, streaming the affine rows as the instanced groups do
+		std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.shadow_model < b.shadow_model; });
+		for (auto first = candidates.begin(); first != candidates.end();)
+		{
+			auto last = std::find_if(first, candidates.end(), [&](const Candidate& c) { return c.shadow_model != first->shadow_model; });
+			size_t count = std::distance(first, last);
+
+			auto allocation = instance_ring.allocate(count * GPUInstanceCuller::INSTANCE_SIZE);
+			glm::vec4* instance_data = static_cast<glm::vec4*>(allocation.data);
+			for (auto candidate = first; candidate != last; ++candidate)
+			{
+				const glm::mat4& transform = candidate->entity->world_transform().matrix();
+				for (int row = 0; row < 3; row++)
+					*instance_data++ = { transform[0][row], transform[1][row], transform[2][row], transform[3][row] };
+			}
+
+			batch.draws.push_back({ first->shadow_model, allocation, count });
+			instanced_shadow_instances += count;
+			first = last;
+		}
+		return batch;
+	}
+
+	void Scene::draw_instanced_shadow_casters(const InstancedShadowBatch& batch) const
+	{
+		for (const InstancedShadowBatch::Draw& draw : batch.draws)
+		{
+			instance_ring.bind_range(0, draw.transforms, draw.count * GPUInstanceCuller::INSTANCE_SIZE);
+			draw.shadow_model->draw_instanced(draw.count);
+		}
+	}
+
+	void Scene::draw_shadow_casters(Shader& shadow_shader, ShadowCasters casters)
+	{
+		entity_map draw_entities;
+		for (auto& [id, entity] : entities)
+		{
+			if (is_caster_of(*entity, casters)) draw_entities[id] = entity;
+		}
+
+		bool cull_option = use_frustum_culling;
+		use_frustum_culling = false;
+		draw_internal(draw_entities, {}, &shadow_shader);
+		use_frustum_culling = cull_option; // restore previous culling option
+	}
+
+	void Scene::build_occlusion_pyramid(const engine::resources::Texture& depth)
+	{
+		if (!instance_culler || !use_gpu_instance_culling || !use_occlusion_culling) return;
+		instance_culler->build_hiz(depth, current_camera->projectionMatrix() * current_camera->viewMatrix());
+	}
+
+	void Scene::prepare_draws(const entity_map& entities)
+	{
+		prepared_draws.clear();
+		multi_draw_batch.clear();
+
 		for (auto& [id, entity] : entities)
 		{
 			if (use_frustum_culling)
@@ -136,56 +303,177 @@ namespace engine::scene
 				if (!(entity->bounding_volume->isOnFrustum(current_camera->frustum(), entity->world_transform()))) { continue; } 
 			}
 
-			if (custom_shader)
-				entity->custom_draw(*custom_shader);
+			// Queue the meshes of the entity in the multi-draw batch if its shader has a multi-draw variant
+			auto multi_draw_shader = use_multi_draw && entity->material ? multi_draw_shaders.find(entity->material->shader) : multi_draw_shaders.end();
+			uint32_t point_light_mask = point_light_mask_of(*entity);
+			if (multi_draw_shader != multi_draw_shaders.end() && entity->model)
+			{
+				const glm::mat4& model_matrix = entity->world_transform().matrix();
+				for (const auto& mesh_entry : entity->model->meshes)
+				{
+					// If the model has materials of its own, use them, otherwise use entity's material
+					const Material& mesh_material = entity->model->has_material() ? entity->model->materials[mesh_entry.associated_material_idx].material : *entity->material;
+					multi_draw_batch.add(mesh_entry.mesh, mesh_material, *multi_draw_shader->second, model_matrix, point_light_mask);
+				}
+			}
 			else
-				entity->draw();
+				prepared_draws.push_back({ entity.get(), point_light_mask });
+		}
+	}
+
+	void Scene::submit_draws(bool keep)
+	{
+		for (auto& [entity, point_light_mask] : prepared_draws) entity->draw(point_light_mask);
+		multi_draw_batch.submit(keep);
+		if (!keep) prepared_draws.clear();
+	}
+
+	Scene::CullingCheck Scene::check_gpu_culling()
+	{
+		CullingCheck check;
+		if (!instance_culler || !current_camera) return check;
+
+		utils::math::Frustum frustum = current_camera->frustum();
+		for (auto& [group_id, instanced_group] : instanced_entities_groups)
+		{
+			if (instanced_group.empty()) continue;
+			const Entity& first_entity = *instanced_group.begin()->second;
+			const BoundingSphere* sphere = dynamic_cast<const BoundingSphere*>(first_entity.bounding_volume.get());
+			if (!sphere) continue;
+
+			ResidentInstances& resident = resident_instances[group_id];
+			resident.update();
+
+			size_t gpu_visible = resident.size() > 0 ? instance_culler->count_visible(resident.id(), resident.size(), *first_entity.model, *sphere, frustum) : 0;
+			size_t cpu_visible = std::count_if(instanced_group.begin(), instanced_group.end(),
+				[&](const auto& instance) { return instance.second->bounding_volume->isOnFrustum(frustum, instance.second->world_transform()); });
+
+			if (resident.size() != instanced_group.size() || gpu_visible != cpu_visible)
+				utils::io::warn("SCENE - GPU culling self-test, group ", group_id, ": ", instanced_group.size(), " instances (", resident.size(), " resident), ",
+					gpu_visible, " visible on the GPU, ", cpu_visible, " on the CPU");
+
+			check.instances += instanced_group.size();
+			check.resident += resident.size();
+			check.gpu_visible += gpu_visible;
+			check.cpu_visible += cpu_visible;
+		}
+
+		utils::io::info("SCENE - GPU culling self-test: ", check.instances, " instances (", check.resident, " resident), ",
+			check.gpu_visible, " visible on the GPU, ", check.cpu_visible, " on the CPU");
+		return check;
+	}
+
+	void Scene::draw_internal(const entity_map& entities, const entity_group_map& instanced_entities_groups, Shader* custom_shader)
+	{
+		// Draw independent entities
+		if (custom_shader)
+		{
+			for (auto& [id, entity] : entities)
+			{
+				// Don't draw this entity if not in frustums camera
+				if (use_frustum_culling && !(entity->bounding_volume->isOnFrustum(current_camera->frustum(), entity->world_transform()))) continue;
+				entity->custom_draw(*custom_shader);
+			}
+		}
+		else
+		{
+			prepare_draws(entities);
+			submit_draws(false);
 		}
 
 		glBindTexture(GL_TEXTURE_2D, 0);
 		glUseProgram(0);
 
 		// Lambda for drawing instanced groups of entities
-		auto draw_group = [&](auto instanced_group)
+		utils::math::Frustum frustum = current_camera->frustum();
+		size_t instance_size = compact_instance_transforms ? 3 * sizeof(glm::vec4) : sizeof(glm::mat4);
+		bool gpu_culling = instance_culler && use_gpu_instance_culling;
+		if (gpu_culling && !instanced_entities_groups.empty()) instance_culler->begin();
+
+		// Lambda for drawing instanced groups of entities culled on the GPU: the transforms of the group stay resident on the GPU
+		// (only the new and moving instances are written again), the culler keeps the visible ones and counts them into the indirect commands of the draw
+		auto draw_group_gpu_culled = [&](const std::string& group_id, const entity_map& instanced_group, const Shader& shader)
+		{
+			const Entity& first_entity = *instanced_group.begin()->second;
+			const BoundingSphere* sphere = dynamic_cast<const BoundingSphere*>(first_entity.bounding_volume.get());
+			if (!sphere) { utils::io::error("SCENE - GPU culling needs the instances to be bounded by spheres"); return; }
+
+			ResidentInstances& resident = resident_instances[group_id];
+			resident.update();
+			if (resident.size() == 0) return;
+
+			glm::mat4 view_projection = current_camera->projectionMatrix() * current_camera->viewMatrix();
+			auto group = instance_culler->cull(resident.id(), 0, resident.size(), *first_entity.model, *sphere,
+				frustum, view_projection, use_frustum_culling, use_occlusion_culling);
+
+			// Culling bound the compute program, bind the group shader again to draw
+			shader.bind();
+			shader.setBool("compact_instances", true);
+			shader.setUint("point_light_mask", ~0u); // see draw_group
+			instance_culler->draw(group, *first_entity.model);
+		};
+
+		auto draw_group = [&](const std::string& group_id, const entity_map& instanced_group, const Shader& shader)
 		{
+			if (gpu_culling) { draw_group_gpu_culled(group_id, instanced_group, shader); return; }
+
+			// The visible transforms are written straight into the mapped ring, so we reserve room for the whole group
+			auto allocation = instance_ring.allocate(instanced_group.size() * instance_size);
+			glm::vec4* instance_data = static_cast<glm::vec4*>(allocation.data);
+			size_t visible = 0;
+
 			for (auto& [id, instanced_entity] : instanced_group)
 			{
 				if (use_frustum_culling)
 				{
 					// Don't add this entity to the drawing transforms if not in frustums camera
-					if (!(instanced_entity->bounding_volume->isOnFrustum(current_camera->frustum(), instanced_entity->world_transform()))) { continue; }
+					if (!(instanced_entity->bounding_volume->isOnFrustum(frustum, instanced_entity->world_transform()))) { continue; }
 				}
 
-				// Fill data about instanced group transforms
-				instance_group_transforms.push_back(instanced_entity->world_transform().matrix());
-
+				// Fill data about instanced group transforms (rows of the affine part if compact, columns otherwise)
+				const glm::mat4& transform = instanced_entity->world_transform().matrix();
+				if (compact_instance_transforms)
+				{
+					for (int row = 0; row < 3; row++)
+						*instance_data++ = { transform[0][row], transform[1][row], transform[2][row], transform[3][row] };
+				}
+				else
+				{
+					for (int column = 0; column < 4; column++)
+						*instance_data++ = transform[column];
+				}
+				visible++;
 			}
-			// Fill the shader's ubo/ssbo with the gathered transform data
-			utils::graphics::opengl::setup_buffer_object(instanced_ssbo, GL_SHADER_STORAGE_BUFFER, 0, sizeof(glm::mat4), instance_group_transforms.size(),
-				GL_DYNAMIC_DRAW, glm::value_ptr(instance_group_transforms[0]));
+			if (visible == 0) return;
+
+			// The shader reads the group's range of the ring as its instance transforms SSBO
+			instance_ring.bind_range(0, allocation, visible * instance_size);
+			shader.setBool("compact_instances", compact_instance_transforms);
+			// The instances share a draw and are spread over the scene, so their union would reach every light anyway:
+			// rather than testing each instance against each light, the group shades all of them
+			shader.setUint("point_light_mask", ~0u);
 
 			// Perform the instanced draw on the common model of the group
-			instanced_group.begin()->second->model->draw_instanced(instance_group_transforms.size());
+			instanced_group.begin()->second->model->draw_instanced(visible);
 		};
 
 		Material* current_group_material;
 		for (auto& [group_id, instanced_group] : instanced_entities_groups)
 		{
-			instance_group_transforms.clear();
 			// get first entity material, we're assuming all entities in a group share the same material and model
 			if (instanced_group.size() > 0)
 			{
 				if (custom_shader)
 				{
 					custom_shader->bind();
-					draw_group(instanced_group);
+					draw_group(group_id, instanced_group, *custom_shader);
 					custom_shader->unbind();
 				}
 				else
 				{
 					current_group_material = instanced_group.begin()->second->material;
 					current_group_material->bind();
-					draw_group(instanced_group);
+					draw_group(group_id, instanced_group, *current_group_material->shader);
 					current_group_material->unbind();
 				}
 				
@@ -1,18 +1,25 @@
 #pragma once
 
 #include <vector>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
 #include <utility>
+#include <optional>
 
 #include "../random.h"
 #include "../shader.h"
 #include "../material.h"
 #include "../utils.h"
+#include "../ring_buffer.h"
+#include "../geometry_pool.h"
+#include "../multi_draw.h"
 
 #include "camera.h"
 #include "entity.h"
+#include "instance_culler.h"
+#include "resident_instances.h"
 
 namespace engine::scene
 {
@@ -50,18 +57,93 @@ namespace engine::scene
 		// Collection of instanced entity ids to find and destroy at the end of the loop
 		std::unordered_set<std::pair<std::string, std::string>, details::string_pair_hash> marked_for_removal_instanced; 
 
-		GLuint instanced_ssbo{ 0 }; // ID of an OpenGL SSBO (Shader Storage Buffer Object) containing instanced entities' transforms
-		std::vector<glm::mat4> instance_group_transforms; // Collection of instanced entities' transforms
+		// Persistently mapped ring in which the transforms of the visible instances are written, each group reading its own range as SSBO
+		static constexpr size_t INSTANCE_RING_SEGMENT_SIZE = 1 << 20;
+		utils::graphics::opengl::PersistentRingBuffer instance_ring{ GL_SHADER_STORAGE_BUFFER, INSTANCE_RING_SEGMENT_SIZE };
+
+		// Transforms of each instanced group kept on the GPU for the culling pass, following the instances as they are added and removed
+		std::unordered_map<std::string, ResidentInstances> resident_instances;
+
+		// Shared geometry of the meshes drawn through multi-draws, and the batch collecting those draws
+		engine::resources::GeometryPool geometry_pool;
+		engine::resources::MultiDrawBatch multi_draw_batch{ geometry_pool };
+
+		// Variants of the material shaders reading the per-draw data of a multi-draw, entities whose shader has none are drawn one by one
+		std::unordered_map<const Shader*, Shader*> multi_draw_shaders;
+
+		// Low detail models drawn in place of the models of the instanced groups casting shadows, groups without one don't cast
+		std::unordered_map<const engine::resources::Model*, const engine::resources::Model*> shadow_models;
+		size_t instanced_shadow_instances{ 0 };
+
+		// Independent entities which passed the culling and are drawn one by one, with their point light mask (see prepare_draws)
+		std::vector<std::pair<Entity*, uint32_t>> prepared_draws;
 
 		// Draws the provided entities (using the custom shader if given)
-		void draw_internal(entity_map entities, entity_group_map instanced_entities_groups, Shader* custom_shader = nullptr);
+		void draw_internal(const entity_map& entities, const entity_group_map& instanced_entities_groups, Shader* custom_shader = nullptr);
+
+		// Culls the provided independent entities and sorts them between the multi-draw batch and the single draws, without drawing them
+		void prepare_draws(const entity_map& entities);
+
+		// Draws what prepare_draws collected, keeping it for another submit if asked
+		void submit_draws(bool keep);
+
+		// Dynamic casters are drawn by every shadow pass, the static ones can be cached by the lights until the scene changes
+		static bool is_dynamic_caster(const Entity& entity);
+
+		// Mask of the point lights whose influence reaches the entity bounds (every light if culling is disabled)
+		uint32_t point_light_mask_of(const Entity& entity) const;
 
 	public:
+		// Subsets of the independent entities drawn by a shadow pass
+		enum class ShadowCasters { all, static_only, dynamic_only };
+
+		// Reach of a point light, beyond which its contribution is negligible
+		struct LightInfluence
+		{
+			glm::vec3 position;
+			float radius;
+		};
+
+		// Result of check_gpu_culling, summed over the instanced groups
+		struct CullingCheck
+		{
+			size_t instances{ 0 };   // in the groups
+			size_t resident{ 0 };    // in the transforms kept on the GPU (should match instances)
+			size_t gpu_visible{ 0 }; // kept by the culling pass
+			size_t cpu_visible{ 0 }; // kept by the CPU frustum test (should match gpu_visible, give or take the instances grazing a plane)
+		};
+
+		// State of the shadow casters shared by every shadow pass of a frame, see shadow_casters_state()
+		struct ShadowCastersState
+		{
+			uint32_t static_signature{ 0 };             // of the static casters and their transforms, changing whenever one is added, removed, moved or becomes dynamic
+			bool dynamic{ false };                      // whether any caster has to be drawn every frame (dynamic_casters or a casting instanced group)
+			std::vector<const Entity*> dynamic_casters; // the independent entities flagged as dynamic or currently moving
+		};
+
 		Camera* current_camera{ nullptr };
 		utils::random::generator& rng;
 		bool use_frustum_culling{ true };
+		bool compact_instance_transforms{ true }; // Stream instance transforms as 3x4 affine matrices instead of mat4s
+		bool use_multi_draw{ true }; // Submit the independent entities with multi-draws (when their shader has a multi-draw variant)
+
+		// GPU culling of the instanced groups, used instead of the CPU frustum culling when set
+		GPUInstanceCuller* instance_culler{ nullptr };
+		bool use_gpu_instance_culling{ true };
+		bool use_occlusion_culling{ true }; // Also cull the instances hidden by the depth given to build_occlusion_pyramid()
+
+		// Influences of the point lights, in the same order as in the Lights block: lit draws only shade (and sample the shadows of)
+		// the lights reaching their bounds, passed as the point_light_mask uniform or in the per-draw data of a multi-draw
+		// (instanced groups are not masked and shade every light)
+		std::vector<LightInfluence> point_light_influences;
+		bool use_light_culling{ true };
+
+		// Instanced groups with a shadow model are dynamic shadow casters, drawn by every shadow pass through an instanced depth-only shader
+		bool instanced_shadow_casters{ true };
+		bool instanced_shadow_visible_only{ false }; // Only the instances in the camera frustum cast, cheaper but their shadows pop at the screen edges
+		size_t instanced_shadow_budget{ 1024 };     // Most instances drawn by a shadow pass, the nearest to the camera first
 
-		Scene(utils::random::generator& rng) : rng{rng} { glGenBuffers(1, &instanced_ssbo); }
+		Scene(utils::random::generator& rng) : rng{rng} {}
 
 		// Emplaces a entity into the indepented entities collection given its construction arguments and returns a raw ptr to it
 		template <typename ...Args>
@@ -91,12 +173,74 @@ namespace engine::scene
 			newly_added_entity->_scene_state.current_scene = this; // setting this scene as current
 			newly_added_entity->_scene_state.entity_id = final_entity_id; // setting the id in this scene
 			newly_added_entity->_scene_state.instanced_group_id = group_id; // setting the group id 
+			resident_instances[group_id].add(*newly_added_entity);
 			
 			return newly_added_entity; // return the raw pointer
 		}
 
+		// Collects the components of the given type owned by the independent entities
+		template <typename ComponentType>
+		std::vector<ComponentType*> find_components()
+		{
+			std::vector<ComponentType*> found;
+			for (auto& [id, entity] : entities)
+			{
+				if (ComponentType* component = entity->get_component<ComponentType>())
+					found.push_back(component);
+			}
+			return found;
+		}
+
 		size_t get_instances_amount() const;
 
+		// Registers the multi-draw variant of a material shader (the variant must read its data as declared in multi_draw.glsl)
+		void set_multi_draw_shader(const Shader& shader, Shader& multi_draw_shader) { multi_draw_shaders[&shader] = &multi_draw_shader; }
+
+		// Registers the model drawn by the shadow passes for the instanced groups of the given one, letting them cast shadows
+		void set_shadow_model(const engine::resources::Model& model, const engine::resources::Model& shadow_model) { shadow_models[&model] = &shadow_model; }
+
+		// Builds the occlusion culling pyramid of the instanced groups from the depth of the scene drawn with the current camera
+		void build_occlusion_pyramid(const engine::resources::Texture& depth);
+
+		// Self-test of the GPU culling: culls the instanced groups against the current camera frustum (no occlusion) both on the GPU,
+		// from the resident transforms, and on the CPU, then logs and returns both counts (reads back synchronously, only meant for debugging)
+		CullingCheck check_gpu_culling();
+
+		// Gathers the state of the shadow casters in a single pass over the entities, to be computed once per frame and given to every light
+		ShadowCastersState shadow_casters_state() const;
+
+		// Draws the given shadow casters with a shadow shader, without frustum culling (casters outside the camera view still cast shadows in it)
+		void draw_shadow_casters(Shader& shadow_shader, ShadowCasters casters);
+
+		// Collects the given shadow casters, for shadow passes culling and drawing them on their own
+		std::vector<Entity*> find_shadow_casters(ShadowCasters casters);
+
+		// Instanced shadow casters selected for a shadow pass, their transforms (3 rows each) streamed once and drawn for every layer of the pass
+		struct InstancedShadowBatch
+		{
+			struct Draw
+			{
+				const engine::resources::Model* shadow_model;
+				utils::graphics::opengl::PersistentRingBuffer::Allocation transforms;
+				size_t count;
+			};
+			std::vector<Draw> draws; // one per shadow model
+		};
+
+		// Selects the instanced shadow casters (always dynamic) within the given range if set (e.g. the reach of a point light) and within the budget,
+		// then streams their transforms, to be drawn by draw_instanced_shadow_casters for the layers of the same shadow pass
+		InstancedShadowBatch prepare_instanced_shadow_casters(ShadowCasters casters, std::optional<LightInfluence> range = std::nullopt);
+
+		// Draws a batch of instanced shadow casters with the bound instanced shadow shader, which reads the transforms at SSBO binding 0
+		void draw_instanced_shadow_casters(const InstancedShadowBatch& batch) const;
+
+		// Instances selected for the last instanced shadow pass
+		size_t instanced_shadow_drawn() const { return instanced_shadow_instances; }
+
+		// Statistics of the last multi-draw submission
+		size_t multi_draw_draws() const { return multi_draw_batch.submitted_draws(); }
+		size_t multi_draw_calls() const { return multi_draw_batch.submitted_calls(); }
+
 		// Marks an entity for removal given its id (and optionally its group_id if its an instanced entity)
 		void mark_for_removal(const std::string& id_to_remove, std::optional<std::string> group_id = std::nullopt);
 
@@ -115,6 +259,11 @@ namespace engine::scene
 		// Draw only independent entities
 		void draw_except_instanced(Shader* custom_shader = nullptr);
 
+		// Same as draw_except_instanced, but culling and batching once for several passes with the same camera (e.g. a depth prepass, then the lit pass):
+		// each pass calls draw_prepared, keeping the draws for the following one except the last
+		void prepare_except_instanced();
+		void draw_prepared(bool keep = false);
+
 		// Draw only instanced entities
 		void draw_only_instanced  (Shader* custom_shader = nullptr);
 
@@ -126,6 +275,9 @@ namespace engine::scene
 
 	private:
 
+		// Whether the entity belongs to the given subset of shadow casters
+		static bool is_caster_of(const Entity& entity, ShadowCasters casters);
+
 		// Function that returns an unique string id (not in the given map) given a base string
 		template<typename T>
 		std::string try_get_unique_string_id(const std::unordered_map<std::string, T>& map, const std::string& id)
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <bit>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+#include "../oop.h"
+
+#include "scene.h"
+#include "light.h"
+
+namespace engine::scene
+{
+	// Spreads the shadowmap updates of many lights over several frames, given a budget of shadow texels rendered per frame
+	// Every outdated layer (cube face or directional cascade) waits in line, scored by the priority of its light times the frames it has been waiting,
+	// so urgent lights are updated more often while the others still get their turn; the layers skipped keep their last content
+	// (except the layers just created, which have none and are updated right away over the budget)
+	class ShadowScheduler : utils::oop::non_copyable, utils::oop::non_movable
+	{
+	public:
+		bool  enabled{ true };          // When disabled, every outdated layer is updated each frame
+		float budget_megatexels{ 6.f }; // Shadow texels rendered per frame, in millions (at least one layer is always updated)
+
+		// Per light statistics, as shown in the lights panel
+		struct LightStats
+		{
+			float updates_per_frame{ 0 }; // Running average of the layers updated each frame
+			unsigned int pending{ 0 };    // Outdated layers left waiting in the last frame
+		};
+
+		// Updates the shadowmaps of the given lights within the budget
+		void update(Scene& scene, const std::vector<Light*>& lights)
+		{
+			struct Candidate
+			{
+				Light* light;
+				unsigned int layer;
+				float score;
+				bool forced; // undefined layers are updated regardless of the budget
+			};
+			std::vector<Candidate> candidates;
+
+			// The casters are the same for every light, gather them once for the whole update
+			Scene::ShadowCastersState casters = scene.shadow_casters_state();
+
+			for (Light* light : lights)
+			{
+				LightState& state = states[light];
+				uint32_t undefined = light->undefined_shadow_layers();
+				uint32_t outdated = light->outdated_shadow_layers(casters) | undefined;
+				float priority = enabled ? light->shadow_priority(scene, casters) : 1.f;
+
+				for (unsigned int layer = 0; layer < state.waiting.size(); layer++)
+				{
+					if (!(outdated & (1u << layer))) { state.waiting[layer] = 0; continue; }
+					bool forced = undefined & (1u << layer);
+					candidates.push_back({ light, layer, forced ? std::numeric_limits<float>::infinity() : priority * ++state.waiting[layer], forced });
+				}
+				state.requested = 0;
+			}
+
+			// Take the most urgent layers first, skipping the ones exceeding what is left of the budget
+			std::stable_sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+			size_t budget = static_cast<size_t>(budget_megatexels * 1e6f), spent = 0;
+			for (const Candidate& candidate : candidates)
+			{
+				size_t cost = candidate.light->shadow_layer_texels();
+				if (enabled && !candidate.forced && spent > 0 && spent + cost > budget) continue;
+
+				spent += cost;
+				states[candidate.light].requested |= 1u << candidate.layer;
+			}
+
+			for (Light* light : lights)
+			{
+				LightState& state = states[light];
+				if (state.requested) light->compute_shadowmap(scene, casters, state.requested);
+
+				unsigned int updated = std::popcount(state.requested), pending = 0;
+				for (unsigned int layer = 0; layer < state.waiting.size(); layer++)
+				{
+					if (state.requested & (1u << layer)) state.waiting[layer] = 0;
+					else if (state.waiting[layer] > 0) pending++;
+				}
+				state.stats.updates_per_frame += (updated - state.stats.updates_per_frame) * 0.05f;
+				state.stats.pending = pending;
+			}
+			texels_last_frame = spent;
+		}
+
+		LightStats stats(const Light* light) const
+		{
+			auto found = states.find(light);
+			return found != states.end() ? found->second.stats : LightStats{};
+		}
+
+		size_t rendered_texels() const { return texels_last_frame; }
+
+	private:
+		struct LightState
+		{
+			std::array<unsigned int, 6> waiting{}; // Frames each outdated layer has been waiting for its update
+			uint32_t requested{ 0 };               // Layers updated in the current frame
+			LightStats stats;
+		};
+
+		std::unordered_map<const Light*, LightState> states;
+		size_t texels_last_frame{ 0 };
+	};
+}
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <fstream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+#include "../oop.h"
+#include "../io.h"
+#include "../utils.h"
+#include "../components/paintable_component.h"
+
+#include "scene.h"
+
+namespace engine::scene
+{
+	// Compact quantized representation of a splat applied to a paintable entity (28 bytes)
+	struct SplatRecord
+	{
+		using Splat = engine::resources::Splat;
+
+		constexpr static float POSITION_SCALE  = 1024.f;   // 1/1024 m steps
+		constexpr static float SIZE_SCALE      = 4096.f;   // 1/4096 m steps
+		constexpr static float DIRECTION_SCALE = 32767.f;
+
+		int32_t  position[3];  // World position
+		int16_t  direction[2]; // Octahedral-encoded direction
+		uint16_t size;         // Splat size
+		uint16_t reserved;
+		uint8_t  color[4];     // RGBA8 color
+		uint32_t target;       // FNV-1a hash of the target entity display name
+
+		static SplatRecord encode(const Splat& splat, uint32_t target)
+		{
+			SplatRecord record{};
+
+			for (int i = 0; i < 3; ++i)
+				record.position[i] = static_cast<int32_t>(std::round(splat.position[i] * POSITION_SCALE));
+
+			// Octahedral mapping: project onto the octahedron, then unfold the lower hemisphere onto the square corners
+			glm::vec3 n = splat.direction / (std::abs(splat.direction.x) + std::abs(splat.direction.y) + std::abs(splat.direction.z));
+			glm::vec2 oct = n.z >= 0 ? glm::vec2{ n.x, n.y } : (1.f - glm::abs(glm::vec2{ n.y, n.x })) * sign_not_zero(glm::vec2{ n.x, n.y });
+			for (int i = 0; i < 2; ++i)
+				record.direction[i] = static_cast<int16_t>(std::round(glm::clamp(oct[i], -1.f, 1.f) * DIRECTION_SCALE));
+
+			record.size = static_cast<uint16_t>(std::round(glm::clamp(splat.size * SIZE_SCALE, 0.f, 65535.f)));
+
+			for (int i = 0; i < 4; ++i)
+				record.color[i] = static_cast<uint8_t>(std::round(glm::clamp(splat.color[i], 0.f, 1.f) * 255.f));
+
+			record.target = target;
+			return record;
+		}
+
+		Splat decode() const
+		{
+			Splat splat;
+			splat.position = glm::vec3{ position[0], position[1], position[2] } / POSITION_SCALE;
+
+			glm::vec2 oct = glm::vec2{ direction[0], direction[1] } / DIRECTION_SCALE;
+			glm::vec3 n{ oct.x, oct.y, 1.f - std::abs(oct.x) - std::abs(oct.y) };
+			float t = std::max(-n.z, 0.f);
+			n.x += n.x >= 0 ? -t : t;
+			n.y += n.y >= 0 ? -t : t;
+			splat.direction = glm::normalize(n);
+
+			splat.size = size / SIZE_SCALE;
+			splat.color = glm::vec4{ color[0], color[1], color[2], color[3] } / 255.f;
+			return splat;
+		}
+
+	private:
+		static glm::vec2 sign_not_zero(const glm::vec2& v) { return { v.x >= 0 ? 1.f : -1.f, v.y >= 0 ? 1.f : -1.f }; }
+	};
+	static_assert(sizeof(SplatRecord) == 28, "SplatRecord layout must stay packed, it is written as is into the log");
+
+	// Append-only binary log of the splats applied onto the paintables of a scene:
+	// replaying it rebuilds the paint state, so it can be used to restore sessions or synchronize paint between processes
+	class SplatLog : utils::oop::non_copyable
+	{
+		using Splat              = engine::resources::Splat;
+		using PaintableComponent = engine::components::PaintableComponent;
+
+		constexpr static uint32_t FILE_MAGIC   = 0x4C534843; // "CHSL" (little endian)
+		constexpr static uint32_t FILE_VERSION = 1;
+		constexpr static size_t   FLUSH_THRESHOLD = 4096; // records buffered before being written out regardless of flush() calls
+		constexpr static size_t   REPLAY_BATCH_SPLATS = 65536; // splats queued before being applied when replaying
+
+	public:
+		// Paint-space projection parameters shared by every splat of a log
+		struct ProjectionParams
+		{
+			float near_plane, far_plane, distance_bias;
+
+			bool operator==(const ProjectionParams& other) const = default;
+		};
+
+	private:
+		struct Header
+		{
+			uint32_t magic, version;
+			ProjectionParams params;
+		};
+
+		std::string file_path;
+		ProjectionParams params;
+		std::ofstream out;
+		std::vector<SplatRecord> buffered;
+		size_t recorded{ 0 };
+		bool params_warning_shown{ false };
+
+	public:
+		// Opens the log for appending, creating it if needed (or if truncate is true): an existing log keeps the params it was created with
+		SplatLog(std::string file_path, ProjectionParams params, bool truncate = false) :
+			file_path{ std::move(file_path) },
+			params{ params }
+		{
+			std::vector<SplatRecord> existing_records;
+			ProjectionParams existing_params;
+			bool append = !truncate && read(this->file_path, existing_params, existing_records);
+
+			if (append)
+			{
+				this->params = existing_params;
+				recorded = existing_records.size();
+			}
+
+			std::filesystem::path path{ this->file_path };
+			if (path.has_parent_path()) std::filesystem::create_directories(path.parent_path());
+
+			out.open(this->file_path, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+			if (!out) { utils::io::error("SPLAT LOG - Could not open ", this->file_path); return; }
+
+			if (!append)
+			{
+				Header header{ FILE_MAGIC, FILE_VERSION, params };
+				out.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			}
+		}
+
+		~SplatLog()
+		{
+			flush();
+		}
+
+		const ProjectionParams& projection_params() const { return params; }
+
+		// Amount of splats in the log (including the ones of previous sessions)
+		size_t size() const { return recorded; }
+
+		// Appends a splat applied with the given params onto the named entity and returns it as it will be replayed:
+		// applying the returned (quantized) splat instead of the original keeps the live paint state identical to a replay
+		Splat record(const Splat& splat, std::string_view target_name, const ProjectionParams& current_params)
+		{
+			if (current_params != params && !params_warning_shown)
+			{
+				utils::io::warn("SPLAT LOG - Paint projection params differ from the ones the log was created with, replays will not match exactly");
+				params_warning_shown = true;
+			}
+
+			SplatRecord splat_record = SplatRecord::encode(splat, utils::strings::hash_fnv1a(target_name));
+			buffered.push_back(splat_record);
+			++recorded;
+
+			if (buffered.size() >= FLUSH_THRESHOLD) flush();
+
+			return splat_record.decode();
+		}
+
+		// Writes out the buffered records (meant to be called once per frame)
+		void flush()
+		{
+			if (buffered.empty() || !out) return;
+
+			out.write(reinterpret_cast<const char*>(buffered.data()), buffered.size() * sizeof(SplatRecord));
+			out.flush();
+			buffered.clear();
+		}
+
+		// Reads a whole log, returns false if it doesn't exist or it is not a valid log
+		static bool read(const std::string& path, ProjectionParams& params, std::vector<SplatRecord>& records)
+		{
+			std::ifstream in{ path, std::ios::binary };
+			if (!in) return false;
+
+			Header header;
+			if (!in.read(reinterpret_cast<char*>(&header), sizeof(Header)) || header.magic != FILE_MAGIC || header.version != FILE_VERSION)
+			{
+				utils::io::error("SPLAT LOG - ", path, " is not a valid splat log");
+				return false;
+			}
+			params = header.params;
+
+			// A log being appended to by another process may end with a partial record, which we simply ignore
+			auto data_size = std::filesystem::file_size(path) - sizeof(Header);
+			records.resize(data_size / sizeof(SplatRecord));
+			in.read(reinterpret_cast<char*>(records.data()), records.size() * sizeof(SplatRecord));
+			records.resize(in.gcount() / sizeof(SplatRecord));
+
+			return true;
+		}
+
+		// Replays the records onto the paintables of the scene they target, returns the amount of splats applied
+		static size_t replay(Scene& scene, const ProjectionParams& params, const std::vector<SplatRecord>& records)
+		{
+			std::unordered_map<uint32_t, PaintableComponent*> targets;
+			for (PaintableComponent* paintable : scene.find_components<PaintableComponent>())
+				targets[utils::strings::hash_fnv1a(paintable->parent()->display_name)] = paintable;
+
+			// Splats are queued in the atlases of their targets, which apply the splats of different paintmaps together
+			size_t applied = 0;
+			for (const SplatRecord& record : records)
+			{
+				auto target = targets.find(record.target);
+				if (target == targets.end()) continue;
+
+				replay(*target->second, params, &record, 1);
+				++applied;
+			}
+
+			for (auto& [hash, paintable] : targets) paintable->atlas().apply_splats();
+
+			if (applied != records.size())
+				utils::io::warn("SPLAT LOG - ", records.size() - applied, " splats target entities not in the scene, skipped");
+
+			return applied;
+		}
+
+		// Replays the records onto the given paintable, regardless of their original target
+		static void replay(PaintableComponent& paintable, const ProjectionParams& params, const SplatRecord* records, size_t count)
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				Splat splat = records[i].decode();
+				paintable.update_paintmap(splat.paintspace_matrix(params.near_plane, params.far_plane, params.distance_bias), splat.direction, splat.color);
+
+				// Keep the queued splats bounded on long logs
+				if (paintable.atlas().pending() >= REPLAY_BATCH_SPLATS) paintable.atlas().apply_splats();
+			}
+		}
+	};
+}
@@ -5,6 +5,8 @@
 #include <sstream>
 #include <iostream>
 #include <vector>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
 
 #include <gsl/gsl>
@@ -18,6 +20,46 @@
 
 namespace engine::resources
 {
+	// Name of a uniform, identified by its hash (computed at compile time for string literals)
+	struct UniformName
+	{
+		uint32_t hash;
+		std::string_view name; // only valid during the call, for diagnostics
+
+		template <size_t N>
+		consteval UniformName(const char (&literal)[N]) : hash{ utils::strings::hash_fnv1a({ literal, N - 1 }) }, name{ literal, N - 1 } {}
+		UniformName(const std::string& name) : hash{ utils::strings::hash_fnv1a(name) }, name{ name } {}
+	};
+
+	// Typed handle to a uniform of a program, resolved once and set without binding the program
+	template <typename T>
+	class Uniform
+	{
+		GLuint program { 0 };
+		GLint  location{ -1 };
+
+	public:
+		Uniform() = default;
+		Uniform(GLuint program, GLint location) : program{ program }, location{ location } {}
+
+		bool valid() const noexcept { return location >= 0; }
+
+		void set(const T& value) const
+		{
+			if      constexpr (std::is_same_v<T, int>)          glProgramUniform1i (program, location, value);
+			else if constexpr (std::is_same_v<T, bool>)         glProgramUniform1i (program, location, gsl::narrow<GLint>(value));
+			else if constexpr (std::is_same_v<T, unsigned int>) glProgramUniform1ui(program, location, value);
+			else if constexpr (std::is_same_v<T, float>)        glProgramUniform1f (program, location, value);
+			else if constexpr (std::is_same_v<T, glm::vec2>)    glProgramUniform2fv(program, location, 1, glm::value_ptr(value));
+			else if constexpr (std::is_same_v<T, glm::vec3>)    glProgramUniform3fv(program, location, 1, glm::value_ptr(value));
+			else if constexpr (std::is_same_v<T, glm::vec4>)    glProgramUniform4fv(program, location, 1, glm::value_ptr(value));
+			else if constexpr (std::is_same_v<T, glm::mat2>)    glProgramUniformMatrix2fv(program, location, 1, GL_FALSE, glm::value_ptr(value));
+			else if constexpr (std::is_same_v<T, glm::mat3>)    glProgramUniformMatrix3fv(program, location, 1, GL_FALSE, glm::value_ptr(value));
+			else if constexpr (std::is_same_v<T, glm::mat4>)    glProgramUniformMatrix4fv(program, location, 1, GL_FALSE, glm::value_ptr(value));
+			else static_assert(!sizeof(T), "Unsupported uniform type");
+		}
+	};
+
 	// Class for loading and managing shaders 
 	class Shader
 	{
@@ -28,7 +70,7 @@ namespace engine::resources
 		GLuint _program;
 		std::string _name;
 
-		mutable std::unordered_map<std::string, GLint> _uniformLocationCache;
+		std::unordered_map<uint32_t, GLint> _uniformLocations; // active uniforms by name hash, filled after linking
 
 	public:
 		Shader(std::string name, const GLchar* vertPath, const GLchar* fragPath, GLuint glMajor, GLuint glMinor, const GLchar* geomPath = 0, std::vector<const GLchar*> utilPaths = {}) :
@@ -39,12 +81,22 @@ namespace engine::resources
 			loadFromText(vertPath, fragPath, geomPath, utilPaths);
 		}
 
+		// Compute shader program, with optional source text prepended after the utils (e.g. defines or generated constants)
+		Shader(std::string name, const GLchar* compPath, GLuint glMajor, GLuint glMinor, std::vector<const GLchar*> utilPaths = {}, const std::string& prependedSource = "") :
+			_name{ name },
+			_program{ glCreateProgram() }, glMajorVersion{ glMajor }, glMinorVersion{ glMinor },
+			vertPath{ compPath }
+		{
+			loadComputeFromText(compPath, utilPaths, prependedSource);
+		}
+
 		           Shader(const Shader& copy) = delete;
 		Shader& operator=(const Shader& copy) = delete;
 
 		Shader(Shader&& move) noexcept :
 			_program{ move._program }, glMajorVersion{ move.glMajorVersion }, glMinorVersion{ move.glMinorVersion },
-			vertPath{ std::move(move.vertPath) }, fragPath{ std::move(move.fragPath) }
+			vertPath{ std::move(move.vertPath) }, fragPath{ std::move(move.fragPath) },
+			_name{ std::move(move._name) }, _uniformLocations{ std::move(move._uniformLocations) }
 		{
 			// invalidate other's program since it has moved
 			move._program = 0;
@@ -60,6 +112,8 @@ namespace engine::resources
 				_program = move._program; 
 				glMajorVersion = move.glMajorVersion; glMinorVersion = move.glMinorVersion;
 				vertPath = std::move(move.vertPath); fragPath = std::move(move.fragPath);
+				_name = std::move(move._name);
+				_uniformLocations = std::move(move._uniformLocations); // the locations refer to the moved program
 
 				// invalidate other's texture id since it has moved
 				move._program = 0;
@@ -144,48 +198,52 @@ namespace engine::resources
 		}
 
 #pragma region utility_uniform_functions
-		GLint getUniformLocation(const std::string& name) const
+		GLint getUniformLocation(UniformName name) const
 		{
-			// If the uniform was already cached, we dont need an expensive gl call
-			if (_uniformLocationCache.find(name) != _uniformLocationCache.end())
-				return _uniformLocationCache[name];
-
-			GLint location = glGetUniformLocation(_program, name.c_str());
-			_uniformLocationCache[name] = location; // we cache the new uniform
+			// Every active uniform was cached after linking, so we never need an expensive gl call
+			auto location = _uniformLocations.find(name.hash);
+			if (location != _uniformLocations.end())
+				return location->second;
 
 			#ifdef DEBUG_UNIFORM
-			if (location == -1)
-			{
-				std::cout << "Warning: uniform '" << name << "' of program compiled from path '" << vertPath << "' doesn't exist!" << std::endl;
-			}
+			std::cout << "Warning: uniform '" << name.name << "' of program compiled from path '" << vertPath << "' doesn't exist!" << std::endl;
 			#endif
-			return location;
+			return -1;
 		}
 
-		void setInt  (const std::string& name, int value)                             const { glUniform1i (getUniformLocation(name), gsl::narrow<GLint>(value)); }
-		void setBool (const std::string& name, bool value)                            const { glUniform1i (getUniformLocation(name), gsl::narrow<GLint>(value)); }
-		void setUint (const std::string& name, unsigned int value)                    const { glUniform1ui(getUniformLocation(name), gsl::narrow<GLuint>(value)); }
-		void setFloat(const std::string& name, float value)                           const { glUniform1f (getUniformLocation(name), gsl::narrow<GLfloat>(value)); }
+		// Typed handle to a uniform, to be resolved once and kept by the caller
+		template <typename T>
+		Uniform<T> uniform(UniformName name) const { return { _program, getUniformLocation(name) }; }
 
-		void setVec2 (const std::string& name, const GLfloat value[])                 const { glUniform2fv(getUniformLocation(name), 1, &value[0]); }
-		void setVec2 (const std::string& name, const glm::vec2& value)                const { glUniform2fv(getUniformLocation(name), 1, glm::value_ptr(value)); }
-		void setVec2 (const std::string& name, float x, float y)                      const { glUniform2f (getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y)); }
+		// N.B. setters use glProgramUniform, so the program doesn't need to be bound
+		void setInt  (UniformName name, int value)                             const { glProgramUniform1i (_program, getUniformLocation(name), gsl::narrow<GLint>(value)); }
+		void setBool (UniformName name, bool value)                            const { glProgramUniform1i (_program, getUniformLocation(name), gsl::narrow<GLint>(value)); }
+		void setUint (UniformName name, unsigned int value)                    const { glProgramUniform1ui(_program, getUniformLocation(name), gsl::narrow<GLuint>(value)); }
+		void setFloat(UniformName name, float value)                           const { glProgramUniform1f (_program, getUniformLocation(name), gsl::narrow<GLfloat>(value)); }
+
+		void setVec2 (UniformName name, const GLfloat value[])                 const { glProgramUniform2fv(_program, getUniformLocation(name), 1, &value[0]); }
+		void setVec2 (UniformName name, const glm::vec2& value)                const { glProgramUniform2fv(_program, getUniformLocation(name), 1, glm::value_ptr(value)); }
+		void setVec2 (UniformName name, float x, float y)                      const { glProgramUniform2f (_program, getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y)); }
 					 
-		void setVec3 (const std::string& name, const GLfloat value[])                 const { glUniform3fv(getUniformLocation(name), 1, &value[0]); }
-		void setVec3 (const std::string& name, const glm::vec3& value)                const { glUniform3fv(getUniformLocation(name), 1, glm::value_ptr(value)); }
-		void setVec3 (const std::string& name, float x, float y, float z)             const { glUniform3f (getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y), gsl::narrow<GLfloat>(z)); }
+		void setVec3 (UniformName name, const GLfloat value[])                 const { glProgramUniform3fv(_program, getUniformLocation(name), 1, &value[0]); }
+		void setVec3 (UniformName name, const glm::vec3& value)                const { glProgramUniform3fv(_program, getUniformLocation(name), 1, glm::value_ptr(value)); }
+		void setVec3 (UniformName name, float x, float y, float z)             const { glProgramUniform3f (_program, getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y), gsl::narrow<GLfloat>(z)); }
 					 
-		void setVec4 (const std::string& name, const GLfloat value[])                 const { glUniform4fv(getUniformLocation(name), 1, &value[0]); }
-		void setVec4 (const std::string& name, const glm::vec4& value)                const { glUniform4fv(getUniformLocation(name), 1, glm::value_ptr(value)); }
-		void setVec4 (const std::string& name, float x, float y, float z, float w)    const { glUniform4f (getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y), gsl::narrow<GLfloat>(z), gsl::narrow<GLfloat>(w)); }
+		void setVec4 (UniformName name, const GLfloat value[])                 const { glProgramUniform4fv(_program, getUniformLocation(name), 1, &value[0]); }
+		void setVec4 (UniformName name, const glm::vec4& value)                const { glProgramUniform4fv(_program, getUniformLocation(name), 1, glm::value_ptr(value)); }
+		void setVec4 (UniformName name, float x, float y, float z, float w)    const { glProgramUniform4f (_program, getUniformLocation(name), gsl::narrow<GLfloat>(x), gsl::narrow<GLfloat>(y), gsl::narrow<GLfloat>(z), gsl::narrow<GLfloat>(w)); }
 					 
-		void setMat2 (const std::string& name, const glm::mat2& mat)                  const { glUniformMatrix2fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
+		void setMat2 (UniformName name, const glm::mat2& mat)                  const { glProgramUniformMatrix2fv(_program, getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
 
-		void setMat3 (const std::string& name, const glm::mat3& mat)                  const { glUniformMatrix3fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
+		void setMat3 (UniformName name, const glm::mat3& mat)                  const { glProgramUniformMatrix3fv(_program, getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
 					 
-		void setMat4 (const std::string& name, const glm::mat4& mat)                  const { glUniformMatrix4fv(getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
+		void setMat4 (UniformName name, const glm::mat4& mat)                  const { glProgramUniformMatrix4fv(_program, getUniformLocation(name), 1, GL_FALSE, glm::value_ptr(mat)); }
+
+		void setIntV (UniformName name, const int count, const int* value)     const { glProgramUniform1iv(_program, getUniformLocation(name), count, value); }
+
+		void setVec4V(UniformName name, const int count, const glm::vec4* value) const { glProgramUniform4fv(_program, getUniformLocation(name), count, glm::value_ptr(value[0])); }
 
-		void setIntV (const std::string& name, const int count, const int* value)     const { glUniform1iv(getUniformLocation(name), count, value); }
+		void setMat4V(UniformName name, const int count, const glm::mat4* value) const { glProgramUniformMatrix4fv(_program, getUniformLocation(name), count, GL_FALSE, glm::value_ptr(value[0])); }
 #pragma endregion 
 
 	private:	
@@ -203,6 +261,7 @@ namespace engine::resources
 				if (shaderType == GL_VERTEX_SHADER)        shader_type = "VERTEX";
 				else if (shaderType == GL_FRAGMENT_SHADER) shader_type = "FRAGMENT";
 				else if (shaderType == GL_GEOMETRY_SHADER) shader_type = "GEOMETRY";
+				else if (shaderType == GL_COMPUTE_SHADER)  shader_type = "COMPUTE";
 				utils::io::error("SHADER ", shader_type, " - compilation failed for shader ", _name, " \n", infoLog);
 			}
 		}
@@ -255,6 +314,7 @@ namespace engine::resources
 			}
 			catch (std::exception e) { auto x = glGetError(); checkLinkingErrors(); std::cout << e.what(); }
 			checkLinkingErrors();
+			cacheUniformLocations();
 
 			// Cleanup
 			glDeleteShader(vertexShader);
@@ -263,6 +323,69 @@ namespace engine::resources
 			if (geomPath) { glDeleteShader(geometryShader); }
 		}
 
+		// Load, compile and link a compute shader program
+		void loadComputeFromText(const GLchar* compPath, std::vector<const GLchar*> utilPaths, const std::string& prependedSource)
+		{
+			const std::string compSource = loadSourceText(compPath);
+
+			std::string utilsSource;
+			for (const GLchar* utilPath : utilPaths)
+			{
+				utilsSource += loadSourceText(utilPath) + "\n";
+			}
+			utilsSource += prependedSource;
+
+			GLuint computeShader = compileShaderText(compSource, GL_COMPUTE_SHADER, utilsSource);
+			glAttachShader(_program, computeShader);
+
+			glLinkProgram(_program);
+			checkLinkingErrors();
+			cacheUniformLocations();
+
+			glDeleteShader(computeShader);
+		}
+
+		// Caches the location of every active uniform of the linked program by name hash
+		// arrays are reachable both by their name and by the name of each element (e.g. "maps", "maps[0]", "maps[1]"...)
+		void cacheUniformLocations()
+		{
+			_uniformLocations.clear();
+
+			GLint uniformsAmount = 0, maxNameLength = 0;
+			glGetProgramiv(_program, GL_ACTIVE_UNIFORMS, &uniformsAmount);
+			glGetProgramiv(_program, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+			std::vector<GLchar> nameBuffer(std::max(maxNameLength, 1));
+			for (GLint i = 0; i < uniformsAmount; i++)
+			{
+				GLsizei nameLength = 0; GLint arraySize = 0; GLenum type;
+				glGetActiveUniform(_program, gsl::narrow<GLuint>(i), gsl::narrow<GLsizei>(nameBuffer.size()), &nameLength, &arraySize, &type, nameBuffer.data());
+				std::string name{ nameBuffer.data(), gsl::narrow<size_t>(nameLength) };
+
+				GLint location = glGetUniformLocation(_program, name.c_str());
+				if (location < 0) continue; // members of uniform blocks have no location
+
+				cacheUniformLocation(name, location);
+				if (name.ends_with("[0]"))
+				{
+					std::string arrayName = name.substr(0, name.size() - 3);
+					cacheUniformLocation(arrayName, location);
+					for (GLint element = 1; element < arraySize; element++)
+					{
+						std::string elementName = arrayName + "[" + std::to_string(element) + "]";
+						cacheUniformLocation(elementName, glGetUniformLocation(_program, elementName.c_str()));
+					}
+				}
+			}
+		}
+
+		void cacheUniformLocation(const std::string& name, GLint location)
+		{
+			auto [cached, inserted] = _uniformLocations.try_emplace(utils::strings::hash_fnv1a(name), location);
+			if (!inserted && cached->second != location)
+				utils::io::warn("SHADER ", _name, " - uniform name hash collision on '", name, "'");
+		}
+
 		// Load the source code of a shader
 		const std::string loadSourceText(const GLchar* sourcePath) const noexcept
 		{
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <glad.h>
+
+#include "oop.h"
+#include "utils.h"
+
+namespace utils::graphics::opengl
+{
+	// Uniform buffer object holding a single std140 block, bound to a fixed binding point shared by every shader declaring the block
+	// (T must mirror the block layout, padding included)
+	template <typename T>
+	class UniformBuffer : utils::oop::non_copyable, utils::oop::non_movable
+	{
+		GLuint _id;
+		GLuint _binding;
+
+	public:
+		UniformBuffer(GLuint binding, const T& data = {}) : _binding{ binding }
+		{
+			glGenBuffers(1, &_id);
+			setup_buffer_object(_id, GL_UNIFORM_BUFFER, binding, sizeof(T), GL_DYNAMIC_DRAW, const_cast<T*>(&data));
+		}
+
+		~UniformBuffer()
+		{
+			glDeleteBuffers(1, &_id);
+		}
+
+		// Uploads the whole block, every shader sees the new values in its next draws
+		void update(const T& data)
+		{
+			glNamedBufferSubData(_id, 0, sizeof(T), &data);
+		}
+
+		// Binds the buffer again to its binding point (only needed if something else was bound there)
+		void bind() const
+		{
+			glBindBufferBase(GL_UNIFORM_BUFFER, _binding, _id);
+		}
+
+		GLuint id() const { return _id; }
+		GLuint binding() const { return _binding; }
+	};
+}
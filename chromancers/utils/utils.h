@@ -1,7 +1,11 @@
 #pragma once
 #include <string>
+#include <string_view>
 
 #include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_inverse.hpp>
@@ -51,6 +55,30 @@ namespace utils::strings
 
 		return ret;
 	}
+
+	// 32-bit FNV-1a hash of a string, usable at compile time
+	constexpr uint32_t hash_fnv1a(std::string_view str)
+	{
+		uint32_t hash = 2166136261u;
+		for (char c : str)
+		{
+			hash ^= static_cast<uint8_t>(c);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	// 32-bit FNV-1a hash of raw bytes, continuing from the given hash so that several values can be hashed in sequence
+	inline uint32_t hash_fnv1a(const void* data, size_t size, uint32_t hash = 2166136261u)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 16777619u;
+		}
+		return hash;
+	}
 }
 
 namespace utils::math
@@ -87,6 +115,31 @@ namespace utils::math
 		Plane nearFace;
 	};
 
+	// Extracts the frustum planes of a view projection matrix (Gribb-Hartmann), with normals pointing inside
+	inline Frustum frustum_from_matrix(const glm::mat4& view_projection)
+	{
+		glm::vec4 rows[4];
+		for (int i = 0; i < 4; i++) rows[i] = { view_projection[0][i], view_projection[1][i], view_projection[2][i], view_projection[3][i] };
+
+		auto plane = [](const glm::vec4& coefficients)
+		{
+			Plane result;
+			float length = glm::length(glm::vec3(coefficients));
+			result.normal   = glm::vec3(coefficients) / length;
+			result.distance = -coefficients.w / length;
+			return result;
+		};
+
+		Frustum frustum;
+		frustum.leftFace   = plane(rows[3] + rows[0]);
+		frustum.rightFace  = plane(rows[3] - rows[0]);
+		frustum.bottomFace = plane(rows[3] + rows[1]);
+		frustum.topFace    = plane(rows[3] - rows[1]);
+		frustum.nearFace   = plane(rows[3] + rows[2]);
+		frustum.farFace    = plane(rows[3] - rows[2]);
+		return frustum;
+	}
+
 	inline glm::vec4 unproject(float screen_x, float screen_y, int screen_width, int screen_height, glm::mat4 view, glm::mat4 proj)
 	{
 		glm::vec4 ret{1};
@@ -109,10 +162,36 @@ namespace utils::math
 
 		return ret;
 	}
+
+	// Normalized weights of a symmetric gaussian kernel: weights[0] is the center tap, weights[i] is mirrored at offsets -i and +i
+	inline std::vector<float> gaussian_kernel(int radius, float sigma)
+	{
+		std::vector<float> discrete(radius + 1);
+		float sum = 0;
+		for (int i = 0; i <= radius; ++i)
+		{
+			discrete[i] = std::exp(-(i * i) / (2 * sigma * sigma));
+			sum += i ? 2 * discrete[i] : discrete[i];
+		}
+		for (float& w : discrete) w /= sum;
+		return discrete;
+	}
 }
 
 namespace utils::graphics::opengl
 {
+	// Checks whether the current context exposes the given extension (e.g. "GL_ARB_shader_viewport_layer_array")
+	inline bool has_extension(std::string_view name)
+	{
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; i++)
+		{
+			if (name == reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i))) return true;
+		}
+		return false;
+	}
+
 	// Setups an OpenGL buffer object and fills it with the provided data
 	inline void setup_buffer_object(GLuint& buffer_object, GLenum target, int bind_index, size_t alloc_size, GLenum usage, void* data = nullptr)
 	{
@@ -167,4 +246,70 @@ namespace utils::containers
 			std::vector<T>::push_back(value);
 		}
 	};
+}
+
+namespace utils::compression
+{
+	// Byte-oriented run-length encoding (PackBits-like), well suited for data with long uniform runs (e.g. mostly empty textures)
+	// A control byte c < 128 is followed by c+1 literal bytes, a control byte c >= 128 is followed by a single byte repeated c-125 times
+	inline std::vector<uint8_t> rle_encode(const uint8_t* data, size_t size)
+	{
+		constexpr size_t max_literals = 128, min_run = 3, max_run = 130;
+
+		std::vector<uint8_t> encoded;
+		size_t i = 0;
+		while (i < size)
+		{
+			// Measure the run starting at the current byte
+			size_t run = 1;
+			while (i + run < size && run < max_run && data[i + run] == data[i]) ++run;
+
+			if (run >= min_run)
+			{
+				encoded.push_back(static_cast<uint8_t>(run + 125));
+				encoded.push_back(data[i]);
+				i += run;
+			}
+			else
+			{
+				// Gather literals until a worthy run begins
+				size_t start = i;
+				while (i < size && i - start < max_literals)
+				{
+					if (i + 2 < size && data[i] == data[i + 1] && data[i] == data[i + 2]) break;
+					++i;
+				}
+				encoded.push_back(static_cast<uint8_t>(i - start - 1));
+				encoded.insert(encoded.end(), data + start, data + i);
+			}
+		}
+
+		return encoded;
+	}
+
+	// Decodes data encoded with rle_encode into a buffer of known size, returns false if the data is malformed
+	inline bool rle_decode(const uint8_t* data, size_t size, uint8_t* decoded, size_t decoded_size)
+	{
+		size_t i = 0, o = 0;
+		while (i < size)
+		{
+			uint8_t control = data[i++];
+			if (control < 128)
+			{
+				size_t count = size_t(control) + 1;
+				if (i + count > size || o + count > decoded_size) return false;
+				std::copy(data + i, data + i + count, decoded + o);
+				i += count; o += count;
+			}
+			else
+			{
+				size_t count = size_t(control) - 125;
+				if (i >= size || o + count > decoded_size) return false;
+				std::fill_n(decoded + o, count, data[i++]);
+				o += count;
+			}
+		}
+
+		return o == decoded_size;
+	}
 }
\ No newline at end of file